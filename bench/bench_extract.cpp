@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Compares extracting a tree of small files entry by entry with
+// ArchiveEntry::extractDisk(), which sets up a disk writer per entry,
+// against extractAll() with the disk writer and with the io_uring backend.
+// Each target directory is benchmarked in turn, so passing one on tmpfs
+// and one on ext4 compares the file systems, e.g.
+//
+//   bench_extract 20000 1024 /dev/shm/moor_bench /var/tmp/moor_bench
+
+#include <moor/archive_reader.hpp>
+#include <moor/archive_writer.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+
+using namespace moor;
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*)
+{
+    return std::remove(path);
+}
+
+static void removeTree(const std::string& path)
+{
+    nftw(path.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static std::vector<unsigned char> makeArchive(size_t count, size_t size)
+{
+    std::vector<unsigned char> buf;
+    ArchiveWriter writer(buf, Format::PAX, Filter::None);
+    std::string content(size, 'x');
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        // 100 files per directory
+        writer.addFile("tree/" + std::to_string(i / 100) + "/file" + std::to_string(i), content);
+    }
+
+    writer.close();
+    return buf;
+}
+
+enum class Method
+{
+    ExtractDisk,
+    WriteDisk,
+    IoUring
+};
+
+static double timeExtract(const std::vector<unsigned char>& archive,
+                          const std::string& root,
+                          Method method)
+{
+    removeTree(root);
+    mkdir(root.c_str(), 0755);
+
+    ArchiveReader reader((std::vector<unsigned char>(archive)));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (method == Method::ExtractDisk)
+    {
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            it->extractDisk(root);
+        }
+    }
+    else
+    {
+        ExtractOptions options;
+        if (method == Method::IoUring)
+        {
+            options.backend = ExtractOptions::Backend::IoUring;
+        }
+
+        reader.extractAll(root, options);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    removeTree(root);
+
+    return elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+    const size_t count = argc > 1 ? static_cast<size_t>(std::atoi(argv[1])) : 20000;
+    const size_t size = argc > 2 ? static_cast<size_t>(std::atoi(argv[2])) : 1024;
+
+    std::vector<std::string> roots;
+    for (int i = 3; i < argc; ++i)
+    {
+        roots.push_back(argv[i]);
+    }
+
+    if (roots.empty())
+    {
+        roots.push_back("bench_extract_out");
+    }
+
+    const std::vector<unsigned char> archive = makeArchive(count, size);
+
+    std::cout << count << " files of " << size << " bytes\n";
+
+    for (const std::string& root : roots)
+    {
+        // Warm up the directory and inode caches
+        timeExtract(archive, root, Method::WriteDisk);
+
+        std::cout << root << '\n'
+                  << "  extractDisk:         " << count / timeExtract(archive, root, Method::ExtractDisk) << " files/s\n"
+                  << "  extractAll:          " << count / timeExtract(archive, root, Method::WriteDisk) << " files/s\n";
+
+        // Without io_uring the backend falls back to the disk writer, which
+        // would only measure extractAll again
+        std::cout << "  extractAll io_uring: ";
+        if (ExtractOptions::supports(ExtractOptions::Backend::IoUring))
+        {
+            std::cout << count / timeExtract(archive, root, Method::IoUring) << " files/s\n";
+        }
+        else
+        {
+            std::cout << "unavailable\n";
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Compares adding files through the old ifstream copy loop against
+// writeFileData(), which maps large files and reads small ones in aligned
+// blocks. Output goes to a discarding callback with Filter::None so the
+// ingest path dominates. Files are read warm from the page cache.
+
+#include <moor/archive_writer.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+using namespace moor;
+
+static ssize_t discard(ArchiveWriter&, void*, const void*, size_t size)
+{
+    return static_cast<ssize_t>(size);
+}
+
+static void makeFile(const std::string& path, size_t size)
+{
+    std::vector<char> block(1024 * 1024);
+    for (size_t i = 0; i < block.size(); ++i)
+    {
+        block[i] = static_cast<char>(i * 31);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    while (size > 0)
+    {
+        size_t n = std::min(size, block.size());
+        out.write(block.data(), static_cast<std::streamsize>(n));
+        size -= n;
+    }
+}
+
+// What writeFileData() used to do
+static void addFileLegacy(ArchiveWriter& writer, const std::string& path)
+{
+    std::vector<char> buffer(16 * 1024);
+
+    writer.addHeader(path);
+    std::ifstream file(path, std::ios::in);
+
+    while (file.good())
+    {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        writer.writeData(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+
+    writer.addFinish();
+}
+
+static double timeIngest(const std::vector<std::string>& paths, bool legacy, size_t blockSize)
+{
+    ArchiveWriter writer(discard, Format::PAX, Filter::None);
+    writer.setFileBlockSize(blockSize);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (const std::string& path : paths)
+    {
+        if (legacy)
+        {
+            addFileLegacy(writer, path);
+        }
+        else
+        {
+            writer.addFile(path);
+        }
+    }
+
+    writer.close();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+    const size_t largeMiB = argc > 1 ? static_cast<size_t>(std::atoi(argv[1])) : 256;
+    const size_t smallCount = argc > 2 ? static_cast<size_t>(std::atoi(argv[2])) : 2000;
+    const size_t smallSize = 64 * 1024;
+
+    std::vector<std::string> large(1, "bench_ingest_large.bin");
+    makeFile(large[0], largeMiB * 1024 * 1024);
+
+    std::vector<std::string> small;
+    for (size_t i = 0; i < smallCount; ++i)
+    {
+        small.push_back("bench_ingest_small_" + std::to_string(i) + ".bin");
+        makeFile(small.back(), smallSize);
+    }
+
+    const double largeBytes = static_cast<double>(largeMiB) * 1024 * 1024;
+    const double smallBytes = static_cast<double>(smallCount * smallSize);
+
+    // Warm the page cache so both paths see the same conditions
+    timeIngest(large, false, 1024 * 1024);
+    timeIngest(small, false, 1024 * 1024);
+
+    std::cout << "large file: " << largeMiB << " MiB\n"
+              << "  ifstream 16K:  " << largeBytes / timeIngest(large, true, 0) / 1e6 << " MB/s\n"
+              << "  mmap:          " << largeBytes / timeIngest(large, false, 1024 * 1024) / 1e6 << " MB/s\n"
+              << smallCount << " files of " << smallSize / 1024 << " KiB\n"
+              << "  ifstream 16K:  " << smallBytes / timeIngest(small, true, 0) / 1e6 << " MB/s\n";
+
+    for (size_t blockSize : { 64 * 1024, 256 * 1024, 1024 * 1024 })
+    {
+        std::string label = "  read " + std::to_string(blockSize / 1024) + "K:";
+        label.resize(17, ' ');
+        std::cout << label << smallBytes / timeIngest(small, false, blockSize) / 1e6 << " MB/s\n";
+    }
+
+    std::remove(large[0].c_str());
+    for (const std::string& path : small)
+    {
+        std::remove(path.c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Measures the per-open cost of reading a tiny in-memory tar.gz with every
+// format and filter registered, with a format hint, with a strict hint, and
+// by resetting a reader leased from a pool.
+
+#include <moor/archive_iterator.hpp>
+#include <moor/archive_pool.hpp>
+#include <moor/archive_reader.hpp>
+#include <moor/archive_writer.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+using namespace moor;
+
+static double timeOpens(std::vector<unsigned char>& archive,
+                        const FormatHint& hint,
+                        int iterations)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t total = 0;
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        ArchiveReader reader(archive.data(), archive.size(), hint);
+        std::vector<unsigned char> out;
+
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            it->extractData<std::vector<unsigned char>>(out);
+            total += out.size();
+        }
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    if (total == 0)
+    {
+        std::cerr << "Nothing was read\n";
+    }
+
+    std::chrono::nanoseconds elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    return static_cast<double>(elapsed.count()) / iterations;
+}
+
+static double timePooledOpens(std::vector<unsigned char>& archive,
+                              const FormatHint& hint,
+                              int iterations)
+{
+    ArchiveReaderPool pool(hint);
+    std::chrono::nanoseconds hotPath(0);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::chrono::steady_clock::time_point leaseStart = std::chrono::steady_clock::now();
+        ArchiveReaderPool::Lease reader = pool.lease();
+        reader->reset(archive.data(), archive.size());
+        std::vector<unsigned char> out;
+
+        for (auto it = reader->begin(); !it.isAtEnd(); ++it)
+        {
+            it->extractData<std::vector<unsigned char>>(out);
+        }
+
+        // The lease is returned, and the reader prepared, after timing
+        hotPath += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - leaseStart);
+    }
+
+    return static_cast<double>(hotPath.count()) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 20000;
+    std::vector<unsigned char> archive;
+
+    {
+        ArchiveWriter writer(archive, Format::PAX, Filter::Gzip);
+        writer.addFile("payload.json", std::string("{\"key\": \"value\", \"n\": 42}"));
+    }
+
+    const double all = timeOpens(archive, FormatHint(), iterations);
+    const double hinted = timeOpens(archive, FormatHint(Format::PAX, Filter::Gzip), iterations);
+    const double strict = timeOpens(archive, FormatHint(Format::PAX, Filter::Gzip, true), iterations);
+    const double pooled = timePooledOpens(archive, FormatHint(Format::PAX, Filter::Gzip, true), iterations);
+
+    std::cout << "archive size: " << archive.size() << " bytes, "
+              << iterations << " opens\n"
+              << "all formats:  " << all << " ns/open\n"
+              << "hinted:       " << hinted << " ns/open\n"
+              << "strict:       " << strict << " ns/open\n"
+              << "strict+pool:  " << pooled << " ns/open (excluding return to pool)\n";
+
+    return 0;
+}
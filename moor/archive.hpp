@@ -40,7 +40,7 @@ namespace moor
     class MOOR_API Archive
     {
     private:
-        const std::string m_archive_file_name;
+        std::string m_archive_file_name;
 
     protected:
         archive* m_archive;
@@ -64,14 +64,26 @@ namespace moor
 
         virtual ~Archive();
 
+        void setFilename(const std::string& filename_)
+        {
+            m_archive_file_name = filename_;
+        }
+
         MOOR_NORETURN
         void throwError(int errCode, bool closeBeforeThrow)
         {
             std::system_error err = systemError();
 
+            // The original error is the one reported, not one from closing
             if (errCode == ARCHIVE_FATAL && closeBeforeThrow)
             {
-                close();
+                try
+                {
+                    close();
+                }
+                catch (...)
+                {
+                }
             }
 
             throw err;
@@ -24,11 +24,20 @@
  */
 
 #include "archive_entry.hpp"
+#include "archive.hpp"
 #include "archive_write_disk.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <ostream>
 #include <system_error>
 
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 
 // Select which attributes we want to restore.
 const int moor::ArchiveEntry::s_defaultExtractFlags = ARCHIVE_EXTRACT_TIME
@@ -91,6 +100,156 @@ bool moor::ArchiveEntry::extractData(void* out, size_t outSize)
                            static_cast<size_t>(entrySize));
 }
 
+static bool sinkZeros(const moor::DataSink& sink,
+                      std::int64_t count,
+                      size_t chunkSize,
+                      std::vector<unsigned char>& zeros)
+{
+    zeros.resize(static_cast<size_t>(std::min<std::int64_t>(count, static_cast<std::int64_t>(chunkSize))));
+
+    while (count > 0)
+    {
+        size_t n = static_cast<size_t>(std::min<std::int64_t>(count, static_cast<std::int64_t>(zeros.size())));
+        if (!sink(zeros.data(), n))
+        {
+            return false;
+        }
+
+        count -= static_cast<std::int64_t>(n);
+    }
+
+    return true;
+}
+
+bool moor::ArchiveEntry::extractTo(const DataSink& sink, size_t chunkSize)
+{
+    assert(m_entry);
+
+    chunkSize = std::max<size_t>(chunkSize, 1);
+    std::vector<unsigned char> zeros; // Only allocated for sparse entries
+    std::int64_t position = 0;
+
+    for (const DataBlock& block : blocks())
+    {
+        if (block.offset > position
+            && !sinkZeros(sink, block.offset - position, chunkSize, zeros))
+        {
+            return false;
+        }
+
+        const unsigned char* p = static_cast<const unsigned char*>(block.data);
+        size_t remaining = block.size;
+
+        while (remaining > 0)
+        {
+            size_t n = std::min(remaining, chunkSize);
+            if (!sink(p, n))
+            {
+                return false;
+            }
+
+            p += n;
+            remaining -= n;
+        }
+
+        position = block.offset + static_cast<std::int64_t>(block.size);
+    }
+
+    return true;
+}
+
+bool moor::ArchiveEntry::extractTo(std::ostream& out, size_t chunkSize)
+{
+    return extractTo([&out](const void* data, size_t size) -> bool
+    {
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        return out.good();
+    },
+    chunkSize);
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+bool moor::ArchiveEntry::extractTo(int fd, size_t chunkSize)
+{
+    assert(m_entry);
+
+    chunkSize = std::max<size_t>(chunkSize, 1);
+    std::vector<unsigned char> zeros;
+    std::int64_t position = 0;
+    bool seekable = true;
+    bool endsInHole = false;
+
+    DataSink writeAll = [fd](const void* data, size_t size) -> bool
+    {
+        const char* p = static_cast<const char*>(data);
+
+        while (size > 0)
+        {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                throw std::system_error(std::error_code(errno, std::generic_category()));
+            }
+
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+
+        return true;
+    };
+
+    for (const DataBlock& block : blocks())
+    {
+        if (block.offset > position)
+        {
+            std::int64_t gap = block.offset - position;
+
+            if (seekable && ::lseek(fd, static_cast<off_t>(gap), SEEK_CUR) >= 0)
+            {
+                endsInHole = true;
+            }
+            else
+            {
+                // Pipes and sockets get the zeros written out
+                seekable = false;
+                sinkZeros(writeAll, gap, chunkSize, zeros);
+            }
+        }
+
+        for (size_t done = 0; done < block.size; )
+        {
+            size_t n = std::min(block.size - done, chunkSize);
+            writeAll(static_cast<const char*>(block.data) + done, n);
+            done += n;
+            endsInHole = false;
+        }
+
+        position = block.offset + static_cast<std::int64_t>(block.size);
+    }
+
+    if (endsInHole)
+    {
+        // Seeking past the end doesn't extend the file by itself
+        off_t end = ::lseek(fd, 0, SEEK_CUR);
+        struct stat st;
+
+        if (end < 0
+            || fstat(fd, &st) < 0
+            || (st.st_size < end && ftruncate(fd, end) < 0))
+        {
+            throw std::system_error(std::error_code(errno, std::generic_category()));
+        }
+    }
+
+    return true;
+}
+#endif
+
 int moor::ArchiveEntry::copyData(archive* ar, archive* aw)
 {
     while (true)
@@ -120,6 +279,43 @@ int moor::ArchiveEntry::copyData(archive* ar, archive* aw)
     return ARCHIVE_OK;
 }
 
+moor::DataBlockRange::iterator moor::DataBlockRange::begin()
+{
+    if (!m_started)
+    {
+        m_started = true;
+        advance();
+    }
+
+    return iterator(m_atEnd ? nullptr : this);
+}
+
+bool moor::DataBlockRange::advance()
+{
+    if (m_atEnd)
+    {
+        return false;
+    }
+
+    int r = archive_read_data_block(m_archive.raw(),
+                                    &m_block.data,
+                                    &m_block.size,
+                                    &m_block.offset);
+    if (r == ARCHIVE_EOF)
+    {
+        m_atEnd = true;
+        return false;
+    }
+
+    if (r != ARCHIVE_OK && r != ARCHIVE_WARN)
+    {
+        m_atEnd = true;
+        throw m_archive.systemError();
+    }
+
+    return true;
+}
+
 int moor::ArchiveEntry::nextHeader()
 {
     int r = archive_read_next_header(m_archive.raw(), &m_entry);
@@ -25,11 +25,14 @@
 #pragma once
 
 #include "moor_build_config.hpp"
+#include "data_block.hpp"
 #include "types.hpp"
 
 #include <archive_entry.h>
 
 #include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <limits>
 #include <string>
 #include <system_error>
@@ -40,14 +43,21 @@ namespace moor
 {
     class Archive;
     class ArchiveWriter;
+    class ParallelDiskWalker;
 
 
+    // Receives extracted data in order. Return false to stop extraction.
+    typedef std::function<bool(const void*, size_t)> DataSink;
+
     // Non-owning references to archive*, archive_entry*
     class MOOR_API ArchiveEntry
     {
         friend class ArchiveIterator;
         friend class ArchiveMatch;
         friend class ArchiveReader;
+        friend class ArchiveReaderImpl;
+        friend class ArchiveWriter;
+        friend class ParallelDiskWalker;
     protected:
         Archive& m_archive; // Archive the entry belongs to
         archive_entry* m_entry;
@@ -61,6 +71,7 @@ namespace moor
 
     private:
         static const int s_defaultExtractFlags;
+        static const size_t s_defaultChunkSize = 64 * 1024;
 
         bool extractDataImpl(unsigned char* ptr,
                              size_t size,
@@ -117,9 +128,34 @@ namespace moor
         }
 
         void skip();
+
+        // Iterate the entry data in place, without copying it out of
+        // libarchive. Use instead of, not together with, extractData.
+        DataBlockRange blocks()
+        {
+            return DataBlockRange(m_archive);
+        }
+
         bool extractData(std::vector<unsigned char>& out);
         bool extractData(void* out, size_t size);
 
+        // Stream the entry data in pieces of at most chunkSize bytes, with
+        // holes filled in as zeros. Works for entries of unknown size, and
+        // memory use doesn't depend on the entry size. Returns false if the
+        // sink stopped extraction or the stream failed.
+        bool extractTo(const DataSink& sink,
+                       size_t chunkSize = s_defaultChunkSize);
+        bool extractTo(std::ostream& out,
+                       size_t chunkSize = s_defaultChunkSize);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        // Write to a file descriptor at its current position. Holes are
+        // seeked over where the descriptor allows it. Throws on write
+        // errors.
+        bool extractTo(int fd,
+                       size_t chunkSize = s_defaultChunkSize);
+#endif
+
         // Like extract data but extract to the given filepath instead
         bool extractDisk(const std::string& rootPath);
 
@@ -110,6 +110,16 @@ namespace moor
             return archive_match_excluded(m_match, e.raw());
         }
 
+        // Invoke the callback for an entry excluded outside of a disk
+        // reader's own matching.
+        void notifyExcluded(ArchiveEntry& e)
+        {
+            if (m_cb)
+            {
+                (*m_cb->m_f)(e, m_cb->m_ud);
+            }
+        }
+
         int excludePattern(const char* pattern)
         {
             return archive_match_exclude_pattern(m_match, pattern);
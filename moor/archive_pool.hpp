@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include "archive_reader.hpp"
+#include "archive_writer.hpp"
+#include "types.hpp"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace moor
+{
+    namespace detail
+    {
+        // Only the caller can see whether finishing an archive failed, so
+        // a writer must be closed before it goes back to the pool. One
+        // returned still open is destroyed, ignoring any error.
+        inline bool returnable(const ArchiveReader&)
+        {
+            return true;
+        }
+
+        inline bool returnable(const ArchiveWriter& writer)
+        {
+            return !writer.isOpen();
+        }
+    }
+
+    // Thread-safe pool of readers or writers whose handles are already
+    // allocated and configured, so a request only has to reset() the
+    // leased object onto its input or output. Returned objects are
+    // prepared for their next use when the lease ends.
+    template <class T>
+    class ArchivePool
+    {
+    public:
+        typedef std::unique_ptr<T, std::function<void(T*)>> Lease;
+
+        // Leases may outlive the pool, in which case returned objects are
+        // simply destroyed.
+        Lease lease();
+
+        size_t idleCount() const
+        {
+            std::lock_guard<std::mutex> lock(m_state->m_mutex);
+            return m_state->m_idle.size();
+        }
+
+    protected:
+        ArchivePool(std::function<T*()> create, size_t maxIdle)
+            : m_state(std::make_shared<State>(create, maxIdle))
+        {
+        }
+
+    private:
+        struct State
+        {
+            const std::function<T*()> m_create;
+            const size_t m_maxIdle;
+            mutable std::mutex m_mutex;
+            std::vector<std::unique_ptr<T>> m_idle;
+
+            State(std::function<T*()> create, size_t maxIdle)
+                : m_create(create),
+                  m_maxIdle(maxIdle),
+                  m_mutex(),
+                  m_idle() { }
+
+            void release(T* obj);
+        };
+
+        std::shared_ptr<State> m_state;
+    };
+
+    class ArchiveReaderPool : public ArchivePool<ArchiveReader>
+    {
+    public:
+        explicit ArchiveReaderPool(const FormatHint& hint = FormatHint(),
+                                   size_t maxIdle = 64)
+            : ArchivePool<ArchiveReader>([hint]() { return new ArchiveReader(hint); },
+                                         maxIdle) { }
+    };
+
+    // close() a leased writer before the lease ends, which reports a
+    // failed final write. A writer returned with its archive still open
+    // isn't reused.
+    class ArchiveWriterPool : public ArchivePool<ArchiveWriter>
+    {
+    public:
+        ArchiveWriterPool(const Format format,
+                          const Filter filter,
+                          size_t maxIdle = 64)
+            : ArchivePool<ArchiveWriter>([format, filter]() { return new ArchiveWriter(format, filter); },
+                                         maxIdle) { }
+    };
+
+    template <class T>
+    typename ArchivePool<T>::Lease ArchivePool<T>::lease()
+    {
+        std::unique_ptr<T> obj;
+
+        {
+            std::lock_guard<std::mutex> lock(m_state->m_mutex);
+            if (!m_state->m_idle.empty())
+            {
+                obj = std::move(m_state->m_idle.back());
+                m_state->m_idle.pop_back();
+            }
+        }
+
+        if (!obj)
+        {
+            obj.reset(m_state->m_create());
+        }
+
+        std::weak_ptr<State> weakState(m_state);
+        return Lease(obj.release(), [weakState](T* o)
+        {
+            std::shared_ptr<State> state = weakState.lock();
+            if (state)
+            {
+                state->release(o);
+            }
+            else
+            {
+                delete o;
+            }
+        });
+    }
+
+    template <class T>
+    void ArchivePool<T>::State::release(T* o)
+    {
+        std::unique_ptr<T> obj(o);
+        if (!detail::returnable(*obj))
+        {
+            return;
+        }
+
+        // Do the expensive part of the next reset now, outside the lock.
+        // Only setting up the new handle can fail here, in which case the
+        // object is dropped and the next lease makes another.
+        try
+        {
+            obj->prepare();
+        }
+        catch (...)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_idle.size() < m_maxIdle)
+        {
+            m_idle.push_back(std::move(obj));
+        }
+    }
+}
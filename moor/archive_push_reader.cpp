@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "archive_push_reader.hpp"
+#include "archive_iterator.hpp"
+#include "archive_reader.hpp"
+
+#include <archive.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #define MOOR_HAVE_UCONTEXT 1
+  #include <ucontext.h>
+#endif
+
+
+namespace
+{
+    // Thrown on the parser stack to unwind it when the reader is destroyed
+    // part way through an archive.
+    struct Cancelled
+    {
+    };
+}
+
+struct moor::ArchivePushReader::Coroutine
+{
+#ifdef MOOR_HAVE_UCONTEXT
+    ucontext_t m_caller;
+    ucontext_t m_callee;
+#endif
+    std::unique_ptr<char[]> m_stack;
+
+    explicit Coroutine(size_t stackSize)
+        : m_stack(new char[stackSize])
+    {
+    }
+
+    void resume()
+    {
+#ifdef MOOR_HAVE_UCONTEXT
+        swapcontext(&m_caller, &m_callee);
+#endif
+    }
+
+    void suspend()
+    {
+#ifdef MOOR_HAVE_UCONTEXT
+        swapcontext(&m_callee, &m_caller);
+#endif
+    }
+};
+
+moor::ArchivePushReader::ArchivePushReader(size_t stackSize)
+    : m_coroutine(new Coroutine(stackSize)),
+      m_input(),
+      m_current(),
+      m_buffered(0),
+      m_finished(false),
+      m_event(Event::NeedInput),
+      m_started(false),
+      m_done(false),
+      m_cancel(false),
+      m_skipData(false),
+      m_error(),
+      m_entry(nullptr),
+      m_block(nullptr),
+      m_blockSize(0),
+      m_blockOffset(0)
+{
+#ifdef MOOR_HAVE_UCONTEXT
+    Coroutine& co = *m_coroutine;
+
+    if (getcontext(&co.m_callee) < 0)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()));
+    }
+
+    co.m_callee.uc_stack.ss_sp = co.m_stack.get();
+    co.m_callee.uc_stack.ss_size = stackSize;
+    co.m_callee.uc_link = &co.m_caller;
+
+    // makecontext only passes int arguments, so the pointer is split in two
+    std::uintptr_t p = reinterpret_cast<std::uintptr_t>(this);
+    makecontext(&co.m_callee,
+                reinterpret_cast<void (*)()>(&ArchivePushReader::entryPoint),
+                2,
+                static_cast<unsigned int>(p >> 16 >> 16),
+                static_cast<unsigned int>(p & 0xffffffffu));
+#else
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+#endif
+}
+
+moor::ArchivePushReader::~ArchivePushReader()
+{
+    if (m_started && !m_done)
+    {
+        // Let the parser stack unwind so the archive is closed
+        m_cancel = true;
+        m_coroutine->resume();
+    }
+}
+
+void moor::ArchivePushReader::feed(const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    feed(std::vector<unsigned char>(p, p + size));
+}
+
+void moor::ArchivePushReader::feed(std::vector<unsigned char>&& chunk)
+{
+    // An empty read means EOF to libarchive
+    if (chunk.empty())
+    {
+        return;
+    }
+
+    m_buffered += chunk.size();
+    m_input.push_back(std::move(chunk));
+}
+
+void moor::ArchivePushReader::finish()
+{
+    m_finished = true;
+}
+
+moor::ArchivePushReader::Event moor::ArchivePushReader::next()
+{
+    if (!m_done)
+    {
+        m_started = true;
+        m_block = nullptr;
+        m_blockSize = 0;
+        m_coroutine->resume();
+    }
+
+    if (m_error)
+    {
+        std::exception_ptr err = m_error;
+        m_error = std::exception_ptr();
+        std::rethrow_exception(err);
+    }
+
+    return m_done ? Event::EndOfArchive : m_event;
+}
+
+void moor::ArchivePushReader::entryPoint(unsigned int hi, unsigned int lo)
+{
+    std::uintptr_t p = (static_cast<std::uintptr_t>(hi) << 16 << 16) | lo;
+    ArchivePushReader* self = reinterpret_cast<ArchivePushReader*>(p);
+
+    self->run();
+    self->m_done = true;
+    self->m_entry = nullptr;
+
+    // Returning switches back to the caller through uc_link
+}
+
+void moor::ArchivePushReader::yield(Event e)
+{
+    m_event = e;
+    m_coroutine->suspend();
+
+    if (m_cancel)
+    {
+        throw Cancelled();
+    }
+}
+
+ssize_t moor::ArchivePushReader::readInput(const void** buffer)
+{
+    // libarchive is done with the chunk it was given last time
+    m_current.clear();
+
+    while (m_input.empty())
+    {
+        if (m_finished)
+        {
+            return 0;
+        }
+
+        m_event = Event::NeedInput;
+        m_coroutine->suspend();
+
+        if (m_cancel)
+        {
+            return ARCHIVE_FATAL;
+        }
+    }
+
+    m_current.swap(m_input.front());
+    m_input.pop_front();
+    m_buffered -= m_current.size();
+
+    *buffer = m_current.data();
+    return static_cast<ssize_t>(m_current.size());
+}
+
+void moor::ArchivePushReader::run()
+{
+    try
+    {
+        ArchiveReader reader(
+            [this](ArchiveReaderImpl&, void*, const void** buffer) -> ssize_t
+        {
+            return readInput(buffer);
+        });
+
+        for (ArchiveIterator it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            m_entry = &*it;
+            m_skipData = false;
+            yield(Event::Header);
+
+            while (!m_skipData)
+            {
+                const void* buf;
+                size_t size;
+                std::int64_t offset;
+
+                int r = archive_read_data_block(reader.raw(), &buf, &size, &offset);
+                if (r == ARCHIVE_EOF)
+                {
+                    break;
+                }
+
+                if (r != ARCHIVE_OK && r != ARCHIVE_WARN)
+                {
+                    throw reader.systemError();
+                }
+
+                m_block = buf;
+                m_blockSize = size;
+                m_blockOffset = offset;
+                yield(Event::Data);
+            }
+
+            yield(Event::EndOfEntry);
+            m_entry = nullptr;
+        }
+    }
+    catch (const Cancelled&)
+    {
+    }
+    catch (...)
+    {
+        if (!m_cancel)
+        {
+            m_error = std::current_exception();
+        }
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include "archive_entry.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <vector>
+
+
+namespace moor
+{
+    class ArchiveReaderImpl;
+
+    // Incremental reader for event loops. Input is pushed in as it arrives
+    // and next() parses as far as the buffered bytes allow, returning
+    // NeedInput instead of blocking when it runs dry.
+    //
+    // libarchive only knows how to pull, so the parser runs on its own
+    // small stack and is suspended whenever its read callback finds the
+    // input queue empty. Everything still happens on the calling thread.
+    class MOOR_API ArchivePushReader
+    {
+    public:
+        enum class Event
+        {
+            NeedInput,   // Call feed() or finish(), then next() again
+            Header,      // entry() is the new entry
+            Data,        // data(), dataSize() and dataOffset() are valid
+            EndOfEntry,  // All data for entry() has been delivered
+            EndOfArchive
+        };
+
+        explicit ArchivePushReader(size_t stackSize = 1024 * 1024);
+        ~ArchivePushReader();
+
+        // Queue more input. The pointer version copies the bytes.
+        void feed(const void* data, size_t size);
+        void feed(std::vector<unsigned char>&& chunk);
+
+        // No more input will be fed. Parsing continues until the buffered
+        // input is used up.
+        void finish();
+
+        // Resume parsing until the next event. Parse errors are thrown as
+        // std::system_error, after which the reader is at EndOfArchive.
+        Event next();
+
+        // Skip the rest of the current entry's data. The next call to
+        // next() reports EndOfEntry without delivering more blocks.
+        void skipData()
+        {
+            m_skipData = true;
+        }
+
+        // Valid from Header until the following EndOfEntry
+        ArchiveEntry& entry()
+        {
+            return *m_entry;
+        }
+
+        // Valid after a Data event until the following call to next().
+        // Blocks point into libarchive's buffers and are not copied.
+        const void* data() const
+        {
+            return m_block;
+        }
+
+        size_t dataSize() const
+        {
+            return m_blockSize;
+        }
+
+        std::int64_t dataOffset() const
+        {
+            return m_blockOffset;
+        }
+
+        // Bytes fed but not yet handed to the parser
+        size_t bufferedInput() const
+        {
+            return m_buffered;
+        }
+
+    private:
+        struct Coroutine;
+
+        ArchivePushReader(const ArchivePushReader&);
+        ArchivePushReader& operator=(const ArchivePushReader&);
+
+        static void entryPoint(unsigned int hi, unsigned int lo);
+        void run();
+        void yield(Event e);
+        ssize_t readInput(const void** buffer);
+
+        std::unique_ptr<Coroutine> m_coroutine;
+
+        std::deque<std::vector<unsigned char>> m_input;
+        std::vector<unsigned char> m_current; // Chunk currently lent to libarchive
+        size_t m_buffered;
+        bool m_finished;
+
+        Event m_event;
+        bool m_started;
+        bool m_done;
+        bool m_cancel;
+        bool m_skipData;
+        std::exception_ptr m_error;
+
+        ArchiveEntry* m_entry;
+        const void* m_block;
+        size_t m_blockSize;
+        std::int64_t m_blockOffset;
+    };
+}
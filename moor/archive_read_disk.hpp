@@ -28,9 +28,12 @@
 
 #include "archive_match.hpp"
 #include "archive_reader.hpp"
+#include "user_group_cache.hpp"
 
 #include <archive.h>
 
+#include <memory>
+
 
 namespace moor
 {
@@ -38,7 +41,8 @@ namespace moor
     {
     public:
         ArchiveReadDisk()
-            : ArchiveReader(archive_read_disk_new())
+            : ArchiveReader(archive_read_disk_new()),
+              m_userGroupCache()
         {
 #if !defined(_WIN32) || defined(__CYGWIN__)
             int ec = archive_read_disk_set_standard_lookup(m_archive);
@@ -50,8 +54,56 @@ namespace moor
 #endif
         }
 
+        // Resolve user and group names through a cache that may be shared
+        // with other readers.
+        explicit ArchiveReadDisk(std::shared_ptr<UserGroupCache> cache)
+            : ArchiveReader(archive_read_disk_new()),
+              m_userGroupCache()
+        {
+            setUserGroupCache(std::move(cache));
+        }
+
         virtual ~ArchiveReadDisk() override;
 
+        // Passing null goes back to uncached lookups.
+        void setUserGroupCache(std::shared_ptr<UserGroupCache> cache)
+        {
+            if (!cache)
+            {
+                if (archive_read_disk_set_standard_lookup(m_archive) != ARCHIVE_OK)
+                {
+                    throw std::bad_alloc();
+                }
+
+                m_userGroupCache.reset();
+                return;
+            }
+
+            int ec = archive_read_disk_set_uname_lookup(m_archive,
+                                                        cache.get(),
+                                                        UserGroupCache::unameCallback,
+                                                        nullptr);
+            if (ec == ARCHIVE_OK)
+            {
+                ec = archive_read_disk_set_gname_lookup(m_archive,
+                                                        cache.get(),
+                                                        UserGroupCache::gnameCallback,
+                                                        nullptr);
+            }
+
+            if (ec != ARCHIVE_OK)
+            {
+                throw std::bad_alloc();
+            }
+
+            m_userGroupCache = std::move(cache);
+        }
+
+        const std::shared_ptr<UserGroupCache>& userGroupCache() const
+        {
+            return m_userGroupCache;
+        }
+
         virtual void close() override
         {
             if (m_archive)
@@ -104,6 +156,10 @@ namespace moor
                                                      fd,
                                                      statBuf);
         }
+
+    private:
+        // Kept alive for the lookup callbacks
+        std::shared_ptr<UserGroupCache> m_userGroupCache;
     };
 }
 
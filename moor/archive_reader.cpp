@@ -23,11 +23,36 @@
  */
 
 #include "archive_reader.hpp"
+#include "archive_match.hpp"
+#include "archive_write_disk.hpp"
+#include "file_range.hpp"
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <stdexcept>
 #include <system_error>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <fcntl.h>
+  #include <unistd.h>
+#else
+  #include <sys/utime.h>
+#endif
+
+#ifdef MOOR_HAVE_IO_URING
+  #include "uring_file_writer.hpp"
+#endif
 
 using namespace moor;
 
@@ -38,35 +63,352 @@ const int ArchiveReaderImpl::s_defaultExtractFlags = ARCHIVE_EXTRACT_TIME
                                                    | ARCHIVE_EXTRACT_ACL
                                                    | ARCHIVE_EXTRACT_FFLAGS;
 
-ArchiveReaderImpl::ArchiveReaderImpl(const std::string& archive_file_name_)
+ssize_t ArchiveReaderImpl::readCallbackWrapper(archive*, void* ud, const void** buffer)
+{
+    ReaderCallbackData* rcb = reinterpret_cast<ReaderCallbackData*>(ud);
+    return rcb->m_read(rcb->m_reader, rcb->m_userData, buffer);
+}
+
+std::int64_t ArchiveReaderImpl::skipCallbackWrapper(archive*, void* ud, std::int64_t request)
+{
+    ReaderCallbackData* rcb = reinterpret_cast<ReaderCallbackData*>(ud);
+    return rcb->m_skip(rcb->m_reader, rcb->m_userData, request);
+}
+
+std::int64_t ArchiveReaderImpl::seekCallbackWrapper(archive*,
+                                                    void* ud,
+                                                    std::int64_t offset,
+                                                    int whence)
+{
+    ReaderCallbackData* rcb = reinterpret_cast<ReaderCallbackData*>(ud);
+    return rcb->m_seek(rcb->m_reader, rcb->m_userData, offset, whence);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(const std::string& archive_file_name_,
+                                     const FormatHint& hint_)
     : Archive(archive_read_new(), archive_file_name_),
-      m_in_buffer()
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
 {
     init();
     checkError(openFilename(cfilename()), true);
 }
 
-ArchiveReaderImpl::ArchiveReaderImpl(void* in_buffer_, const size_t size_)
+ArchiveReaderImpl::ArchiveReaderImpl(void* in_buffer_,
+                                     const size_t size_,
+                                     const FormatHint& hint_)
     : Archive(archive_read_new()),
-      m_in_buffer()
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
 {
     init();
     checkError(openMemory(in_buffer_, size_), true);
 }
 
-ArchiveReaderImpl::ArchiveReaderImpl(std::vector<unsigned char>&& in_buffer_)
+ArchiveReaderImpl::ArchiveReaderImpl(std::vector<unsigned char>&& in_buffer_,
+                                     const FormatHint& hint_)
     : Archive(archive_read_new()),
-      m_in_buffer(std::move(in_buffer_))
+      m_formatHint(hint_),
+      m_in_buffer(std::move(in_buffer_)),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
 {
     init();
     int ec = openMemory(m_in_buffer.data(), m_in_buffer.size());
     checkError(ec, true);
 }
 
+ArchiveReaderImpl::ArchiveReaderImpl(MappedFile&& mapped_file_,
+                                     const FormatHint& hint_)
+    : Archive(archive_read_new(), mapped_file_.path()),
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
+{
+    std::shared_ptr<const MappedFile> mapped = std::make_shared<MappedFile>(std::move(mapped_file_));
+    m_sharedBuffer = mapped;
+
+    init();
+    int ec = openMemory(mapped->data(), mapped->size());
+    checkError(ec, true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(std::shared_ptr<const MappedFile> mapped_file_,
+                                     const FormatHint& hint_)
+    : Archive(archive_read_new(), mapped_file_->path()),
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(mapped_file_),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+    int ec = openMemory(mapped_file_->data(), mapped_file_->size());
+    checkError(ec, true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(std::shared_ptr<const std::vector<unsigned char>> in_buffer_,
+                                     const FormatHint& hint_)
+    : Archive(archive_read_new()),
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(in_buffer_),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+    int ec = openMemory(in_buffer_->data(), in_buffer_->size());
+    checkError(ec, true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(std::shared_ptr<const void> owner_,
+                                     const void* in_buffer_,
+                                     const size_t size_,
+                                     const FormatHint& hint_)
+    : Archive(archive_read_new()),
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(owner_),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+    int ec = openMemory(in_buffer_, size_);
+    checkError(ec, true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(ReadCallback readCB,
+                                     SkipCallback skipCB,
+                                     SeekCallback seekCB,
+                                     void* userData)
+    : Archive(archive_read_new()),
+      m_formatHint(),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(ReaderCallbackData::create(readCB,
+                                                skipCB,
+                                                seekCB,
+                                                *this,
+                                                userData)),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+    checkError(openCallbacks(), true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(ReadCallback readCB, void* userData)
+    : Archive(archive_read_new()),
+      m_formatHint(),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(ReaderCallbackData::create(readCB,
+                                                SkipCallback(),
+                                                SeekCallback(),
+                                                *this,
+                                                userData)),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+    checkError(openCallbacks(), true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(const std::string& archive_file_name_,
+                                     const ReadAheadOptions& readAhead)
+    : Archive(archive_read_new(), archive_file_name_),
+      m_formatHint(),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(true)
+{
+    init();
+
+    try
+    {
+        m_readAhead.reset(new ReadAheadFile(archive_file_name_, readAhead));
+    }
+    catch (...)
+    {
+        close();
+        throw;
+    }
+
+    ReadAheadFile* file = m_readAhead.get();
+    m_callbackData = ReaderCallbackData::create(
+        [file](ArchiveReaderImpl& reader, void*, const void** buffer) -> ssize_t
+        {
+            ssize_t n = file->read(buffer);
+            if (n < 0)
+            {
+                archive_set_error(reader.raw(), file->errorNumber(), "Read error");
+                return ARCHIVE_FATAL;
+            }
+
+            return n;
+        },
+        SkipCallback(),
+        SeekCallback(),
+        *this,
+        nullptr);
+
+    checkError(openCallbacks(), true);
+}
+
+ArchiveReaderImpl::ArchiveReaderImpl(const FormatHint& hint_)
+    : Archive(archive_read_new()),
+      m_formatHint(hint_),
+      m_in_buffer(),
+      m_sharedBuffer(),
+      m_callbackData(),
+      m_readAhead(),
+      m_opened(false)
+{
+    init();
+}
+
+void ArchiveReaderImpl::prepare()
+{
+    close();
+
+    std::vector<unsigned char>().swap(m_in_buffer);
+    m_sharedBuffer.reset();
+    m_callbackData.reset();
+    setFilename(std::string());
+
+    m_archive = archive_read_new();
+    if (!m_archive)
+    {
+        throw std::bad_alloc();
+    }
+
+    m_opened = false;
+    init();
+}
+
+void ArchiveReaderImpl::prepareForOpen()
+{
+    // libarchive handles can't be reopened once used
+    if (m_opened || !m_archive)
+    {
+        prepare();
+    }
+
+    m_opened = true;
+}
+
+void ArchiveReaderImpl::reset(const std::string& archive_file_name_)
+{
+    prepareForOpen();
+    setFilename(archive_file_name_);
+    checkError(openFilename(cfilename()), true);
+}
+
+void ArchiveReaderImpl::reset(void* in_buffer_, const size_t size_)
+{
+    prepareForOpen();
+    checkError(openMemory(in_buffer_, size_), true);
+}
+
+void ArchiveReaderImpl::reset(std::vector<unsigned char>&& in_buffer_)
+{
+    prepareForOpen();
+    m_in_buffer = std::move(in_buffer_);
+    checkError(openMemory(m_in_buffer.data(), m_in_buffer.size()), true);
+}
+
+void ArchiveReaderImpl::reset(std::shared_ptr<const MappedFile> mapped_file_)
+{
+    prepareForOpen();
+    setFilename(mapped_file_->path());
+    m_sharedBuffer = mapped_file_;
+    checkError(openMemory(mapped_file_->data(), mapped_file_->size()), true);
+}
+
+void ArchiveReaderImpl::reset(std::shared_ptr<const std::vector<unsigned char>> in_buffer_)
+{
+    prepareForOpen();
+    m_sharedBuffer = in_buffer_;
+    checkError(openMemory(in_buffer_->data(), in_buffer_->size()), true);
+}
+
+void ArchiveReaderImpl::reset(std::shared_ptr<const void> owner_,
+                              const void* in_buffer_,
+                              const size_t size_)
+{
+    prepareForOpen();
+    m_sharedBuffer = owner_;
+    checkError(openMemory(in_buffer_, size_), true);
+}
+
 void ArchiveReaderImpl::init()
 {
-    checkError(archive_read_support_format_all(m_archive), true);
-    checkError(archive_read_support_filter_all(m_archive), true);
+    const std::vector<Format>& formats = m_formatHint.formats;
+    const std::vector<Filter>& filters = m_formatHint.filters;
+
+    if (m_formatHint.strict)
+    {
+        if (formats.size() != 1)
+        {
+            close();
+            throw std::invalid_argument("Strict format hint needs exactly one format");
+        }
+
+        // Neither the format nor the filters bid, they are just used
+        checkError(archive_read_set_format(m_archive, static_cast<int>(formats[0])), true);
+
+        for (size_t i = 0; i < filters.size(); ++i)
+        {
+            checkError(archive_read_append_filter(m_archive, static_cast<int>(filters[i])), true);
+        }
+
+        return;
+    }
+
+    if (formats.empty())
+    {
+        checkError(archive_read_support_format_all(m_archive), true);
+    }
+    else
+    {
+        for (size_t i = 0; i < formats.size(); ++i)
+        {
+            checkError(archive_read_support_format_by_code(m_archive, static_cast<int>(formats[i])), true);
+        }
+    }
+
+    if (filters.empty())
+    {
+        checkError(archive_read_support_filter_all(m_archive), true);
+    }
+    else
+    {
+        for (size_t i = 0; i < filters.size(); ++i)
+        {
+            if (filters[i] != Filter::None)
+            {
+                checkError(archive_read_support_filter_by_code(m_archive, static_cast<int>(filters[i])), true);
+            }
+        }
+    }
 }
 
 int ArchiveReaderImpl::openFilename(const char* path, size_t blockSize)
@@ -74,16 +416,780 @@ int ArchiveReaderImpl::openFilename(const char* path, size_t blockSize)
     return archive_read_open_filename(m_archive, path, blockSize);
 }
 
-int ArchiveReaderImpl::openMemory(void* buffer, size_t bufferSize)
+int ArchiveReaderImpl::openMemory(const void* buffer, size_t bufferSize)
 {
     return archive_read_open_memory(m_archive, buffer, bufferSize);
 }
 
+int ArchiveReaderImpl::openCallbacks()
+{
+    if (m_callbackData->m_seek)
+    {
+        int r = archive_read_set_seek_callback(m_archive, ArchiveReaderImpl::seekCallbackWrapper);
+        if (r != ARCHIVE_OK)
+        {
+            return r;
+        }
+    }
+
+    return archive_read_open2(m_archive,
+                              m_callbackData.get(),
+                              nullptr,
+                              ArchiveReaderImpl::readCallbackWrapper,
+                              m_callbackData->m_skip ? ArchiveReaderImpl::skipCallbackWrapper : nullptr,
+                              nullptr);
+}
+
 ArchiveIterator ArchiveReaderImpl::begin()
 {
     return ArchiveIterator(*this);
 }
 
+namespace
+{
+    // Directories known to exist, so each entry's parents are only
+    // created or checked the first time they are seen
+    class ParentDirCache
+    {
+    public:
+        explicit ParentDirCache(bool followSymlinks)
+            : m_dirs(),
+              m_followSymlinks(followSymlinks) { }
+
+        void add(std::string dir)
+        {
+            while (dir.size() > 1 && dir[dir.size() - 1] == '/')
+            {
+                dir.erase(dir.size() - 1);
+            }
+
+            m_dirs.insert(dir);
+        }
+
+        // Forget path and everything under it, when it is replaced by
+        // something that may not be a directory
+        void invalidate(const std::string& path)
+        {
+            auto it = m_dirs.lower_bound(path);
+            while (it != m_dirs.end()
+                   && it->compare(0, path.size(), path) == 0
+                   && (it->size() == path.size() || (*it)[path.size()] == '/'))
+            {
+                it = m_dirs.erase(it);
+            }
+        }
+
+        // Create the missing parents of path. Returns false if one can't
+        // be made, which is left for the disk writer to report.
+        bool createParents(const std::string& path)
+        {
+            // A directory entry's own trailing slash doesn't make it a
+            // parent. Creating it here would leave libarchive treating it
+            // as existing, which sets its time before the files go in.
+            std::string::size_type end = path.find_last_not_of('/');
+            if (end == std::string::npos)
+            {
+                return true;
+            }
+
+            std::string::size_type slash = path.find_last_of('/', end);
+            if (slash == std::string::npos || slash == 0)
+            {
+                return true;
+            }
+
+            return createDir(path.substr(0, slash));
+        }
+
+    private:
+        bool createDir(const std::string& dir)
+        {
+            if (m_dirs.count(dir) != 0)
+            {
+                return true;
+            }
+
+            if (!createParents(dir))
+            {
+                return false;
+            }
+
+            if (::mkdir(dir.c_str(), 0777) != 0)
+            {
+                if (errno != EEXIST)
+                {
+                    return false;
+                }
+
+                struct stat st;
+                if (::lstat(dir.c_str(), &st) != 0)
+                {
+                    return false;
+                }
+
+                // A link to a directory is only followed when the flags
+                // allow it
+                if (S_ISLNK(st.st_mode)
+                    && (!m_followSymlinks || ::stat(dir.c_str(), &st) != 0))
+                {
+                    return false;
+                }
+
+                if (!S_ISDIR(st.st_mode))
+                {
+                    return false;
+                }
+            }
+
+            m_dirs.insert(dir);
+            return true;
+        }
+
+        std::set<std::string> m_dirs;
+        const bool m_followSymlinks;
+    };
+
+    bool hasDotDot(const std::string& path)
+    {
+        std::string::size_type pos = 0;
+        while ((pos = path.find("..", pos)) != std::string::npos)
+        {
+            const bool start = pos == 0 || path[pos - 1] == '/';
+            const bool end = pos + 2 == path.size() || path[pos + 2] == '/';
+            if (start && end)
+            {
+                return true;
+            }
+
+            pos += 2;
+        }
+
+        return false;
+    }
+}
+
+bool ExtractOptions::supports(Backend backend)
+{
+    if (backend != Backend::IoUring)
+    {
+        return true;
+    }
+
+#ifdef MOOR_HAVE_IO_URING
+    return UringFileWriter::create(ExtractOptions().queueDepth) != nullptr;
+#else
+    return false;
+#endif
+}
+
+// Writes entries under a root directory through one disk writer.
+// Regular files in an uncompressed tar file are copied out of it by the
+// kernel instead, since their data is stored there as it is.
+// Directory times are set by close(), after every file is in place.
+// libarchive defers them for directories it creates, but sets them
+// straight away on ones that already exist, where replacing files would
+// then change them again.
+class ArchiveReaderImpl::Extractor
+{
+public:
+    Extractor(const std::string& rootPath, const ExtractOptions& options)
+        // Parents are made here instead of by libarchive, which would
+        // check them again for every entry
+        : m_flags(options.flags | ARCHIVE_EXTRACT_NO_AUTODIR),
+          m_disk(m_flags),
+          m_dirs((options.flags & ARCHIVE_EXTRACT_SECURE_SYMLINKS) == 0),
+          m_dirTimes(),
+          m_secureDotDot((options.flags & ARCHIVE_EXTRACT_SECURE_NODOTDOT) != 0),
+          m_prefix(rootPath + '/')
+#if !defined(_WIN32) || defined(__CYGWIN__)
+          , m_sourceChecked(false),
+          m_sourceFd(-1),
+          m_umask(0)
+#endif
+#ifdef MOOR_HAVE_IO_URING
+          , m_uring(),
+          m_smallFileSize(options.smallFileSize)
+#endif
+    {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        // The disk writer reads it the same way
+        m_umask = ::umask(0);
+        ::umask(m_umask);
+#endif
+
+#ifdef MOOR_HAVE_IO_URING
+        if (options.backend == ExtractOptions::Backend::IoUring)
+        {
+            m_uring = UringFileWriter::create(options.queueDepth);
+        }
+#endif
+    }
+
+    ~Extractor()
+    {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        if (m_sourceFd >= 0)
+        {
+            ::close(m_sourceFd);
+        }
+#endif
+    }
+
+    void extract(ArchiveReaderImpl& reader, ArchiveEntry& entry)
+    {
+        const std::string name(entry.pathname());
+        const std::string fullPath(m_prefix + name);
+        const bool isDir = entry.filetype() == FileType::Directory;
+
+        entry.set_pathname(fullPath.c_str());
+
+        if (const char* link = entry.hardlink())
+        {
+            entry.set_hardlink((m_prefix + link).c_str());
+        }
+
+        // Rejected paths are left for the disk writer to refuse before
+        // anything is created for them
+        bool parentsReady = false;
+        if (!m_secureDotDot || !hasDotDot(name))
+        {
+            parentsReady = m_dirs.createParents(fullPath);
+        }
+
+        if (!isDir)
+        {
+            m_dirs.invalidate(fullPath);
+        }
+
+#ifdef MOOR_HAVE_IO_URING
+        if (m_uring && parentsReady && batchable(entry))
+        {
+            queue(reader, entry, fullPath);
+            return;
+        }
+
+        // Everything else is written after the batch, in archive order
+        flushBatch();
+#endif
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        if (parentsReady
+            && sourceFd(reader) >= 0
+            && simpleFile(entry)
+            && entry.size() > 0
+            && archive_entry_sparse_count(entry.raw()) == 0
+            && copyOut(reader, entry, fullPath))
+        {
+            return;
+        }
+#else
+        (void) parentsReady;
+#endif
+
+        const bool deferTimes = isDir
+                             && (m_flags & ARCHIVE_EXTRACT_TIME) != 0
+                             && entry.mtime_is_set();
+        if (deferTimes)
+        {
+            archive_write_disk_set_options(m_disk.raw(), m_flags & ~ARCHIVE_EXTRACT_TIME);
+        }
+
+        int r = m_disk.writeHeader(entry.raw());
+
+        if (deferTimes)
+        {
+            archive_write_disk_set_options(m_disk.raw(), m_flags);
+        }
+
+        m_disk.checkError(r);
+
+        if (isDir)
+        {
+            m_dirs.add(fullPath);
+        }
+
+        if (deferTimes)
+        {
+            DirTimes times;
+            times.path = fullPath;
+            times.atime = entry.atime_is_set() ? entry.atime() : entry.mtime();
+            times.atimeNsec = entry.atime_is_set() ? entry.atime_nsec() : entry.mtime_nsec();
+            times.mtime = entry.mtime();
+            times.mtimeNsec = entry.mtime_nsec();
+            m_dirTimes.push_back(times);
+        }
+
+        if (entry.size_is_set() && entry.size() > 0)
+        {
+            m_disk.checkError(ArchiveEntry::copyData(reader.raw(), m_disk.raw()));
+        }
+
+        m_disk.checkError(archive_write_finish_entry(m_disk.raw()));
+    }
+
+    // Applies the deferred directory permissions and times. Like the disk
+    // writer, failing to set a time isn't an error.
+    void close()
+    {
+#ifdef MOOR_HAVE_IO_URING
+        flushBatch();
+#endif
+
+        m_disk.checkError(archive_write_close(m_disk.raw()));
+
+        for (const DirTimes& dir : m_dirTimes)
+        {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+            struct timespec times[2];
+            times[0].tv_sec = dir.atime;
+            times[0].tv_nsec = dir.atimeNsec;
+            times[1].tv_sec = dir.mtime;
+            times[1].tv_nsec = dir.mtimeNsec;
+            ::utimensat(AT_FDCWD, dir.path.c_str(), times, 0);
+#else
+            struct _utimbuf times;
+            times.actime = dir.atime;
+            times.modtime = dir.mtime;
+            ::_utime(dir.path.c_str(), &times);
+#endif
+        }
+
+        m_dirTimes.clear();
+    }
+
+private:
+    struct DirTimes
+    {
+        std::string path;
+        time_t atime;
+        long atimeNsec;
+        time_t mtime;
+        long mtimeNsec;
+    };
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // Regular files with nothing for the disk writer to restore beyond
+    // the mode and times
+    bool simpleFile(ArchiveEntry& entry) const
+    {
+        unsigned long fflagsSet = 0;
+        unsigned long fflagsClear = 0;
+        entry.fflags(&fflagsSet, &fflagsClear);
+
+        return entry.filetype() == FileType::Regular
+            && (m_flags & ARCHIVE_EXTRACT_SPARSE) == 0
+            && !entry.hardlink()
+            && entry.size_is_set()
+            && entry.size() >= 0
+            && (entry.perm() & 07000) == 0
+            && (m_flags & ARCHIVE_EXTRACT_OWNER) == 0
+            && ((m_flags & ARCHIVE_EXTRACT_ACL) == 0 || archive_entry_acl_types(entry.raw()) == 0)
+            && ((m_flags & ARCHIVE_EXTRACT_XATTR) == 0 || archive_entry_xattr_count(entry.raw()) == 0)
+            && ((m_flags & ARCHIVE_EXTRACT_FFLAGS) == 0 || (fflagsSet == 0 && fflagsClear == 0));
+    }
+
+    // A descriptor for the archive file if entries' data can be copied
+    // straight out of it, which is only when the archive is an
+    // uncompressed tar file. Checked at the first entry, once the format
+    // is known.
+    int sourceFd(ArchiveReaderImpl& reader)
+    {
+        if (!m_sourceChecked)
+        {
+            m_sourceChecked = true;
+
+            archive* a = reader.raw();
+            if (!reader.filename().empty()
+                && (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR
+                && archive_filter_count(a) == 1
+                && archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE)
+            {
+                m_sourceFd = ::open(reader.cfilename(), O_RDONLY | O_CLOEXEC);
+            }
+        }
+
+        return m_sourceFd;
+    }
+
+    // Creates the file and copies its data from the archive. Returns false
+    // with nothing created, and the entry's data still unread, when the
+    // data can't be found or the file can't be made this way, such as when
+    // it already exists and has to be replaced by the disk writer.
+    bool copyOut(ArchiveReaderImpl& reader, ArchiveEntry& entry, const std::string& fullPath)
+    {
+        const std::int64_t size = entry.size();
+        const std::int64_t offset = detail::tarDataOffset(m_sourceFd,
+                                                          archive_read_header_position(reader.raw()),
+                                                          size);
+        if (offset < 0)
+        {
+            return false;
+        }
+
+        const mode_t perm = static_cast<mode_t>(entry.perm() & 0777);
+        const int fd = ::open(fullPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, perm);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        bool ok = false;
+        try
+        {
+            ok = detail::copyFileRange(m_sourceFd, offset, fd, 0, static_cast<std::uint64_t>(size))
+                 == static_cast<std::uint64_t>(size);
+        }
+        catch (const std::system_error&)
+        {
+        }
+
+        if (ok && (m_flags & ARCHIVE_EXTRACT_PERM) != 0 && (perm & m_umask) != 0)
+        {
+            ok = ::fchmod(fd, perm) == 0;
+        }
+
+        if (ok && (m_flags & ARCHIVE_EXTRACT_TIME) != 0 && (entry.atime_is_set() || entry.mtime_is_set()))
+        {
+            struct timespec times[2];
+            times[0].tv_sec = entry.atime_is_set() ? entry.atime() : 0;
+            times[0].tv_nsec = entry.atime_is_set() ? entry.atime_nsec() : UTIME_OMIT;
+            times[1].tv_sec = entry.mtime_is_set() ? entry.mtime() : 0;
+            times[1].tv_nsec = entry.mtime_is_set() ? entry.mtime_nsec() : UTIME_OMIT;
+            ::futimens(fd, times);
+        }
+
+        if (::close(fd) < 0)
+        {
+            ok = false;
+        }
+
+        // The disk writer tries again and reports why it fails
+        if (!ok)
+        {
+            ::unlink(fullPath.c_str());
+        }
+
+        return ok;
+    }
+#endif
+
+#ifdef MOOR_HAVE_IO_URING
+    bool batchable(ArchiveEntry& entry) const
+    {
+        return simpleFile(entry)
+            && static_cast<std::uint64_t>(entry.size()) <= m_smallFileSize;
+    }
+
+    void queue(ArchiveReaderImpl& reader, ArchiveEntry& entry, const std::string& fullPath)
+    {
+        if (m_uring->full() || m_uring->pending(fullPath))
+        {
+            flushBatch();
+        }
+
+        UringFileWriter::File file;
+        file.path = fullPath;
+        file.data.resize(static_cast<size_t>(entry.size()));
+
+        size_t done = 0;
+        while (done < file.data.size())
+        {
+            ssize_t n = archive_read_data(reader.raw(), file.data.data() + done, file.data.size() - done);
+            if (n < 0)
+            {
+                reader.checkError(static_cast<int>(n));
+            }
+
+            if (n <= 0)
+            {
+                break;
+            }
+
+            done += static_cast<size_t>(n);
+        }
+
+        file.data.resize(done);
+
+        const mode_t perm = static_cast<mode_t>(entry.perm() & 0777);
+        file.mode = perm;
+        file.chmod = (m_flags & ARCHIVE_EXTRACT_PERM) != 0 && (perm & m_umask) != 0;
+
+        if ((m_flags & ARCHIVE_EXTRACT_TIME) != 0 && (entry.atime_is_set() || entry.mtime_is_set()))
+        {
+            file.setTimes = true;
+            if (entry.atime_is_set())
+            {
+                file.times[0].tv_sec = entry.atime();
+                file.times[0].tv_nsec = entry.atime_nsec();
+            }
+
+            if (entry.mtime_is_set())
+            {
+                file.times[1].tv_sec = entry.mtime();
+                file.times[1].tv_nsec = entry.mtime_nsec();
+            }
+        }
+
+        // Kept to write the file the slow way if the batch fails it
+        file.tag.reset(archive_entry_clone(entry.raw()),
+                       [](void* e) { archive_entry_free(static_cast<archive_entry*>(e)); });
+
+        m_uring->add(std::move(file));
+    }
+
+    void flushBatch()
+    {
+        if (!m_uring || m_uring->empty())
+        {
+            return;
+        }
+
+        // Existing files and anything else unusual are left to the disk
+        // writer, which knows how to replace them
+        for (UringFileWriter::File& file : m_uring->flush())
+        {
+            m_disk.checkError(m_disk.writeHeader(static_cast<archive_entry*>(file.tag.get())));
+
+            if (!file.data.empty()
+                && archive_write_data(m_disk.raw(), file.data.data(), file.data.size()) < 0)
+            {
+                throw m_disk.systemError();
+            }
+
+            m_disk.checkError(archive_write_finish_entry(m_disk.raw()));
+        }
+    }
+#endif
+
+    const int m_flags;
+    ArchiveWriteDisk m_disk;
+    ParentDirCache m_dirs;
+    std::vector<DirTimes> m_dirTimes;
+    const bool m_secureDotDot;
+    const std::string m_prefix;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    bool m_sourceChecked;
+    int m_sourceFd;
+    mode_t m_umask;
+#endif
+
+#ifdef MOOR_HAVE_IO_URING
+    std::unique_ptr<UringFileWriter> m_uring;
+    const size_t m_smallFileSize;
+#endif
+};
+
+size_t ArchiveReaderImpl::extractAll(const std::string& rootPath,
+                                     const ExtractOptions& options)
+{
+    Extractor extractor(rootPath, options);
+    size_t count = 0;
+
+    for (ArchiveIterator it = begin(); !it.isAtEnd(); ++it)
+    {
+        ArchiveEntry& entry = *it;
+
+        if (options.match && options.match->excluded(entry))
+        {
+            continue;
+        }
+
+        extractor.extract(*this, entry);
+        ++count;
+    }
+
+    extractor.close();
+    return count;
+}
+
+size_t ArchiveReaderImpl::extractParallel(const std::string& archive_file_name,
+                                          const std::string& rootPath,
+                                          const ExtractOptions& options)
+{
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(archive_file_name);
+    mapping->advise(MappedFile::Advice::Random);
+    std::shared_ptr<const MappedFile> mapped(mapping);
+
+    // Symlinks in the archive, which entries below them have to wait for
+    std::set<std::string> symlinks;
+
+    // Only formats with an index can skip other threads' entries cheaply
+    {
+        ArchiveReader probe(mapped);
+        ArchiveIterator it = probe.begin();
+        if (it.isAtEnd())
+        {
+            return 0;
+        }
+
+        const int format = archive_format(probe.raw()) & ARCHIVE_FORMAT_BASE_MASK;
+        if (format != ARCHIVE_FORMAT_ZIP && format != ARCHIVE_FORMAT_7ZIP)
+        {
+            // Read by name, so that an uncompressed tar file's data can be
+            // copied straight out of it
+            ArchiveReader reader(archive_file_name);
+            return reader.extractAll(rootPath, options);
+        }
+
+        for (; !it.isAtEnd(); ++it)
+        {
+            if (it->filetype() == FileType::Link && it->pathname())
+            {
+                symlinks.insert(it->pathname());
+            }
+        }
+    }
+
+    const unsigned threads = options.threads != 0
+        ? options.threads
+        : std::max(1u, std::thread::hardware_concurrency());
+
+    std::mutex mutex;
+    std::exception_ptr error;
+    std::atomic<size_t> count(0);
+
+    // Hardlinks need their targets, and symlinks have to be in place
+    // before anything below them, or another thread could make a real
+    // directory there first. These are all extracted after the threads,
+    // in archive order.
+    auto deferred = [&symlinks](ArchiveEntry& entry, const std::string& path)
+    {
+        if (entry.hardlink() || entry.filetype() == FileType::Link)
+        {
+            return true;
+        }
+
+        for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1))
+        {
+            if (symlinks.count(path.substr(0, slash)))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    auto excluded = [&options, &mutex](ArchiveEntry& entry)
+    {
+        if (!options.match)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        return options.match->excluded(entry);
+    };
+
+    // Made before any thread starts: reading the umask sets it to 0 for a
+    // moment, which would apply to files another thread creates meanwhile
+    std::vector<std::unique_ptr<Extractor>> extractors;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        extractors.emplace_back(new Extractor(rootPath, options));
+    }
+
+    // Each path always goes to the same thread, so an entry repeated in
+    // the archive is still overwritten in order
+    auto work = [&](unsigned index)
+    {
+        try
+        {
+            ArchiveReader reader(mapped);
+            Extractor& extractor = *extractors[index];
+            std::hash<std::string> hash;
+
+            for (ArchiveIterator it = reader.begin(); !it.isAtEnd(); ++it)
+            {
+                ArchiveEntry& entry = *it;
+                const char* name = entry.pathname();
+                const std::string path(name ? name : "");
+
+                if (entry.filetype() == FileType::Directory
+                    || deferred(entry, path)
+                    || hash(path) % threads != index
+                    || excluded(entry))
+                {
+                    continue;
+                }
+
+                extractor.extract(reader, entry);
+                ++count;
+            }
+
+            extractor.close();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    try
+    {
+        for (unsigned i = 1; i < threads; ++i)
+        {
+            workers.push_back(std::thread(work, i));
+        }
+    }
+    catch (...)
+    {
+        for (std::thread& t : workers)
+        {
+            t.join();
+        }
+
+        throw;
+    }
+
+    work(0);
+
+    for (std::thread& t : workers)
+    {
+        t.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    // Deferred entries once the rest of the files exist, then directories,
+    // whose times must be set after nothing else is added to them
+    for (bool directories : { false, true })
+    {
+        ArchiveReader reader(mapped);
+        Extractor extractor(rootPath, options);
+
+        for (ArchiveIterator it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            ArchiveEntry& entry = *it;
+            const bool isDir = entry.filetype() == FileType::Directory;
+            const char* name = entry.pathname();
+
+            if (isDir != directories
+                || (!isDir && !deferred(entry, name ? name : ""))
+                || excluded(entry))
+            {
+                continue;
+            }
+
+            extractor.extract(reader, entry);
+            ++count;
+        }
+
+        extractor.close();
+    }
+
+    return count;
+}
+
 int ArchiveReaderImpl::readDataBlock(const void** buf, size_t* size, std::int64_t* offset)
 {
     return archive_read_data_block(m_archive, buf, size, offset);
@@ -98,6 +1204,9 @@ void ArchiveReaderImpl::close()
         archive_read_free(m_archive);
         m_archive = nullptr;
     }
+
+    // Stops the read-ahead thread
+    m_readAhead.reset();
 }
 
 ArchiveReader::~ArchiveReader()
@@ -24,6 +24,9 @@
 
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -33,10 +36,93 @@
 #include "types.hpp"
 
 #include "archive_iterator.hpp"
+#include "mapped_file.hpp"
+#include "read_ahead.hpp"
 
 
 namespace moor
 {
+    // Restricts the formats and filters a reader registers. By default
+    // every module libarchive has is registered and bids on the input,
+    // which dominates the cost of opening small archives.
+    struct FormatHint
+    {
+        std::vector<Format> formats; // Empty means all formats
+        std::vector<Filter> filters; // Empty means all filters
+
+        // Skip bidding altogether: the input must be in the single listed
+        // format, with the listed filters applied outermost first, or the
+        // open fails.
+        bool strict;
+
+        FormatHint()
+            : formats(),
+              filters(),
+              strict(false) { }
+
+        FormatHint(Format format_,
+                   Filter filter_,
+                   bool strict_ = false)
+            : formats(1, format_),
+              filters(1, filter_),
+              strict(strict_) { }
+    };
+
+    class ArchiveMatch;
+
+    struct MOOR_API ExtractOptions
+    {
+        // ARCHIVE_EXTRACT_* flags for the disk writer. The default restores
+        // times, permissions, ACLs and file flags. Sparse entries always
+        // get their holes back. ARCHIVE_EXTRACT_SPARSE makes holes of zero
+        // blocks in other files too, which needs every file to go through
+        // the disk writer.
+        int flags;
+
+        // Entries the match excludes are skipped. With several threads,
+        // calls are serialized by a lock.
+        ArchiveMatch* match;
+
+        // Reader handles used by extractParallel. 0 uses one per hardware
+        // thread.
+        unsigned threads;
+
+        enum class Backend
+        {
+            // Every entry goes through libarchive's disk writer
+            WriteDisk,
+
+            // Small regular files are created, written and closed in
+            // batches through io_uring where the kernel supports it, and
+            // everything else goes through the disk writer
+            IoUring
+        };
+
+        Backend backend;
+
+        // io_uring submission queue entries. Each file takes three.
+        unsigned queueDepth;
+
+        // Largest file written through io_uring
+        size_t smallFileSize;
+
+        ExtractOptions()
+            : flags(ARCHIVE_EXTRACT_TIME
+                    | ARCHIVE_EXTRACT_PERM
+                    | ARCHIVE_EXTRACT_ACL
+                    | ARCHIVE_EXTRACT_FFLAGS),
+              match(nullptr),
+              threads(0),
+              backend(Backend::WriteDisk),
+              queueDepth(192),
+              smallFileSize(64 * 1024) { }
+
+        // Whether the backend works here. io_uring can be missing from the
+        // build or refused by the kernel, in which case extraction quietly
+        // uses the disk writer instead.
+        static bool supports(Backend backend);
+    };
+
     // The ArchiveReaderImpl is where all the functionality is.  The
     // ArchiveReader is the owning version which will destroy the
     // underlying archive.
@@ -44,17 +130,143 @@ namespace moor
     {
         friend class ArchiveMatch;
     public:
-        ArchiveReaderImpl(const std::string& archive_file_name);
-        ArchiveReaderImpl(void* in_buffer, const size_t size);
-        ArchiveReaderImpl(std::vector<unsigned char>&& in_buffer);
+        typedef std::function<ssize_t(ArchiveReaderImpl&, void*, const void**)> ReadCallback;
+        typedef std::function<std::int64_t(ArchiveReaderImpl&, void*, std::int64_t)> SkipCallback;
+        typedef std::function<std::int64_t(ArchiveReaderImpl&, void*, std::int64_t, int)> SeekCallback;
+
+    private:
+        struct ReaderCallbackData
+        {
+            ReadCallback m_read;
+            SkipCallback m_skip;
+            SeekCallback m_seek;
+            ArchiveReaderImpl& m_reader;
+            void* m_userData;
+
+            static std::unique_ptr<ReaderCallbackData> create(ReadCallback r,
+                                                              SkipCallback sk,
+                                                              SeekCallback se,
+                                                              ArchiveReaderImpl& reader,
+                                                              void* ud)
+            {
+                return std::unique_ptr<ReaderCallbackData>(new ReaderCallbackData(r, sk, se, reader, ud));
+            }
+
+        private:
+            ReaderCallbackData(ReadCallback r,
+                               SkipCallback sk,
+                               SeekCallback se,
+                               ArchiveReaderImpl& reader,
+                               void* ud)
+                : m_read(r),
+                  m_skip(sk),
+                  m_seek(se),
+                  m_reader(reader),
+                  m_userData(ud) { }
+        };
+
+        static ssize_t readCallbackWrapper(archive*, void* ud, const void** buffer);
+        static std::int64_t skipCallbackWrapper(archive*, void* ud, std::int64_t request);
+        static std::int64_t seekCallbackWrapper(archive*, void* ud, std::int64_t offset, int whence);
+
+    public:
+        ArchiveReaderImpl(const std::string& archive_file_name,
+                          const FormatHint& hint = FormatHint());
+        ArchiveReaderImpl(void* in_buffer,
+                          const size_t size,
+                          const FormatHint& hint = FormatHint());
+        ArchiveReaderImpl(std::vector<unsigned char>&& in_buffer,
+                          const FormatHint& hint = FormatHint());
+
+        // Read directly out of a mapping of the file, without copying
+        // blocks through a read buffer.
+        ArchiveReaderImpl(MappedFile&& mapped_file,
+                          const FormatHint& hint = FormatHint());
+
+        // Read an immutable buffer that may be shared with other readers,
+        // possibly on other threads. The reader holds a reference, so the
+        // buffer stays alive for as long as any reader uses it.
+        ArchiveReaderImpl(std::shared_ptr<const MappedFile> mapped_file,
+                          const FormatHint& hint = FormatHint());
+        ArchiveReaderImpl(std::shared_ptr<const std::vector<unsigned char>> in_buffer,
+                          const FormatHint& hint = FormatHint());
+
+        // The owner is any reference counted object keeping the
+        // [in_buffer, in_buffer + size) range alive.
+        ArchiveReaderImpl(std::shared_ptr<const void> owner,
+                          const void* in_buffer,
+                          const size_t size,
+                          const FormatHint& hint = FormatHint());
+
+        // Read the file on a background thread, a bounded number of
+        // blocks ahead of decompression, so I/O and inflate overlap.
+        ArchiveReaderImpl(const std::string& archive_file_name,
+                          const ReadAheadOptions& read_ahead);
+
+        // Stream the archive from callbacks. The read callback returns the
+        // number of bytes made available in *buffer, 0 at EOF, or a
+        // negative value on error; the buffer must stay valid until the
+        // next call. Skip and seek are optional, but let formats like zip
+        // and 7-Zip jump over entry data instead of reading through it.
+        ArchiveReaderImpl(ReadCallback read,
+                          SkipCallback skip,
+                          SeekCallback seek,
+                          void* userData = nullptr);
+        ArchiveReaderImpl(ReadCallback read,
+                          void* userData = nullptr);
+
+        // Allocate and configure a handle without opening anything. Call
+        // reset() to open a source.
+        explicit ArchiveReaderImpl(const FormatHint& hint);
+
+        // Start reading a new source with the same format configuration,
+        // dropping the current one.
+        void reset(const std::string& archive_file_name);
+        void reset(void* in_buffer, const size_t size);
+        void reset(std::vector<unsigned char>&& in_buffer);
+        void reset(std::shared_ptr<const MappedFile> mapped_file);
+        void reset(std::shared_ptr<const std::vector<unsigned char>> in_buffer);
+        void reset(std::shared_ptr<const void> owner,
+                   const void* in_buffer,
+                   const size_t size);
+
+        // Release the current source and set up a fresh handle, so the
+        // next reset() only has to open. libarchive can't reopen a handle
+        // that has been used, so this is the part of a reset that can be
+        // done ahead of time.
+        void prepare();
 
         // Check ArchiveIterator::isAtEnd for EOF
         ArchiveIterator begin();
 
+        // Extract the remaining entries under rootPath with one disk
+        // writer. Parent directories are created once and remembered, and
+        // directory times and permissions are set when the archive has
+        // been read, so files added later don't disturb them. Returns the
+        // number of entries extracted.
+        size_t extractAll(const std::string& rootPath,
+                          const ExtractOptions& options = ExtractOptions());
+
+        // Extract a Zip or 7-Zip file with several independent reader
+        // handles on one mapping of it. Entries are shared out by path, so
+        // each thread only decodes its own and seeks past the rest, and
+        // hardlinks and directory attributes are applied once all the
+        // files are in place. Solid 7-Zip blocks still have to be decoded
+        // by every thread to skip through them, so only non-solid archives
+        // speed up. Other formats are extracted serially.
+        static size_t extractParallel(const std::string& archive_file_name,
+                                      const std::string& rootPath,
+                                      const ExtractOptions& options = ExtractOptions());
+
     protected:
         ArchiveReaderImpl(archive* a)
             : Archive(a),
-              m_in_buffer()
+              m_formatHint(),
+              m_in_buffer(),
+              m_sharedBuffer(),
+              m_callbackData(),
+              m_readAhead(),
+              m_opened(false)
         {
 
         }
@@ -62,16 +274,24 @@ namespace moor
         virtual void close() override;
 
     private:
+        class Extractor;
+
         static const int s_defaultExtractFlags;
 
         void init();
+        void prepareForOpen();
         int openFilename(const char* path, size_t blockSize = 10240);
-        int openMemory(void* buffer, size_t bufferSize);
+        int openMemory(const void* buffer, size_t bufferSize);
+        int openCallbacks();
 
-        static int copyData(archive* ar, archive* aw);
         int readDataBlock(const void** buf, size_t* size, std::int64_t* offset);
 
+        FormatHint m_formatHint;
         std::vector<unsigned char> m_in_buffer;
+        std::shared_ptr<const void> m_sharedBuffer; // Keeps shared input alive
+        std::unique_ptr<ReaderCallbackData> m_callbackData;
+        std::unique_ptr<ReadAheadFile> m_readAhead;
+        bool m_opened;
     };
 
     class MOOR_API ArchiveReader : public ArchiveReaderImpl
@@ -81,12 +301,43 @@ namespace moor
             : ArchiveReaderImpl(a) { }
 
     public:
-        ArchiveReader(const std::string& archive_file_name)
-            : ArchiveReaderImpl(archive_file_name) { }
-        ArchiveReader(void* buffer, const size_t size)
-            : ArchiveReaderImpl(buffer, size) { }
-        ArchiveReader(std::vector<unsigned char>&& buffer)
-            : ArchiveReaderImpl(std::move(buffer)) { }
+        explicit ArchiveReader(const FormatHint& hint)
+            : ArchiveReaderImpl(hint) { }
+        ArchiveReader(const std::string& archive_file_name,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(archive_file_name, hint) { }
+        ArchiveReader(void* buffer,
+                      const size_t size,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(buffer, size, hint) { }
+        ArchiveReader(std::vector<unsigned char>&& buffer,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(std::move(buffer), hint) { }
+        ArchiveReader(MappedFile&& mapped_file,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(std::move(mapped_file), hint) { }
+        ArchiveReader(std::shared_ptr<const MappedFile> mapped_file,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(mapped_file, hint) { }
+        ArchiveReader(std::shared_ptr<const std::vector<unsigned char>> buffer,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(buffer, hint) { }
+        ArchiveReader(std::shared_ptr<const void> owner,
+                      const void* buffer,
+                      const size_t size,
+                      const FormatHint& hint = FormatHint())
+            : ArchiveReaderImpl(owner, buffer, size, hint) { }
+        ArchiveReader(const std::string& archive_file_name,
+                      const ReadAheadOptions& read_ahead)
+            : ArchiveReaderImpl(archive_file_name, read_ahead) { }
+        ArchiveReader(ReadCallback read,
+                      SkipCallback skip,
+                      SeekCallback seek,
+                      void* userData = nullptr)
+            : ArchiveReaderImpl(read, skip, seek, userData) { }
+        ArchiveReader(ReadCallback read,
+                      void* userData = nullptr)
+            : ArchiveReaderImpl(read, userData) { }
         virtual ~ArchiveReader() override;
     };
 }
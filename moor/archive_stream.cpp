@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "archive_stream.hpp"
+#include "archive_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <unistd.h>
+#else
+  #include <io.h>
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+
+namespace
+{
+    const size_t chunkSize = 64 * 1024;
+}
+
+moor::ArchiveStream::ArchiveStream(const Format format_,
+                                   const Filter filter_,
+                                   const CompressionOptions& options_)
+    : m_sources(),
+      m_output(),
+      m_outputPos(0),
+      m_chunk(chunkSize),
+      m_reader(),
+      m_remaining(0),
+      m_inEntry(false),
+      m_fd(-1),
+      m_finished(false),
+      m_writer()
+{
+    auto collect = [this](ArchiveWriter&, void*, const void* data, size_t size) -> ssize_t
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        m_output.insert(m_output.end(), p, p + size);
+        return static_cast<ssize_t>(size);
+    };
+
+    m_writer.reset(new ArchiveWriter(collect, format_, filter_, nullptr, options_));
+}
+
+moor::ArchiveStream::~ArchiveStream()
+{
+    closeFile();
+}
+
+void moor::ArchiveStream::addFile(const std::string& file_path)
+{
+    Source source;
+    source.name = file_path;
+    source.path = file_path;
+    source.type = FileType::Regular;
+    source.size = 0;
+
+    m_sources.push_back(std::move(source));
+}
+
+void moor::ArchiveStream::addFile(const std::string& entry_name,
+                                  std::vector<unsigned char>&& content)
+{
+    std::shared_ptr<std::vector<unsigned char>> data
+        = std::make_shared<std::vector<unsigned char>>(std::move(content));
+    std::shared_ptr<size_t> offset = std::make_shared<size_t>(0);
+
+    addFile(entry_name,
+            static_cast<std::int64_t>(data->size()),
+            [data, offset](void* buf, size_t size) -> size_t
+            {
+                size_t n = std::min(size, data->size() - *offset);
+                std::memcpy(buf, data->data() + *offset, n);
+                *offset += n;
+                return n;
+            });
+}
+
+void moor::ArchiveStream::addFile(const std::string& entry_name,
+                                  std::int64_t size,
+                                  ContentReader reader)
+{
+    Source source;
+    source.name = entry_name;
+    source.type = FileType::Regular;
+    source.size = size;
+    source.reader = std::move(reader);
+
+    m_sources.push_back(std::move(source));
+}
+
+void moor::ArchiveStream::addDirectory(const std::string& directory_name)
+{
+    Source source;
+    source.name = directory_name;
+    source.type = FileType::Directory;
+    source.size = 0;
+
+    m_sources.push_back(std::move(source));
+}
+
+size_t moor::ArchiveStream::read(void* buf, size_t size)
+{
+    unsigned char* out = static_cast<unsigned char*>(buf);
+    size_t done = 0;
+
+    while (done < size)
+    {
+        if (m_outputPos < m_output.size())
+        {
+            size_t n = std::min(size - done, m_output.size() - m_outputPos);
+            std::memcpy(out + done, m_output.data() + m_outputPos, n);
+            m_outputPos += n;
+            done += n;
+            continue;
+        }
+
+        m_output.clear();
+        m_outputPos = 0;
+
+        if (!step())
+        {
+            break;
+        }
+    }
+
+    return done;
+}
+
+// Write the next piece of the archive: a chunk of the current entry's
+// content, the next header, or the end of the archive. Returns false once
+// there is nothing left to write.
+bool moor::ArchiveStream::step()
+{
+    if (m_finished)
+    {
+        return false;
+    }
+
+    if (m_inEntry)
+    {
+        size_t want = static_cast<size_t>(std::min<std::int64_t>(m_remaining, m_chunk.size()));
+        size_t n = 0;
+
+        if (want != 0)
+        {
+            if (m_fd >= 0)
+            {
+                ssize_t r;
+                do
+                {
+                    r = ::read(m_fd, m_chunk.data(), want);
+                }
+                while (r < 0 && errno == EINTR);
+
+                if (r < 0)
+                {
+                    throw std::system_error(std::error_code(errno, std::generic_category()));
+                }
+
+                n = static_cast<size_t>(r);
+            }
+            else
+            {
+                n = m_reader(m_chunk.data(), want);
+            }
+        }
+
+        if (n == 0)
+        {
+            finishEntry();
+            return true;
+        }
+
+        if (m_writer->writeData(m_chunk.data(), n) < 0)
+        {
+            throw m_writer->systemError();
+        }
+
+        m_remaining -= static_cast<std::int64_t>(n);
+        return true;
+    }
+
+    if (!m_sources.empty())
+    {
+        Source source(std::move(m_sources.front()));
+        m_sources.pop_front();
+
+        startEntry(source);
+        return true;
+    }
+
+    m_writer->close();
+    m_finished = true;
+
+    // Closing flushes whatever the format and filter held back
+    return !m_output.empty();
+}
+
+void moor::ArchiveStream::startEntry(Source& source)
+{
+    if (source.type == FileType::Directory)
+    {
+        m_writer->addHeader(source.name, FileType::Directory, 0, 0755);
+        m_writer->addFinish();
+        return;
+    }
+
+    if (!source.path.empty())
+    {
+        m_fd = ::open(source.path.c_str(), O_RDONLY | O_BINARY);
+        if (m_fd < 0)
+        {
+            throw std::system_error(std::error_code(errno, std::generic_category()), source.path);
+        }
+
+        struct stat st;
+        if (::fstat(m_fd, &st) < 0)
+        {
+            int err = errno;
+            closeFile();
+            throw std::system_error(std::error_code(err, std::generic_category()), source.path);
+        }
+
+        if (!S_ISREG(st.st_mode))
+        {
+            closeFile();
+            throw std::system_error(std::make_error_code(std::errc::not_supported), source.path);
+        }
+
+        m_writer->addHeader(source.path, &st);
+        m_remaining = st.st_size;
+    }
+    else
+    {
+        m_writer->addHeader(source.name, FileType::Regular, source.size);
+        m_reader = std::move(source.reader);
+        m_remaining = source.size;
+    }
+
+    m_inEntry = true;
+}
+
+void moor::ArchiveStream::finishEntry()
+{
+    m_writer->addFinish();
+    m_inEntry = false;
+    m_reader = ContentReader();
+    closeFile();
+}
+
+void moor::ArchiveStream::closeFile()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+#include "compression_options.hpp"
+#include "types.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace moor
+{
+    class ArchiveWriter;
+
+    // Produces an archive on demand instead of pushing it to an output.
+    // Entries are queued up front and nothing is read until read() needs
+    // it: each call writes just enough of the archive to fill the buffer,
+    // taking content a chunk at a time from files and readers. Memory use
+    // is one content chunk plus whatever the format and filter hold back,
+    // whatever the size of the archive.
+    //
+    // Entries may be added while reading, until the archive is finished by
+    // a read() that finds no entries left.
+    class MOOR_API ArchiveStream
+    {
+    public:
+        // Fill up to size bytes of entry content, returning the count
+        // written. Returning 0 ends the content early, and the format pads
+        // the entry to its declared size.
+        typedef std::function<size_t(void*, size_t)> ContentReader;
+
+        ArchiveStream(const Format format,
+                      const Filter filter,
+                      const CompressionOptions& options = CompressionOptions());
+        ~ArchiveStream();
+
+        // Add an entry for a real file, opened when the stream reaches it
+        void addFile(const std::string& file_path);
+
+        void addFile(const std::string& entry_name,
+                     std::vector<unsigned char>&& content);
+
+        // Add an entry of the given size whose content comes from reader
+        void addFile(const std::string& entry_name,
+                     std::int64_t size,
+                     ContentReader reader);
+
+        void addDirectory(const std::string& directory_name);
+
+        // Copy up to size bytes of the archive into buf. Returns 0 once
+        // the whole archive has been read.
+        size_t read(void* buf, size_t size);
+
+        bool atEnd() const
+        {
+            return m_finished && m_outputPos == m_output.size();
+        }
+
+    private:
+        struct Source
+        {
+            std::string name;
+            std::string path;
+            FileType type;
+            std::int64_t size;
+            ContentReader reader;
+        };
+
+        ArchiveStream(const ArchiveStream&);
+        ArchiveStream& operator=(const ArchiveStream&);
+
+        bool step();
+        void startEntry(Source& source);
+        void finishEntry();
+        void closeFile();
+
+        std::deque<Source> m_sources;
+
+        std::vector<unsigned char> m_output;
+        size_t m_outputPos;
+
+        std::vector<unsigned char> m_chunk;
+        ContentReader m_reader;
+        std::int64_t m_remaining;
+        bool m_inEntry;
+        int m_fd;
+        bool m_finished;
+
+        // Last, so it is closed while the output it writes to still exists
+        std::unique_ptr<ArchiveWriter> m_writer;
+    };
+}
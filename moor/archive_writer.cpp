@@ -24,19 +24,34 @@
 
 #include "archive_writer.hpp"
 #include "archive_entry.hpp"
+#include "archive_match.hpp"
 #include "archive_read_disk.hpp"
+#include "file_range.hpp"
+#include "mapped_file.hpp"
 #include "memory_writer_callback.hpp"
+#include "segmented_buffer.hpp"
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <mutex>
 #include <stdexcept>
 #include <system_error>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
 
 int moor::ArchiveWriter::openCallbackWrapper(archive*, void* ud)
 {
@@ -61,56 +76,130 @@ int moor::ArchiveWriter::closeCallbackWrapper(archive*, void* ud)
 
 moor::ArchiveWriter::ArchiveWriter(const std::string& archive_file_name_,
                                    const moor::Format format_,
-                                   const moor::Filter filter_)
+                                   const moor::Filter filter_,
+                                   const CompressionOptions& options_)
     : Archive(archive_write_new(), archive_file_name_),
       m_entry(*this),
       m_format(format_),
       m_filter(filter_),
       m_callbackData(),
-      m_buffer(new char[bufferSize()])
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
 {
-    // Set archive format
-    checkError(archive_write_set_format(m_archive, static_cast<int>(m_format)), true);
-
-    // Set archive compression
-    checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
+    init();
     checkError(openFilename(cfilename()), true);
 }
 
 moor::ArchiveWriter::ArchiveWriter(std::vector<unsigned char>& out_buffer_,
                                    const moor::Format format_,
-                                   const moor::Filter filter_)
+                                   const moor::Filter filter_,
+                                   const CompressionOptions& options_)
     : Archive(archive_write_new()),
       m_entry(*this),
       m_format(format_),
       m_filter(filter_),
       m_callbackData(),
-      m_buffer(new char[bufferSize()])
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
 {
-    // Set archive format
-    checkError(archive_write_set_format(m_archive, static_cast<int>(m_format)), true);
+    init();
+    checkError(openMemory(out_buffer_), true);
+}
 
-    // Set archive filter
-    checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
+moor::ArchiveWriter::ArchiveWriter(SegmentedBuffer& out_buffer_,
+                                   const moor::Format format_,
+                                   const moor::Filter filter_,
+                                   const CompressionOptions& options_)
+    : Archive(archive_write_new()),
+      m_entry(*this),
+      m_format(format_),
+      m_filter(filter_),
+      m_callbackData(),
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
+{
+    init();
     checkError(openMemory(out_buffer_), true);
 }
 
 moor::ArchiveWriter::ArchiveWriter(unsigned char* out_buffer_,
                                    size_t* size_,
                                    const moor::Format format_,
-                                   const moor::Filter filter_)
+                                   const moor::Filter filter_,
+                                   const CompressionOptions& options_)
     : Archive(archive_write_new()),
       m_entry(*this),
       m_format(format_),
       m_filter(filter_),
       m_callbackData(nullptr),
-      m_buffer(new char[bufferSize()])
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
 {
-    // Set archive format
-    checkError(archive_write_set_format(m_archive, static_cast<int>(m_format)), true);
-
-    // Set archive filter
-    checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
+    init();
     checkError(openMemory(out_buffer_, size_), true);
 }
 
@@ -119,7 +208,8 @@ moor::ArchiveWriter::ArchiveWriter(OpenCallback openCB,
                                    CloseCallback closeCB,
                                    const moor::Format format_,
                                    const moor::Filter filter_,
-                                   void* userData)
+                                   void* userData,
+                                   const CompressionOptions& options_)
     : Archive(archive_write_new()),
       m_entry(*this),
       m_format(format_),
@@ -129,103 +219,849 @@ moor::ArchiveWriter::ArchiveWriter(OpenCallback openCB,
                                                 closeCB,
                                                 *this,
                                                 userData)),
-      m_buffer(new char[bufferSize()])
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
 {
-    // Set archive format
-    checkError(archive_write_set_format(m_archive, static_cast<int>(m_format)), true);
-
-    // Set archive filter
-    checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
-
-    int r = archive_write_open(m_archive,
-                               m_callbackData.get(),
-                               ArchiveWriter::openCallbackWrapper,
-                               ArchiveWriter::writeCallbackWrapper,
-                               ArchiveWriter::closeCallbackWrapper);
-    checkError(r);
+    init();
+    checkError(openCallbacks());
 }
 
 moor::ArchiveWriter::ArchiveWriter(WriteCallback writeCB,
                                    const moor::Format format_,
                                    const moor::Filter filter_,
-                                   void* userData)
+                                   void* userData,
+                                   const CompressionOptions& options_)
     : Archive(archive_write_new()),
       m_entry(*this),
       m_format(format_),
       m_filter(filter_),
       m_callbackData(WriterCallbackData::create(writeCB, *this, userData)),
-      m_buffer(new char[bufferSize()])
+      m_buffer(new char[bufferSize()]),
+      m_opened(true),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
+{
+    init();
+    checkError(openCallbacks());
+}
+
+moor::ArchiveWriter::ArchiveWriter(const moor::Format format_,
+                                   const moor::Filter filter_,
+                                   const CompressionOptions& options_)
+    : Archive(archive_write_new()),
+      m_entry(*this),
+      m_format(format_),
+      m_filter(filter_),
+      m_callbackData(),
+      m_buffer(new char[bufferSize()]),
+      m_opened(false),
+      m_fileBuffer(),
+      m_fileBlockSize(defaultFileBlockSize()),
+      m_mapThreshold(defaultMapThreshold()),
+      m_entryRegular(false),
+      m_disk(),
+      m_userGroupCache(),
+      m_compression(options_),
+      m_compressor(),
+      m_stageClose(),
+      m_outputFd(-1),
+      m_outputOffset(0),
+      m_skipBytes(0),
+      m_outputBlockSize(0),
+      m_outputBuffered(0),
+      m_entryDataSize(-1),
+      m_entrySparse()
+{
+    init();
+}
+
+void moor::ArchiveWriter::init()
 {
     // Set archive format
     checkError(archive_write_set_format(m_archive, static_cast<int>(m_format)), true);
 
-    // Set archive filter
-    checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
+    // Set archive filter. The parallel stage does the compression itself.
+    if (parallelCompression())
+    {
+        checkError(archive_write_add_filter_none(m_archive), true);
+    }
+    else
+    {
+        checkError(archive_write_add_filter(m_archive, static_cast<int>(m_filter)), true);
+    }
 
-    int r = archive_write_open(m_archive,
-                               m_callbackData.get(),
-                               nullptr,
-                               ArchiveWriter::writeCallbackWrapper,
-                               nullptr);
-    checkError(r);
+    applyOptions();
 }
 
-moor::ArchiveWriter::~ArchiveWriter()
+void moor::ArchiveWriter::prepare()
 {
     close();
+
+    m_callbackData.reset();
+    setFilename(std::string());
+
+    m_archive = archive_write_new();
+    if (!m_archive)
+    {
+        throw std::bad_alloc();
+    }
+
+    m_opened = false;
+    init();
+}
+
+void moor::ArchiveWriter::prepareForOpen()
+{
+    // libarchive handles can't be reopened once used
+    if (m_opened || !m_archive)
+    {
+        prepare();
+    }
+
+    m_opened = true;
+}
+
+void moor::ArchiveWriter::reset(const std::string& archive_file_name_)
+{
+    prepareForOpen();
+    setFilename(archive_file_name_);
+    checkError(openFilename(cfilename()), true);
+}
+
+void moor::ArchiveWriter::reset(std::vector<unsigned char>& out_buffer_)
+{
+    prepareForOpen();
+    checkError(openMemory(out_buffer_), true);
+}
+
+void moor::ArchiveWriter::reset(SegmentedBuffer& out_buffer_)
+{
+    prepareForOpen();
+    checkError(openMemory(out_buffer_), true);
+}
+
+void moor::ArchiveWriter::reset(unsigned char* out_buffer_, size_t* size_)
+{
+    prepareForOpen();
+    checkError(openMemory(out_buffer_, size_), true);
+}
+
+void moor::ArchiveWriter::reset(OpenCallback openCB,
+                                WriteCallback writeCB,
+                                CloseCallback closeCB,
+                                void* userData)
+{
+    prepareForOpen();
+    m_callbackData = WriterCallbackData::create(openCB, writeCB, closeCB, *this, userData);
+    checkError(openCallbacks(), true);
+}
+
+void moor::ArchiveWriter::reset(WriteCallback writeCB, void* userData)
+{
+    prepareForOpen();
+    m_callbackData = WriterCallbackData::create(writeCB, *this, userData);
+    checkError(openCallbacks(), true);
+}
+
+int moor::ArchiveWriter::openCallbacks()
+{
+    WriterCallbackData* data = m_callbackData.get();
+
+    if (parallelCompression())
+    {
+        if (data->m_open)
+        {
+            int r = data->m_open(*this, data->m_userData);
+            if (r != ARCHIVE_OK)
+            {
+                return r;
+            }
+        }
+
+        return openStage([data](const void* buffer, size_t size)
+        {
+            const char* p = static_cast<const char*>(buffer);
+
+            while (size > 0)
+            {
+                ssize_t n = data->m_write(data->m_writer, data->m_userData, p, size);
+                if (n <= 0)
+                {
+                    throw std::system_error(std::make_error_code(std::errc::io_error),
+                                            "Write callback failed");
+                }
+
+                p += n;
+                size -= static_cast<size_t>(n);
+            }
+        },
+        [data]()
+        {
+            if (data->m_close && data->m_close(data->m_writer, data->m_userData) != ARCHIVE_OK)
+            {
+                throw std::system_error(std::make_error_code(std::errc::io_error),
+                                        "Close callback failed");
+            }
+        });
+    }
+
+    return archive_write_open(m_archive,
+                              data,
+                              data->m_open ? ArchiveWriter::openCallbackWrapper : nullptr,
+                              ArchiveWriter::writeCallbackWrapper,
+                              data->m_close ? ArchiveWriter::closeCallbackWrapper : nullptr);
+}
+
+moor::ArchiveWriter::~ArchiveWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+    }
 }
 
 int moor::ArchiveWriter::writeHeader(ArchiveEntry& e)
 {
-    return archive_write_header(m_archive, e.raw());
+    const int r = archive_write_header(m_archive, e.raw());
+    m_entryRegular = r >= ARCHIVE_WARN && archive_entry_filetype(e.raw()) == AE_IFREG;
+
+    // The data of a regular file follows its header, unless it's a
+    // hardlink, which has none
+    archive_entry* raw = e.raw();
+    m_entryDataSize = -1;
+    m_entrySparse.clear();
+    if (m_outputFd >= 0
+        && r >= ARCHIVE_WARN
+        && archive_entry_filetype(raw) == AE_IFREG
+        && archive_entry_size_is_set(raw)
+        && !archive_entry_hardlink(raw))
+    {
+        m_entryDataSize = archive_entry_size(raw);
+
+        // pax stores the data runs of a sparse file one after another.
+        // GNU tar format stores the holes as zeros.
+        if (m_format == Format::PAX && archive_entry_sparse_reset(raw) > 0)
+        {
+            std::int64_t offset = 0;
+            std::int64_t length = 0;
+            while (archive_entry_sparse_next(raw, &offset, &length) == ARCHIVE_OK)
+            {
+                m_entrySparse.push_back(std::make_pair(offset, length));
+            }
+        }
+    }
+
+    return r;
 }
 
 int moor::ArchiveWriter::openFilename(const char* path)
 {
+    if (parallelCompression())
+    {
+        std::FILE* f = std::fopen(path, "wb");
+        if (!f)
+        {
+            archive_set_error(m_archive, errno, "Failed to open '%s'", path);
+            return ARCHIVE_FATAL;
+        }
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        // As archive_write_open_filename does, so the archive isn't added
+        // to itself
+        struct stat st;
+        if (::fstat(fileno(f), &st) == 0)
+        {
+            archive_write_set_skip_file(m_archive, st.st_dev, st.st_ino);
+        }
+#endif
+
+        // Closed by the close callback, so that its errors are reported,
+        // or when the stage is dropped if the archive is never closed
+        std::shared_ptr<std::FILE*> file(new std::FILE*(f), [](std::FILE** p)
+        {
+            if (*p)
+            {
+                std::fclose(*p);
+            }
+
+            delete p;
+        });
+
+        return openStage([file](const void* data, size_t size)
+        {
+            if (std::fwrite(data, 1, size, *file) != size)
+            {
+                throw std::system_error(std::error_code(errno, std::generic_category()));
+            }
+        },
+        [file]()
+        {
+            std::FILE* f = *file;
+            *file = nullptr;
+
+            if (f && std::fclose(f) != 0)
+            {
+                throw std::system_error(std::error_code(errno, std::generic_category()));
+            }
+        });
+    }
+
+    if (directOutput())
+    {
+        return openDirect(path);
+    }
+
     return archive_write_open_filename(m_archive, path);
 }
 
 int moor::ArchiveWriter::openMemory(std::vector<unsigned char>& outBuf)
 {
+    if (parallelCompression())
+    {
+        std::vector<unsigned char>* out = &outBuf;
+
+        return openStage([out](const void* data, size_t size)
+        {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            out->insert(out->end(), p, p + size);
+        });
+    }
+
+    return write_open_memory(m_archive, outBuf);
+}
+
+int moor::ArchiveWriter::openMemory(SegmentedBuffer& outBuf)
+{
+    if (parallelCompression())
+    {
+        SegmentedBuffer* out = &outBuf;
+
+        return openStage([out](const void* data, size_t size)
+        {
+            out->append(data, size);
+        });
+    }
+
     return write_open_memory(m_archive, outBuf);
 }
 
 int moor::ArchiveWriter::openMemory(void* buf, size_t* bufSize)
 {
+    if (parallelCompression())
+    {
+        unsigned char* out = static_cast<unsigned char*>(buf);
+        const size_t capacity = *bufSize;
+        *bufSize = 0;
+
+        return openStage([out, capacity, bufSize](const void* data, size_t size)
+        {
+            if (capacity - *bufSize < size)
+            {
+                throw std::system_error(std::make_error_code(std::errc::not_enough_memory),
+                                        "Buffer exhausted");
+            }
+
+            std::memcpy(out + *bufSize, data, size);
+            *bufSize += size;
+        });
+    }
+
     return archive_write_open_memory(m_archive, buf, *bufSize, bufSize);
 }
 
+static const char* sevenZipMethodName(moor::SevenZipOptions::Method method)
+{
+    switch (method)
+    {
+        case moor::SevenZipOptions::Method::Store:
+            return "store";
+        case moor::SevenZipOptions::Method::Deflate:
+            return "deflate";
+        case moor::SevenZipOptions::Method::Bzip2:
+            return "bzip2";
+        case moor::SevenZipOptions::Method::LZMA1:
+            return "lzma1";
+        case moor::SevenZipOptions::Method::LZMA2:
+            return "lzma2";
+        case moor::SevenZipOptions::Method::PPMd:
+            return "ppmd";
+        default:
+            return nullptr;
+    }
+}
+
+// Filters libarchive has a compression-level option for. Others refuse
+// the option as undefined, so a level is ignored for them.
+static bool hasCompressionLevel(moor::Filter filter)
+{
+    switch (filter)
+    {
+        case moor::Filter::Gzip:
+        case moor::Filter::Bzip2:
+        case moor::Filter::LZMA:
+        case moor::Filter::Xz:
+        case moor::Filter::LZip:
+        case moor::Filter::LRZip:
+        case moor::Filter::LZOP:
+        case moor::Filter::LZ4:
+        case moor::Filter::Zstd:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Options are only passed to the modules that have them, since libarchive
+// fails on an option no module recognizes.
+void moor::ArchiveWriter::applyOptions()
+{
+    const std::string level = std::to_string(m_compression.level);
+    const std::string threads = std::to_string(m_compression.threads);
+
+    if (m_compression.level >= 0)
+    {
+        if (hasCompressionLevel(m_filter) && !parallelCompression())
+        {
+            checkError(setFilterOption(nullptr, "compression-level", level.c_str()), true);
+        }
+
+        if (m_format == Format::Zip || m_format == Format::Zip7)
+        {
+            checkError(setFormatOption(nullptr, "compression-level", level.c_str()), true);
+        }
+    }
+
+    if (m_compression.threads > 1 && (m_filter == Filter::Xz || m_filter == Filter::Zstd))
+    {
+        checkError(setFilterOption(nullptr, "threads", threads.c_str()), true);
+    }
+
+    if (m_format == Format::Zip)
+    {
+        const ZipOptions& zip = m_compression.zip;
+
+        if (zip.method != ZipOptions::Method::Default)
+        {
+            const char* method = zip.method == ZipOptions::Method::Store ? "store" : "deflate";
+            checkError(setFormatOption("zip", "compression", method), true);
+        }
+
+        if (zip.zip64 >= 0)
+        {
+            // A null value turns a boolean option off
+            checkError(setFormatOption("zip", "zip64", zip.zip64 ? "1" : nullptr), true);
+        }
+
+        if (!zip.encryption.empty())
+        {
+            checkError(setFormatOption("zip", "encryption", zip.encryption.c_str()), true);
+        }
+
+        if (!zip.passphrase.empty())
+        {
+            checkError(archive_write_set_passphrase(m_archive, zip.passphrase.c_str()), true);
+        }
+    }
+
+    if (m_format == Format::Zip7)
+    {
+        const char* method = sevenZipMethodName(m_compression.sevenZip.method);
+        if (method)
+        {
+            checkError(setFormatOption("7zip", "compression", method), true);
+        }
+    }
+
+    if (!m_compression.extra.empty())
+    {
+        checkError(setOptions(m_compression.extra.c_str()), true);
+    }
+}
+
+int moor::ArchiveWriter::setOptions(const char* options)
+{
+    return archive_write_set_options(m_archive, options);
+}
+
+int moor::ArchiveWriter::setFilterOption(const char* module, const char* option, const char* value)
+{
+    return archive_write_set_filter_option(m_archive, module, option, value);
+}
+
+int moor::ArchiveWriter::setFormatOption(const char* module, const char* option, const char* value)
+{
+    return archive_write_set_format_option(m_archive, module, option, value);
+}
+
+bool moor::ArchiveWriter::parallelCompression() const
+{
+    return m_compression.threads > 1 && ParallelCompressor::supports(m_filter);
+}
+
+int moor::ArchiveWriter::openStage(ParallelCompressor::Sink sink,
+                                   std::function<void()> closeOutput)
+{
+    m_compressor.reset(new ParallelCompressor(m_filter, m_compression, std::move(sink)));
+    m_stageClose = std::move(closeOutput);
+
+    return archive_write_open(m_archive,
+                              this,
+                              nullptr,
+                              ArchiveWriter::stageWriteWrapper,
+                              ArchiveWriter::stageCloseWrapper);
+}
+
+ssize_t moor::ArchiveWriter::stageWriteWrapper(archive* a,
+                                               void* ud,
+                                               const void* buffer,
+                                               size_t size)
+{
+    ArchiveWriter* writer = static_cast<ArchiveWriter*>(ud);
+
+    try
+    {
+        writer->m_compressor->write(buffer, size);
+        return static_cast<ssize_t>(size);
+    }
+    catch (const std::system_error& ex)
+    {
+        archive_set_error(a, ex.code().value(), "%s", ex.what());
+    }
+    catch (const std::exception& ex)
+    {
+        archive_set_error(a, EIO, "%s", ex.what());
+    }
+
+    return ARCHIVE_FATAL;
+}
+
+int moor::ArchiveWriter::stageCloseWrapper(archive* a, void* ud)
+{
+    ArchiveWriter* writer = static_cast<ArchiveWriter*>(ud);
+
+    try
+    {
+        writer->m_compressor->finish();
+
+        if (writer->m_stageClose)
+        {
+            writer->m_stageClose();
+        }
+
+        return ARCHIVE_OK;
+    }
+    catch (const std::system_error& ex)
+    {
+        archive_set_error(a, ex.code().value(), "%s", ex.what());
+    }
+    catch (const std::exception& ex)
+    {
+        archive_set_error(a, EIO, "%s", ex.what());
+    }
+
+    return ARCHIVE_FATAL;
+}
+
+bool moor::ArchiveWriter::directOutput() const
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    return m_filter == Filter::None
+        && (m_format == Format::PAX || m_format == Format::Tar);
+#else
+    return false;
+#endif
+}
+
+int moor::ArchiveWriter::openDirect(const char* path)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // Only a regular file can be written at an offset. An empty name is
+    // stdout, and pipes, FIFOs and devices are left to libarchive.
+    struct stat st;
+    if (!path || !*path || (::stat(path, &st) == 0 && !S_ISREG(st.st_mode)))
+    {
+        return archive_write_open_filename(m_archive, path);
+    }
+
+    m_outputFd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (m_outputFd < 0)
+    {
+        archive_set_error(m_archive, errno, "Failed to open '%s'", path);
+        return ARCHIVE_FATAL;
+    }
+
+    if (::fstat(m_outputFd, &st) != 0
+        || !S_ISREG(st.st_mode)
+        || ::lseek(m_outputFd, 0, SEEK_CUR) < 0)
+    {
+        ::close(m_outputFd);
+        m_outputFd = -1;
+        return archive_write_open_filename(m_archive, path);
+    }
+
+    // As archive_write_open_filename does, so the archive isn't added to
+    // itself
+    archive_write_set_skip_file(m_archive, st.st_dev, st.st_ino);
+
+    m_outputOffset = 0;
+    m_skipBytes = 0;
+    m_entryDataSize = -1;
+
+    // libarchive's own blocking is turned off, so that the output offset
+    // is always where the next byte goes once flushOutput() has run. The
+    // write callback blocks the output instead, and the close callback
+    // pads the last block.
+    const int block = archive_write_get_bytes_per_block(m_archive);
+    const int lastBlock = archive_write_get_bytes_in_last_block(m_archive);
+    archive_write_set_bytes_in_last_block(m_archive, lastBlock > 0 ? lastBlock : std::max(block, 1));
+    archive_write_set_bytes_per_block(m_archive, 0);
+
+    m_outputBlockSize = static_cast<size_t>(std::max(block, 0));
+    m_outputBuffered = 0;
+    if (m_outputBlockSize > 0 && !m_outputBlock)
+    {
+        m_outputBlock.reset(new char[m_outputBlockSize]);
+    }
+
+    return archive_write_open(m_archive,
+                              this,
+                              nullptr,
+                              ArchiveWriter::directWriteWrapper,
+                              ArchiveWriter::directCloseWrapper);
+#else
+    return archive_write_open_filename(m_archive, path);
+#endif
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static bool writeAt(int fd, const char* p, size_t size, std::uint64_t offset)
+{
+    for (size_t done = 0; done < size; )
+    {
+        const ssize_t n = ::pwrite(fd, p + done, size - done, static_cast<off_t>(offset + done));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        done += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+#endif
+
+bool moor::ArchiveWriter::flushOutput()
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if (!writeAt(m_outputFd, m_outputBlock.get(), m_outputBuffered, m_outputOffset))
+    {
+        return false;
+    }
+
+    m_outputOffset += m_outputBuffered;
+    m_outputBuffered = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+ssize_t moor::ArchiveWriter::directWriteWrapper(archive* a,
+                                                void* ud,
+                                                const void* buffer,
+                                                size_t size)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    ArchiveWriter* writer = static_cast<ArchiveWriter*>(ud);
+    const char* p = static_cast<const char*>(buffer);
+    size_t remaining = size;
+
+    // Zeros standing in for content that was already copied. The block
+    // was flushed before the copy, so they come first.
+    const size_t skip = static_cast<size_t>(std::min<std::uint64_t>(writer->m_skipBytes, remaining));
+    writer->m_skipBytes -= skip;
+    writer->m_outputOffset += skip;
+    p += skip;
+    remaining -= skip;
+
+    const size_t block = writer->m_outputBlockSize;
+    while (remaining > 0)
+    {
+        // Whole blocks go straight out when nothing is waiting
+        if (writer->m_outputBuffered == 0 && remaining >= block)
+        {
+            const size_t n = block > 0 ? remaining - remaining % block : remaining;
+            if (!writeAt(writer->m_outputFd, p, n, writer->m_outputOffset))
+            {
+                archive_set_error(a, errno, "Write failed");
+                return ARCHIVE_FATAL;
+            }
+
+            writer->m_outputOffset += n;
+            p += n;
+            remaining -= n;
+            continue;
+        }
+
+        const size_t n = std::min(remaining, block - writer->m_outputBuffered);
+        std::memcpy(writer->m_outputBlock.get() + writer->m_outputBuffered, p, n);
+        writer->m_outputBuffered += n;
+        p += n;
+        remaining -= n;
+
+        if (writer->m_outputBuffered == block && !writer->flushOutput())
+        {
+            archive_set_error(a, errno, "Write failed");
+            return ARCHIVE_FATAL;
+        }
+    }
+
+    return static_cast<ssize_t>(size);
+#else
+    (void) ud;
+    (void) buffer;
+    (void) size;
+    archive_set_error(a, ENOSYS, "Direct output is not supported");
+    return ARCHIVE_FATAL;
+#endif
+}
+
+int moor::ArchiveWriter::directCloseWrapper(archive* a, void* ud)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    ArchiveWriter* writer = static_cast<ArchiveWriter*>(ud);
+    int r = ARCHIVE_OK;
+
+    // Pad the last block, as libarchive's own blocking would have
+    const std::uint64_t block = static_cast<std::uint64_t>(archive_write_get_bytes_in_last_block(a));
+    const std::uint64_t tail = (writer->m_outputOffset + writer->m_outputBuffered) % block;
+    if (tail != 0)
+    {
+        const std::vector<char> zeros(static_cast<size_t>(block - tail), 0);
+        if (directWriteWrapper(a, ud, zeros.data(), zeros.size()) < 0)
+        {
+            r = ARCHIVE_FATAL;
+        }
+    }
+
+    if (r == ARCHIVE_OK && !writer->flushOutput())
+    {
+        archive_set_error(a, errno, "Write failed");
+        r = ARCHIVE_FATAL;
+    }
+
+    if (::close(writer->m_outputFd) < 0 && r == ARCHIVE_OK)
+    {
+        archive_set_error(a, errno, "Close failed");
+        r = ARCHIVE_FATAL;
+    }
+
+    writer->m_outputFd = -1;
+    writer->m_outputBuffered = 0;
+    writer->m_entryDataSize = -1;
+    return r;
+#else
+    (void) ud;
+    return ARCHIVE_FATAL;
+#endif
+}
+
 void moor::ArchiveWriter::addHeader(const std::string& entry_name_,
                                     const FileType entry_type_,
                                     const std::int64_t size_,
-                                    const int permission_)
+                                    const int permission_,
+                                    const std::time_t mtime_)
 {
     m_entry.clear();
     m_entry.set_pathname(entry_name_.c_str());
     m_entry.set_perm(static_cast<__LA_MODE_T>(permission_));
     m_entry.set_filetype(entry_type_);
     m_entry.set_size(size_);
+    if (mtime_ != 0)
+    {
+        m_entry.set_mtime(mtime_, 0);
+    }
     checkError(writeHeader(m_entry));
 }
 
 void moor::ArchiveWriter::addHeader(const std::string& filePath,
                                     const struct stat* statBuf)
 {
-    ArchiveReadDisk disk;
-
     m_entry.clear();
     m_entry.set_pathname(filePath.c_str());
-    checkError(disk.entryFromFile(m_entry, -1, statBuf));
+    checkError(diskReader().entryFromFile(m_entry, -1, statBuf));
     checkError(writeHeader(m_entry));
 }
 
+moor::ArchiveReadDisk& moor::ArchiveWriter::diskReader()
+{
+    if (!m_userGroupCache)
+    {
+        m_userGroupCache = std::make_shared<UserGroupCache>();
+    }
+
+    if (!m_disk)
+    {
+        m_disk.reset(new ArchiveReadDisk(m_userGroupCache));
+    }
+
+    return *m_disk;
+}
+
+void moor::ArchiveWriter::setUserGroupCache(std::shared_ptr<UserGroupCache> cache)
+{
+    m_userGroupCache = std::move(cache);
+    m_disk.reset();
+}
+
 void moor::ArchiveWriter::addContent(const char b)
 {
+    m_entryDataSize = -1;
     archive_write_data(m_archive, &b, sizeof(b));
 }
 
 void moor::ArchiveWriter::addContent(const void* data, size_t size)
 {
+    m_entryDataSize = -1;
     archive_write_data(m_archive, data, size);
 }
 
@@ -236,33 +1072,314 @@ void moor::ArchiveWriter::addFinish()
 
 ssize_t moor::ArchiveWriter::writeData(const void* buf, size_t bufSize)
 {
+    m_entryDataSize = -1;
     return archive_write_data(m_archive, buf, bufSize);
 }
 
+void moor::ArchiveWriter::FreeDeleter::operator()(void* p) const
+{
+    std::free(p);
+}
+
+void moor::ArchiveWriter::setFileBlockSize(size_t blockSize)
+{
+    // Keep the block a whole number of pages for aligned reads
+    const size_t align = 4096;
+    blockSize = std::max(align, (blockSize + align - 1) / align * align);
+
+    if (blockSize != m_fileBlockSize)
+    {
+        m_fileBlockSize = blockSize;
+        m_fileBuffer.reset();
+    }
+}
+
+void moor::ArchiveWriter::setMapThreshold(std::int64_t threshold)
+{
+    m_mapThreshold = threshold;
+}
+
 void moor::ArchiveWriter::writeFileData(const char* path)
 {
-    std::ifstream file(path, std::ios::in);
+    // Symlinks and other entries from addDiskPath() have no content, and
+    // the path of one may not even lead anywhere
+    if (!m_entryRegular)
+    {
+        return;
+    }
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    struct stat st;
+    if (::stat(path, &st) < 0)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        // Directories and special files have no content to write
+        return;
+    }
+
+    if (copyFileData(path, st.st_size))
+    {
+        return;
+    }
+
+    // Fewer blocks than the size takes means the file has holes
+    if (static_cast<std::int64_t>(st.st_blocks) * 512 < static_cast<std::int64_t>(st.st_size))
+    {
+        readSparseFileData(path, st.st_size);
+        return;
+    }
+
+    if (st.st_size >= m_mapThreshold)
+    {
+        MappedFile file(path);
+        const char* p = static_cast<const char*>(file.data());
+        size_t remaining = file.size();
+
+        while (remaining > 0)
+        {
+            size_t n = std::min(remaining, m_fileBlockSize);
+            if (writeData(p, n) < 0)
+            {
+                throw systemError();
+            }
+
+            p += n;
+            remaining -= n;
+        }
+
+        return;
+    }
+
+    readFileData(path);
+#else
+    std::ifstream file(path, std::ios::in | std::ios::binary);
 
     while (file.good())
     {
         file.read(m_buffer.get(), bufferSize());
         writeData(m_buffer.get(), static_cast<size_t>(file.gcount()));
     }
+#endif
+}
 
-#if 0
-    int fd = open(archive_entry_sourcepath(m_entry), O_RDONLY);
-    auto len = read(fd, buf, sizeof(buf));
+#if !defined(_WIN32) || defined(__CYGWIN__)
+bool moor::ArchiveWriter::copyFileData(const char* path, std::int64_t fileSize)
+{
+    if (m_entryDataSize <= 0 || fileSize <= 0)
+    {
+        return false;
+    }
 
-    while (len > 0)
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
     {
-        archive_write_data(m_archive, buf, len);
-        len = read(fd, buf, sizeof(buf));
+        throw std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    // pax writes the sparse map ahead of the data with the first write
+    if (!m_entrySparse.empty() && archive_write_data(m_archive, m_buffer.get(), 0) < 0)
+    {
+        ::close(fd);
+        throw systemError();
+    }
+
+    // The copy goes after everything written so far
+    if (!flushOutput())
+    {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(std::error_code(err, std::generic_category()));
+    }
+
+    std::uint64_t copied = 0;
+    try
+    {
+        // A file that has changed size since its header was written is
+        // cut short or left zero filled, as libarchive does with written
+        // data
+        if (m_entrySparse.empty())
+        {
+            const std::uint64_t size = static_cast<std::uint64_t>(std::min(fileSize, m_entryDataSize));
+            copied = detail::copyFileRange(fd, 0, m_outputFd, m_outputOffset + m_skipBytes, size);
+        }
+
+        for (const std::pair<std::int64_t, std::int64_t>& run : m_entrySparse)
+        {
+            const std::uint64_t length = static_cast<std::uint64_t>(run.second);
+            const std::uint64_t n = detail::copyFileRange(fd, run.first, m_outputFd,
+                                                          m_outputOffset + m_skipBytes + copied,
+                                                          length);
+            copied += n;
+            if (n < length)
+            {
+                break;
+            }
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        ::close(fd);
+        throw std::system_error(ex.code(), path);
     }
 
     ::close(fd);
+
+    m_skipBytes += copied;
+    m_entryDataSize = -1;
+    return true;
+}
+
+char* moor::ArchiveWriter::fileBuffer()
+{
+    if (!m_fileBuffer)
+    {
+        void* p = nullptr;
+        if (posix_memalign(&p, 4096, m_fileBlockSize) != 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        m_fileBuffer.reset(static_cast<char*>(p));
+    }
+
+    return m_fileBuffer.get();
+}
+
+void moor::ArchiveWriter::readFileData(const char* path)
+{
+    char* buffer = fileBuffer();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
+
+    while (true)
+    {
+        ssize_t len = ::read(fd, buffer, m_fileBlockSize);
+        if (len == 0)
+        {
+            break;
+        }
+
+        if (len < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            std::system_error err(std::error_code(errno, std::generic_category()), path);
+            ::close(fd);
+            throw err;
+        }
+
+        if (writeData(buffer, static_cast<size_t>(len)) < 0)
+        {
+            ::close(fd);
+            throw systemError();
+        }
+    }
+
+    ::close(fd);
 }
 
+void moor::ArchiveWriter::readSparseFileData(const char* path, std::int64_t size)
+{
+    char* buffer = fileBuffer();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    try
+    {
+        std::int64_t pos = 0;
+
+        for (const detail::DataRun& run : detail::fileDataRuns(fd, size))
+        {
+            writeZeros(run.offset - pos);
+            pos = run.offset;
+
+            const std::int64_t end = run.offset + run.length;
+            while (pos < end)
+            {
+                const size_t want = static_cast<size_t>(std::min<std::int64_t>(end - pos, m_fileBlockSize));
+                ssize_t len = ::pread(fd, buffer, want, pos);
+                if (len < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw std::system_error(std::error_code(errno, std::generic_category()), path);
+                }
+
+                // The file shrank, and libarchive fills the rest with zeros
+                if (len == 0)
+                {
+                    ::close(fd);
+                    return;
+                }
+
+                if (writeData(buffer, static_cast<size_t>(len)) < 0)
+                {
+                    throw systemError();
+                }
+
+                pos += len;
+            }
+        }
+
+        writeZeros(size - pos);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+}
+
+// Holes are written like any other data, so that pax can match them with
+// its sparse map. It drops them without copying where they are holes there
+// too, while other formats store the zeros.
+void moor::ArchiveWriter::writeZeros(std::int64_t size)
+{
+    if (size <= 0)
+    {
+        return;
+    }
+
+    char* buffer = fileBuffer();
+    std::memset(buffer, 0, static_cast<size_t>(std::min<std::int64_t>(size, m_fileBlockSize)));
+
+    while (size > 0)
+    {
+        const size_t n = static_cast<size_t>(std::min<std::int64_t>(size, m_fileBlockSize));
+        if (writeData(buffer, n) < 0)
+        {
+            throw systemError();
+        }
+
+        size -= n;
+    }
+}
+#endif
+
 int moor::ArchiveWriter::setBytesPerBlock(int bytesPerBlock)
 {
     return archive_write_set_bytes_per_block(m_archive, bytesPerBlock);
@@ -307,14 +1424,49 @@ void moor::ArchiveWriter::addFile(const std::string& entryName,
                                   const void* data,
                                   size_t size)
 {
-    addHeader(entryName, FileType::Regular, static_cast<std::int64_t>(size));
+    std::vector<detail::DataRun> runs;
+    bool sparse = false;
+    if (m_format == Format::PAX && size >= 2 * sparseBlockSize())
+    {
+        runs = detail::memoryDataRuns(data, size, sparseBlockSize());
+        sparse = runs.size() != 1 || runs[0].length != static_cast<std::int64_t>(size);
+    }
+
+    if (!sparse)
+    {
+        addHeader(entryName, FileType::Regular, static_cast<std::int64_t>(size));
+        addContent(data, size);
+        addFinish();
+        return;
+    }
+
+    m_entry.clear();
+    m_entry.set_pathname(entryName.c_str());
+    m_entry.set_perm(0644);
+    m_entry.set_filetype(FileType::Regular);
+    m_entry.set_size(static_cast<std::int64_t>(size));
+
+    for (const detail::DataRun& run : runs)
+    {
+        archive_entry_sparse_add_entry(m_entry.raw(), run.offset, run.length);
+    }
+
+    // Content that's all zeros still needs a map to have no data stored
+    if (runs.empty())
+    {
+        archive_entry_sparse_add_entry(m_entry.raw(), static_cast<std::int64_t>(size), 0);
+    }
+
+    checkError(writeHeader(m_entry));
+
+    // The zero blocks are dropped by the format as the map's holes
     addContent(data, size);
     addFinish();
 }
 
 void moor::ArchiveWriter::addDiskPath(const std::string& path, ArchiveMatch* match)
 {
-    moor::ArchiveReadDisk disk;
+    moor::ArchiveReadDisk disk(diskReader().userGroupCache());
 
     checkError(disk.open(path.c_str()), true);
 
@@ -341,6 +1493,55 @@ void moor::ArchiveWriter::addDiskPath(const std::string& path, ArchiveMatch* mat
     }
 }
 
+void moor::ArchiveWriter::addDiskPath(const std::string& path,
+                                      const ParallelWalkOptions& options,
+                                      ArchiveMatch* match)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    ParallelWalkOptions walkOptions(options);
+    if (!walkOptions.userGroupCache)
+    {
+        walkOptions.userGroupCache = diskReader().userGroupCache();
+    }
+
+    std::mutex matchMutex;
+    ParallelDiskWalker walker(path, walkOptions, match, &matchMutex);
+
+    while (std::unique_ptr<ParallelDiskWalker::Item> item = walker.next())
+    {
+        ArchiveEntry entry(*this, item->entry);
+
+        if (match)
+        {
+            std::lock_guard<std::mutex> lock(matchMutex);
+            if (match->excluded(entry))
+            {
+                match->notifyExcluded(entry);
+                continue;
+            }
+        }
+
+        checkError(writeHeader(entry), true);
+
+        if (item->prefetched)
+        {
+            if (!item->data.empty() && writeData(item->data.data(), item->data.size()) < 0)
+            {
+                throw systemError();
+            }
+        }
+        else
+        {
+            writeFileData(item->path.c_str());
+        }
+
+        addFinish();
+    }
+#else
+    addDiskPath(path, match);
+#endif
+}
+
 void moor::ArchiveWriter::addDirectory(const std::string& directory_name)
 {
     addHeader(directory_name, FileType::Directory, 0777);
@@ -349,10 +1550,35 @@ void moor::ArchiveWriter::addDirectory(const std::string& directory_name)
 
 void moor::ArchiveWriter::close()
 {
+    // A failed final write, such as the padding or the compressor's last
+    // block, or a failed close of the output is only seen here
+    std::unique_ptr<std::system_error> error;
     if (m_archive)
     {
-        archive_write_close(m_archive);
+        if (archive_write_close(m_archive) < ARCHIVE_WARN)
+        {
+            error.reset(new std::system_error(systemError()));
+        }
+
         archive_write_free(m_archive);
         m_archive = nullptr;
     }
+
+    // Releases the output held by the parallel stage
+    m_compressor.reset();
+    m_stageClose = std::function<void()>();
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // Left open if the archive failed to open
+    if (m_outputFd >= 0)
+    {
+        ::close(m_outputFd);
+        m_outputFd = -1;
+    }
+#endif
+
+    if (error)
+    {
+        throw *error;
+    }
 }
@@ -28,10 +28,20 @@
 #include "types.hpp"
 #include "archive.hpp"
 #include "archive_entry.hpp"
-
+#include "archive_read_disk.hpp"
+#include "compression_options.hpp"
+#include "disk_walker.hpp"
+#include "parallel_compressor.hpp"
+#include "user_group_cache.hpp"
+
+#include <algorithm>
+#include <ctime>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 
@@ -41,6 +51,35 @@ struct stat;
 namespace moor
 {
     class ArchiveMatch;
+    class SegmentedBuffer;
+
+    namespace detail
+    {
+        // Iterators known to address contiguous storage of single bytes,
+        // whose range can be handed to libarchive with one call.
+        template <class Iter>
+        struct IsContiguousByteIterator
+        {
+            typedef typename std::iterator_traits<Iter>::value_type value_type;
+
+            // basic_string is only portable for character types, so other
+            // types just check against vector again
+            typedef typename std::conditional<std::is_same<value_type, char>::value,
+                                              std::string,
+                                              std::vector<value_type>>::type string_type;
+
+            static constexpr bool contiguous =
+                std::is_pointer<Iter>::value
+                || std::is_same<Iter, typename std::vector<value_type>::iterator>::value
+                || std::is_same<Iter, typename std::vector<value_type>::const_iterator>::value
+                || std::is_same<Iter, typename string_type::iterator>::value
+                || std::is_same<Iter, typename string_type::const_iterator>::value;
+
+            static constexpr bool value = contiguous
+                && sizeof(value_type) == 1
+                && std::is_trivially_copyable<value_type>::value;
+        };
+    }
 
     class MOOR_API ArchiveWriter : public Archive
     {
@@ -102,16 +141,106 @@ namespace moor
         const Filter m_filter;
         std::unique_ptr<WriterCallbackData> m_callbackData;
         std::unique_ptr<char[]> m_buffer;
+        bool m_opened;
+
+        struct FreeDeleter
+        {
+            void operator()(void* p) const;
+        };
+
+        // Aligned buffer for reading files below the map threshold
+        std::unique_ptr<char, FreeDeleter> m_fileBuffer;
+        size_t m_fileBlockSize;
+        std::int64_t m_mapThreshold;
+
+        // Whether the last header written was a regular file's. Other
+        // entries have no content for writeFileData() to write.
+        bool m_entryRegular;
+
+        // Resolves metadata for addHeader(path), created on first use
+        std::unique_ptr<ArchiveReadDisk> m_disk;
+        std::shared_ptr<UserGroupCache> m_userGroupCache;
+
+        // With parallel compression, libarchive writes the uncompressed
+        // stream into the compressor, which writes to the real output.
+        const CompressionOptions m_compression;
+        std::unique_ptr<ParallelCompressor> m_compressor;
+        std::function<void()> m_stageClose;
+
+        // An uncompressed tar file is written by the writer itself rather
+        // than by libarchive, so that writeFileData() can copy content
+        // straight from file to file. Copied bytes are stood in for by
+        // zeros that libarchive writes at the end of the entry, which the
+        // write callback skips over. Other writes are gathered into whole
+        // blocks, which are flushed before a copy.
+        int m_outputFd;
+        std::uint64_t m_outputOffset;
+        std::uint64_t m_skipBytes;
+        std::unique_ptr<char[]> m_outputBlock;
+        size_t m_outputBlockSize;
+        size_t m_outputBuffered;
+
+        // Size of the current entry's data while it can still be copied,
+        // -1 once any data has been written or the entry doesn't qualify
+        std::int64_t m_entryDataSize;
+
+        // Offset and length of each data run the current entry's pax
+        // sparse map stores, in order, empty if it isn't sparse
+        std::vector<std::pair<std::int64_t, std::int64_t>> m_entrySparse;
 
         constexpr static size_t bufferSize()
         {
             return 16 * 1024;
         }
 
+        constexpr static size_t defaultFileBlockSize()
+        {
+            return 1024 * 1024;
+        }
+
+        constexpr static std::int64_t defaultMapThreshold()
+        {
+            return 4 * 1024 * 1024;
+        }
+
+        // Granularity of the holes found in content added from memory
+        constexpr static size_t sparseBlockSize()
+        {
+            return 4096;
+        }
+
+        char* fileBuffer();
+        void readFileData(const char* path);
+        void readSparseFileData(const char* path, std::int64_t size);
+        void writeZeros(std::int64_t size);
+        ArchiveReadDisk& diskReader();
+
         static int openCallbackWrapper(archive*, void* ud);
         static ssize_t writeCallbackWrapper(archive*, void* ud, const void* buffer, size_t size);
         static int closeCallbackWrapper(archive*, void* ud);
 
+        void init();
+        void prepareForOpen();
+        int openCallbacks();
+
+        void applyOptions();
+        bool parallelCompression() const;
+        int openStage(ParallelCompressor::Sink sink,
+                      std::function<void()> closeOutput = std::function<void()>());
+        static ssize_t stageWriteWrapper(archive*, void* ud, const void* buffer, size_t size);
+        static int stageCloseWrapper(archive*, void* ud);
+
+        bool directOutput() const;
+        int openDirect(const char* path);
+        static ssize_t directWriteWrapper(archive*, void* ud, const void* buffer, size_t size);
+        static int directCloseWrapper(archive*, void* ud);
+        bool flushOutput();
+        bool copyFileData(const char* path, std::int64_t fileSize);
+
+        template <class Iter>
+        void addContentRange(Iter begin, Iter end, std::true_type);
+        template <class Iter>
+        void addContentRange(Iter begin, Iter end, std::false_type);
 
     protected:
         ArchiveWriter(archive* a)
@@ -120,40 +249,101 @@ namespace moor
               m_format(Format::Empty),
               m_filter(Filter::None),
               m_callbackData(),
-              m_buffer()
+              m_buffer(),
+              m_opened(false),
+              m_fileBuffer(),
+              m_fileBlockSize(defaultFileBlockSize()),
+              m_mapThreshold(defaultMapThreshold()),
+              m_entryRegular(false),
+              m_disk(),
+              m_userGroupCache(),
+              m_compression(),
+              m_compressor(),
+              m_stageClose(),
+              m_outputFd(-1),
+              m_outputOffset(0),
+              m_skipBytes(0),
+              m_outputBlockSize(0),
+              m_outputBuffered(0),
+              m_entryDataSize(-1),
+              m_entrySparse()
         {
         }
 
     public:
         ArchiveWriter(const std::string& archive_file_name,
                       const Format format,
-                      const Filter compression);
+                      const Filter compression,
+                      const CompressionOptions& options = CompressionOptions());
         ArchiveWriter(std::vector<unsigned char>& out_buffer,
                       const Format format,
-                      const Filter compression);
+                      const Filter compression,
+                      const CompressionOptions& options = CompressionOptions());
+        // Write into a chain of pooled segments instead of one growing
+        // vector, so the output is never reallocated and copied.
+        ArchiveWriter(SegmentedBuffer& out_buffer,
+                      const Format format,
+                      const Filter compression,
+                      const CompressionOptions& options = CompressionOptions());
         ArchiveWriter(unsigned char* out_buffer,
                       size_t* size,
                       const Format format,
-                      const Filter compression);
+                      const Filter compression,
+                      const CompressionOptions& options = CompressionOptions());
         ArchiveWriter(OpenCallback,
                       WriteCallback,
                       CloseCallback,
                       const moor::Format format_,
                       const moor::Filter filter_,
-                      void* userData = nullptr);
+                      void* userData = nullptr,
+                      const CompressionOptions& options = CompressionOptions());
 
         ArchiveWriter(WriteCallback,
                       const moor::Format format_,
                       const moor::Filter filter_,
-                      void* userData = nullptr);
+                      void* userData = nullptr,
+                      const CompressionOptions& options = CompressionOptions());
+
+        // Configure a handle without opening an output. Call reset() to
+        // start writing an archive.
+        ArchiveWriter(const moor::Format format_,
+                      const moor::Filter filter_,
+                      const CompressionOptions& options = CompressionOptions());
 
         virtual ~ArchiveWriter() override;
 
+        // Finish the current archive, if any, and start a new one with the
+        // same format and filter in the given output.
+        void reset(const std::string& archive_file_name);
+        void reset(std::vector<unsigned char>& out_buffer);
+        void reset(SegmentedBuffer& out_buffer);
+        void reset(unsigned char* out_buffer, size_t* size);
+        void reset(OpenCallback,
+                   WriteCallback,
+                   CloseCallback,
+                   void* userData = nullptr);
+        void reset(WriteCallback,
+                   void* userData = nullptr);
+
+        // Finish the current archive and set up a fresh handle, so the next
+        // reset() only has to open the output. libarchive can't reopen a
+        // handle that has been used, so this is the part of a reset that
+        // can be done ahead of time.
+        void prepare();
+
         // Add the file / directories under file_path and their content to
         // the archive
         void addDiskPath(const std::string& file_path,
                          ArchiveMatch* match = nullptr);
 
+        // Same as above, but directories are listed, entries stat'd and
+        // small files read ahead by worker threads. Entries are written in
+        // depth first order with each directory's entries sorted by name,
+        // so the output doesn't depend on thread timing.
+        void addDiskPath(const std::string& file_path,
+                         const ParallelWalkOptions& options,
+                         ArchiveMatch* match = nullptr);
+
         // Add an entry and its content from a real file
         void addFile(const std::string& file_path);
 
@@ -163,6 +353,7 @@ namespace moor
                      const Iter entry_contents_begin,
                      const Iter entry_contents_end,
                      ssize_t size = -1);
+        // With pax, whole blocks of zeros are stored as holes
         void addFile(const std::string& entry_name,
                      const void* data,
                      const size_t size);
@@ -174,17 +365,30 @@ namespace moor
         }
 
         void addDirectory(const std::string& directory_name);
+
+        // Finish the archive. Unlike the destructor, this throws if the
+        // last of the archive can't be written or the output can't be
+        // closed.
         virtual void close() override;
 
+        // True from opening an output until close() or prepare()
+        bool isOpen() const
+        {
+            return m_archive && m_opened;
+        }
+
         int writeHeader(ArchiveEntry&);
         int openFilename(const char* path);
         int openMemory(std::vector<unsigned char>& outBuf);
+        int openMemory(SegmentedBuffer& outBuf);
         int openMemory(void* buf, size_t* bufSize);
 
+        // An mtime of 0 leaves the modification time unset
         void addHeader(const std::string& entry_name,
                        const FileType entry_type,
                        const std::int64_t size = 0,
-                       const int permission = 0644);
+                       const int permission = 0644,
+                       const std::time_t mtime = 0);
         void addHeader(const std::string& file_path,
                        const struct stat* file_stat = nullptr);
         void addContent(const char byte);
@@ -193,8 +397,44 @@ namespace moor
         void addFinish();
 
         ssize_t writeData(const void* buf, size_t bufSize);
+
+        // Write the content of a file. Files of at least the map threshold
+        // are memory mapped and written straight from the mapping, smaller
+        // ones are read in aligned blocks of the file block size. Only the
+        // data runs of a file with holes are read, and the holes are
+        // written as zeros, which pax drops where its sparse map has them.
+        // Written to an uncompressed tar file as the whole of an entry's
+        // data, the content is copied by the kernel with copy_file_range.
         void writeFileData(const char* path);
 
+        void setFileBlockSize(size_t blockSize);
+        size_t getFileBlockSize() const
+        {
+            return m_fileBlockSize;
+        }
+
+        // Share user and group name lookups with other writers. With no
+        // cache set, each writer creates its own on first use.
+        void setUserGroupCache(std::shared_ptr<UserGroupCache> cache);
+        const std::shared_ptr<UserGroupCache>& userGroupCache() const
+        {
+            return m_userGroupCache;
+        }
+
+        void setMapThreshold(std::int64_t threshold);
+        std::int64_t getMapThreshold() const
+        {
+            return m_mapThreshold;
+        }
+
+        // Pass options straight to libarchive. A null module applies the
+        // option to every filter or format that recognizes it. These must
+        // be set before the archive is opened, so they are mostly useful
+        // on a writer constructed without an output, before reset().
+        int setOptions(const char* options);
+        int setFilterOption(const char* module, const char* option, const char* value);
+        int setFormatOption(const char* module, const char* option, const char* value);
+
         int setBytesPerBlock(int bytesPerBlock);
         int getBytesPerBlock() const;
 
@@ -212,13 +452,49 @@ namespace moor
                ? size
                : std::distance(entry_contents_begin, entry_contents_end);
         addHeader(entry_name, FileType::Regular, size);
+        addContentRange(entry_contents_begin,
+                        entry_contents_end,
+                        std::integral_constant<bool, detail::IsContiguousByteIterator<Iter>::value>());
+        addFinish();
+    }
+
+    template <class Iter>
+    void ArchiveWriter::addContentRange(Iter begin, Iter end, std::true_type)
+    {
+        if (begin != end)
+        {
+            addContent(&*begin, static_cast<size_t>(std::distance(begin, end)));
+        }
+    }
 
-        for (Iter it = entry_contents_begin; it != entry_contents_end; ++it)
+    // Elements are converted to bytes the same way addContent(char) would,
+    // staged through m_buffer and written a buffer at a time.
+    template <class Iter>
+    void ArchiveWriter::addContentRange(Iter begin, Iter end, std::false_type)
+    {
+        if (!m_buffer)
         {
-            addContent(*it);
+            m_buffer.reset(new char[bufferSize()]);
         }
 
-        addFinish();
+        char* const buffer = m_buffer.get();
+        size_t used = 0;
+
+        for (Iter it = begin; it != end; ++it)
+        {
+            buffer[used++] = static_cast<char>(*it);
+
+            if (used == bufferSize())
+            {
+                addContent(buffer, used);
+                used = 0;
+            }
+        }
+
+        if (used != 0)
+        {
+            addContent(buffer, used);
+        }
     }
 }
 
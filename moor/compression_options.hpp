@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <cstddef>
+#include <string>
+
+
+namespace moor
+{
+    struct MOOR_API ZipOptions
+    {
+        enum class Method
+        {
+            Default,
+            Store,
+            Deflate
+        };
+
+        Method method;
+
+        // -1 leaves zip64 extensions to libarchive, 0 disables and 1
+        // forces them
+        int zip64;
+
+        // "zipcrypt", "aes128" or "aes256". Empty for no encryption.
+        std::string encryption;
+        std::string passphrase;
+
+        // ParallelZipWriter keeps compressed entries up to this size in
+        // memory and spills larger ones to temporary files
+        size_t spillSize;
+
+        ZipOptions()
+            : method(Method::Default),
+              zip64(-1),
+              encryption(),
+              passphrase(),
+              spillSize(64 * 1024 * 1024) { }
+    };
+
+    struct MOOR_API SevenZipOptions
+    {
+        enum class Method
+        {
+            Default,
+            Store,
+            Deflate,
+            Bzip2,
+            LZMA1,
+            LZMA2,
+            PPMd
+        };
+
+        Method method;
+
+        SevenZipOptions()
+            : method(Method::Default) { }
+    };
+
+    struct MOOR_API CompressionOptions
+    {
+        // Compression level of the filter, or of the format for zip and 7z,
+        // or -1 for the default. Filters without levels ignore it.
+        int level;
+
+        // Worker threads. Xz and Zstd use libarchive's own threading. With
+        // more than one thread, Gzip and Bzip2 output is compressed in
+        // independent blocks on a pool of worker threads, in the style of
+        // pigz and pbzip2. Gzip output is still a single gzip stream.
+        // Bzip2 output is a series of concatenated bzip2 streams, which
+        // libarchive and bzip2 read in full, but a decoder that only reads
+        // a single stream stops after the first block.
+        unsigned threads;
+
+        // Uncompressed bytes per block for parallel compression, or 0 for
+        // the filter's default (128 KiB for gzip, 900 kB for bzip2)
+        size_t blockSize;
+
+        ZipOptions zip;
+        SevenZipOptions sevenZip;
+
+        // Any other libarchive options, passed to archive_write_set_options,
+        // e.g. "zstd:long=27,zip:hdrcharset=UTF-8"
+        std::string extra;
+
+        CompressionOptions()
+            : level(-1),
+              threads(1),
+              blockSize(0),
+              zip(),
+              sevenZip(),
+              extra() { }
+    };
+}
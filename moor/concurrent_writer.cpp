@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "concurrent_writer.hpp"
+#include "archive_writer.hpp"
+
+#include <archive.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+moor::ConcurrentArchiveWriter::ConcurrentArchiveWriter(ArchiveWriter& writer_,
+                                                       const ConcurrentWriterOptions& options_)
+    : m_writer(writer_),
+      m_options(options_),
+      m_mutex(),
+      m_ready(),
+      m_space(),
+      m_queue(),
+      m_queuedBytes(0),
+      m_arrivals(0),
+      m_nextWrite(0),
+      m_closing(false),
+      m_error(),
+      m_sequence(0),
+      m_thread()
+{
+    m_thread = std::thread(&ConcurrentArchiveWriter::serialize, this);
+}
+
+moor::ConcurrentArchiveWriter::~ConcurrentArchiveWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+    }
+}
+
+void moor::ConcurrentArchiveWriter::checkOpen() const
+{
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+
+    if (m_closing)
+    {
+        throw std::logic_error("ConcurrentArchiveWriter is closed");
+    }
+}
+
+bool moor::ConcurrentArchiveWriter::accepts(const EntrySubmission& entry) const
+{
+    const bool sequenced = m_options.ordering == ConcurrentWriterOptions::Ordering::Sequence;
+    const std::uint64_t key = sequenced ? entry.sequence : m_arrivals;
+
+    // The next entry to write is always let in, so a full queue of later
+    // entries can't hold it out. Stale sequence numbers are let in to be
+    // rejected by enqueue().
+    if (key <= m_nextWrite)
+    {
+        return true;
+    }
+
+    if (sequenced && key - m_nextWrite >= m_options.queueDepth)
+    {
+        return false;
+    }
+
+    return m_queue.size() < m_options.queueDepth
+        && m_queuedBytes + entry.data.size() <= m_options.queueBytes;
+}
+
+void moor::ConcurrentArchiveWriter::enqueue(EntrySubmission& entry)
+{
+    std::uint64_t key = m_arrivals++;
+
+    if (m_options.ordering == ConcurrentWriterOptions::Ordering::Sequence)
+    {
+        key = entry.sequence;
+        if (key < m_nextWrite || m_queue.count(key) != 0)
+        {
+            throw std::invalid_argument("Duplicate entry sequence number");
+        }
+    }
+
+    m_queuedBytes += entry.data.size();
+    m_queue.insert(std::make_pair(key, std::move(entry)));
+
+    if (key == m_nextWrite)
+    {
+        m_ready.notify_one();
+    }
+}
+
+void moor::ConcurrentArchiveWriter::submit(EntrySubmission&& entry)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    checkOpen();
+    m_space.wait(lock, [this, &entry] { return m_error || m_closing || accepts(entry); });
+    checkOpen();
+
+    enqueue(entry);
+}
+
+bool moor::ConcurrentArchiveWriter::trySubmit(EntrySubmission& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    checkOpen();
+    if (!accepts(entry))
+    {
+        return false;
+    }
+
+    enqueue(entry);
+    return true;
+}
+
+void moor::ConcurrentArchiveWriter::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+    }
+
+    m_ready.notify_one();
+    m_space.notify_all();
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void moor::ConcurrentArchiveWriter::serialize()
+{
+    while (true)
+    {
+        EntrySubmission entry;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [this]
+            {
+                return m_closing
+                    || (!m_queue.empty() && m_queue.begin()->first == m_nextWrite);
+            });
+
+            if (m_queue.empty() || m_queue.begin()->first != m_nextWrite)
+            {
+                if (!m_queue.empty())
+                {
+                    m_error = std::make_exception_ptr(
+                        std::logic_error("Closed with a gap in entry sequence numbers"));
+                    m_queue.clear();
+                    m_queuedBytes = 0;
+                }
+
+                return;
+            }
+
+            entry = std::move(m_queue.begin()->second);
+            m_queue.erase(m_queue.begin());
+        }
+
+        const size_t bytes = entry.data.size();
+
+        try
+        {
+            write(entry);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_error = std::current_exception();
+            m_queue.clear();
+            m_queuedBytes = 0;
+            m_space.notify_all();
+            return;
+        }
+
+        // Content counts against the queue until it has been written
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queuedBytes -= bytes;
+            ++m_nextWrite;
+        }
+
+        m_space.notify_all();
+    }
+}
+
+void moor::ConcurrentArchiveWriter::write(EntrySubmission& entry)
+{
+    if (entry.type == FileType::Directory)
+    {
+        m_writer.addHeader(entry.name, FileType::Directory, 0, entry.permission, entry.mtime);
+        m_writer.checkError(archive_write_finish_entry(m_writer.raw()));
+        return;
+    }
+
+    if (entry.type != FileType::Regular)
+    {
+        throw std::system_error(std::make_error_code(std::errc::not_supported), entry.name);
+    }
+
+    if (entry.sourcePath.empty())
+    {
+        m_writer.addHeader(entry.name,
+                           FileType::Regular,
+                           static_cast<std::int64_t>(entry.data.size()),
+                           entry.permission,
+                           entry.mtime);
+        // Unlike addContent() and addFinish(), these report a failed write
+        if (m_writer.writeData(entry.data.data(), entry.data.size()) < 0)
+        {
+            throw m_writer.systemError();
+        }
+
+        m_writer.checkError(archive_write_finish_entry(m_writer.raw()));
+        return;
+    }
+
+    struct stat st;
+    if (::stat(entry.sourcePath.c_str(), &st) < 0)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()), entry.sourcePath);
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        throw std::system_error(std::make_error_code(std::errc::not_supported), entry.sourcePath);
+    }
+
+    m_writer.addHeader(entry.name,
+                       FileType::Regular,
+                       static_cast<std::int64_t>(st.st_size),
+                       static_cast<int>(st.st_mode & 07777),
+                       st.st_mtime);
+    m_writer.writeFileData(entry.sourcePath.c_str());
+    m_writer.checkError(archive_write_finish_entry(m_writer.raw()));
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+#include "types.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace moor
+{
+    class ArchiveWriter;
+
+    // A complete entry handed to a ConcurrentArchiveWriter
+    struct MOOR_API EntrySubmission
+    {
+        std::string name;
+
+        // Regular or Directory
+        FileType type;
+
+        int permission;
+        std::time_t mtime;
+
+        // Content owned by the submission
+        std::vector<unsigned char> data;
+
+        // When set, the content is read from this file by the serializer
+        // instead, and the permission and mtime are taken from the file.
+        std::string sourcePath;
+
+        // Position in the archive with Ordering::Sequence, starting at 0
+        std::uint64_t sequence;
+
+        EntrySubmission()
+            : name(),
+              type(FileType::Regular),
+              permission(0644),
+              mtime(std::time(nullptr)),
+              data(),
+              sourcePath(),
+              sequence(0) { }
+    };
+
+    struct MOOR_API ConcurrentWriterOptions
+    {
+        enum class Ordering
+        {
+            // Entries are written in the order submissions are accepted
+            Arrival,
+
+            // Entries are written by EntrySubmission::sequence, with no
+            // gaps. Submissions more than queueDepth ahead of the next
+            // entry to write wait.
+            Sequence
+        };
+
+        Ordering ordering;
+
+        // Maximum number of submissions waiting to be written
+        size_t queueDepth;
+
+        // Maximum bytes of owned content waiting to be written. A single
+        // larger submission is accepted once it is next in line.
+        size_t queueBytes;
+
+        ConcurrentWriterOptions()
+            : ordering(Ordering::Arrival),
+              queueDepth(256),
+              queueBytes(64 * 1024 * 1024) { }
+    };
+
+    // Lets any number of threads add complete entries to one
+    // ArchiveWriter. Submissions go into a bounded queue drained by a
+    // single serializer thread, which is the only user of the writer until
+    // close(). Producers only hold the queue lock while enqueueing, never
+    // while the writer compresses, and block when the queue is full.
+    //
+    // An error from the writer stops the serializer. It is rethrown by
+    // close() and by any later submission.
+    class MOOR_API ConcurrentArchiveWriter
+    {
+    public:
+        explicit ConcurrentArchiveWriter(ArchiveWriter& writer,
+                                         const ConcurrentWriterOptions& options = ConcurrentWriterOptions());
+
+        // Waits for queued entries, ignoring errors. Call close() to see them.
+        ~ConcurrentArchiveWriter();
+
+        // Blocks while the queue is full
+        void submit(EntrySubmission&& entry);
+
+        // Returns false without taking the entry if the queue is full
+        bool trySubmit(EntrySubmission& entry);
+
+        // Hands out consecutive sequence numbers for Ordering::Sequence
+        std::uint64_t nextSequence()
+        {
+            return m_sequence++;
+        }
+
+        // Write all queued entries and stop the serializer. The
+        // ArchiveWriter is left open.
+        void close();
+
+    private:
+        ConcurrentArchiveWriter(const ConcurrentArchiveWriter&);
+        ConcurrentArchiveWriter& operator=(const ConcurrentArchiveWriter&);
+
+        bool accepts(const EntrySubmission& entry) const;
+        void enqueue(EntrySubmission& entry);
+        void checkOpen() const;
+        void serialize();
+        void write(EntrySubmission& entry);
+
+        ArchiveWriter& m_writer;
+        const ConcurrentWriterOptions m_options;
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_ready;
+        std::condition_variable m_space;
+
+        // Keyed by arrival or sequence number
+        std::map<std::uint64_t, EntrySubmission> m_queue;
+        size_t m_queuedBytes;
+        std::uint64_t m_arrivals;
+        std::uint64_t m_nextWrite;
+        bool m_closing;
+        std::exception_ptr m_error;
+
+        std::atomic<std::uint64_t> m_sequence;
+        std::thread m_thread;
+    };
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+
+namespace moor
+{
+    class Archive;
+    class ArchiveEntry;
+
+    // A view of entry data inside libarchive's buffers. It is only valid
+    // until the next block is read.
+    struct DataBlock
+    {
+        const void* data;
+        size_t size;
+        std::int64_t offset; // Offset of data within the entry
+    };
+
+    // Single pass range over the data blocks of the current entry. Blocks
+    // are not copied. A gap between the end of one block and the offset of
+    // the next is a hole in a sparse entry, and a trailing hole may be
+    // reported as an empty block at the end offset.
+    class MOOR_API DataBlockRange
+    {
+        friend class ArchiveEntry;
+
+    public:
+        class iterator
+        {
+            friend class DataBlockRange;
+
+        private:
+            DataBlockRange* m_range; // nullptr at the end
+
+            explicit iterator(DataBlockRange* range)
+                : m_range(range) { }
+
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef DataBlock value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const DataBlock* pointer;
+            typedef const DataBlock& reference;
+
+            reference operator*() const
+            {
+                return m_range->m_block;
+            }
+
+            pointer operator->() const
+            {
+                return &m_range->m_block;
+            }
+
+            iterator& operator++()
+            {
+                if (!m_range->advance())
+                {
+                    m_range = nullptr;
+                }
+
+                return *this;
+            }
+
+            bool operator==(const iterator& other) const
+            {
+                return m_range == other.m_range;
+            }
+
+            bool operator!=(const iterator& other) const
+            {
+                return m_range != other.m_range;
+            }
+        };
+
+        // Reads the first block on the first call
+        iterator begin();
+
+        iterator end()
+        {
+            return iterator(nullptr);
+        }
+
+    private:
+        explicit DataBlockRange(Archive& a)
+            : m_archive(a),
+              m_block(),
+              m_started(false),
+              m_atEnd(false) { }
+
+        // Read the next block, returning false at the end of the entry
+        bool advance();
+
+        Archive& m_archive;
+        DataBlock m_block;
+        bool m_started;
+        bool m_atEnd;
+    };
+}
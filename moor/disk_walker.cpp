@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "disk_walker.hpp"
+#include "archive.hpp"
+#include "archive_match.hpp"
+#include "archive_read_disk.hpp"
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #define MOOR_HAVE_PARALLEL_WALK 1
+  #include <dirent.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+
+namespace
+{
+    std::system_error pathError(const std::string& path)
+    {
+        return std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    std::string joinPath(const std::string& dir, const std::string& name)
+    {
+        if (!dir.empty() && dir[dir.size() - 1] == '/')
+        {
+            return dir + name;
+        }
+
+        return dir + '/' + name;
+    }
+}
+
+moor::ParallelDiskWalker::Item::Item(const std::string& path_)
+    : path(path_),
+      entry(archive_entry_new()),
+      data(),
+      prefetched(false),
+      m_seq(0),
+      m_ready(false),
+      m_error()
+{
+    if (!entry)
+    {
+        throw std::bad_alloc();
+    }
+}
+
+moor::ParallelDiskWalker::Item::~Item()
+{
+    archive_entry_free(entry);
+}
+
+moor::ParallelDiskWalker::ParallelDiskWalker(const std::string& root_,
+                                             const ParallelWalkOptions& options_,
+                                             ArchiveMatch* match_,
+                                             std::mutex* matchMutex_)
+    : m_root(root_),
+      m_options(options_),
+      m_match(match_),
+      m_matchMutex(matchMutex_),
+      m_mutex(),
+      m_workAvailable(),
+      m_progress(),
+      m_items(),
+      m_listings(),
+      m_headSeq(0),
+      m_claimSeq(0),
+      m_bytesInFlight(0),
+      m_walkDone(false),
+      m_stop(false),
+      m_walkError(),
+      m_walkDisk(),
+      m_threads()
+{
+    if (!m_options.userGroupCache)
+    {
+        m_options.userGroupCache = std::make_shared<UserGroupCache>();
+    }
+
+#ifdef MOOR_HAVE_PARALLEL_WALK
+    unsigned nWorkers = std::max(1u, m_options.threads);
+
+    try
+    {
+        for (unsigned i = 0; i < nWorkers; ++i)
+        {
+            m_threads.push_back(std::thread(&ParallelDiskWalker::work, this));
+        }
+
+        m_threads.push_back(std::thread(&ParallelDiskWalker::walk, this));
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_workAvailable.notify_all();
+        m_progress.notify_all();
+
+        for (std::thread& t : m_threads)
+        {
+            t.join();
+        }
+
+        throw;
+    }
+#else
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+#endif
+}
+
+moor::ParallelDiskWalker::~ParallelDiskWalker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_workAvailable.notify_all();
+    m_progress.notify_all();
+
+    for (std::thread& t : m_threads)
+    {
+        t.join();
+    }
+}
+
+std::unique_ptr<moor::ParallelDiskWalker::Item> moor::ParallelDiskWalker::next()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_progress.wait(lock, [this]
+    {
+        return (!m_items.empty() && m_items.front()->m_ready)
+            || (m_items.empty() && (m_walkDone || m_walkError));
+    });
+
+    if (m_items.empty())
+    {
+        if (m_walkError)
+        {
+            std::rethrow_exception(m_walkError);
+        }
+
+        return std::unique_ptr<Item>();
+    }
+
+    std::unique_ptr<Item> item(std::move(m_items.front()));
+    m_items.pop_front();
+    ++m_headSeq;
+    m_bytesInFlight -= item->data.size();
+
+    lock.unlock();
+    m_progress.notify_all();
+
+    if (item->m_error)
+    {
+        std::rethrow_exception(item->m_error);
+    }
+
+    return item;
+}
+
+#ifdef MOOR_HAVE_PARALLEL_WALK
+
+void moor::ParallelDiskWalker::walk()
+{
+    try
+    {
+        struct stat st;
+        if (::lstat(m_root.c_str(), &st) < 0)
+        {
+            throw pathError(m_root);
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (!directoryExcluded(m_root))
+            {
+                std::shared_ptr<Listing> listing = submitListing(m_root);
+                push(m_root);
+                walkDirectory(listing);
+            }
+        }
+        else
+        {
+            push(m_root);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_walkDone = true;
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_walkError = std::current_exception();
+    }
+
+    m_progress.notify_all();
+}
+
+void moor::ParallelDiskWalker::walkDirectory(const std::shared_ptr<Listing>& listing)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_progress.wait(lock, [&] { return listing->done || m_stop; });
+
+        if (m_stop)
+        {
+            return;
+        }
+    }
+
+    if (listing->error)
+    {
+        std::rethrow_exception(listing->error);
+    }
+
+    // Start listing every subdirectory now so they are ready by the time
+    // the walk reaches them.
+    const std::vector<Child>& children = listing->children;
+    std::vector<std::shared_ptr<Listing>> subdirs(children.size());
+    std::vector<bool> skip(children.size(), false);
+
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+        if (children[i].isDirectory)
+        {
+            std::string path = joinPath(listing->path, children[i].name);
+
+            if (directoryExcluded(path))
+            {
+                skip[i] = true;
+            }
+            else
+            {
+                subdirs[i] = submitListing(path);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+        if (skip[i])
+        {
+            continue;
+        }
+
+        push(joinPath(listing->path, children[i].name));
+
+        if (subdirs[i])
+        {
+            walkDirectory(subdirs[i]);
+        }
+    }
+}
+
+std::shared_ptr<moor::ParallelDiskWalker::Listing>
+moor::ParallelDiskWalker::submitListing(const std::string& path)
+{
+    std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+    listing->path = path;
+    listing->done = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_listings.push_back(listing);
+    }
+
+    m_workAvailable.notify_one();
+    return listing;
+}
+
+// Excluded directories are pruned here so their content is never walked.
+// This needs the full metadata of the directory for time and owner rules.
+bool moor::ParallelDiskWalker::directoryExcluded(const std::string& path)
+{
+    if (!m_match)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (::lstat(path.c_str(), &st) < 0)
+    {
+        throw pathError(path);
+    }
+
+    if (!m_walkDisk)
+    {
+        m_walkDisk.reset(new ArchiveReadDisk(m_options.userGroupCache));
+    }
+
+    Item item(path);
+    archive_entry_copy_pathname(item.entry, path.c_str());
+    archive_entry_copy_sourcepath(item.entry, path.c_str());
+    m_walkDisk->checkError(archive_read_disk_entry_from_file(m_walkDisk->raw(), item.entry, -1, &st));
+
+    ArchiveEntry entry(*m_walkDisk, item.entry);
+    std::unique_lock<std::mutex> lock;
+    if (m_matchMutex)
+    {
+        lock = std::unique_lock<std::mutex>(*m_matchMutex);
+    }
+
+    if (m_match->excluded(entry))
+    {
+        m_match->notifyExcluded(entry);
+        return true;
+    }
+
+    return false;
+}
+
+void moor::ParallelDiskWalker::push(const std::string& path)
+{
+    std::unique_ptr<Item> item(new Item(path));
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_progress.wait(lock, [this] { return m_items.size() < m_options.queueDepth || m_stop; });
+
+        if (m_stop)
+        {
+            return;
+        }
+
+        item->m_seq = m_headSeq + m_items.size();
+        m_items.push_back(std::move(item));
+    }
+
+    m_workAvailable.notify_one();
+}
+
+void moor::ParallelDiskWalker::work()
+{
+    // Each worker has its own disk reader, since they aren't thread-safe
+    std::unique_ptr<ArchiveReadDisk> disk;
+
+    while (true)
+    {
+        std::shared_ptr<Listing> listing;
+        Item* item = nullptr;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workAvailable.wait(lock, [this]
+            {
+                return m_stop
+                    || !m_listings.empty()
+                    || m_claimSeq < m_headSeq + m_items.size();
+            });
+
+            if (m_stop)
+            {
+                return;
+            }
+
+            // Listings come first, since the walk is blocked on them
+            if (!m_listings.empty())
+            {
+                listing = m_listings.front();
+                m_listings.pop_front();
+            }
+            else
+            {
+                item = m_items[static_cast<size_t>(m_claimSeq - m_headSeq)].get();
+                ++m_claimSeq;
+            }
+        }
+
+        if (listing)
+        {
+            try
+            {
+                list(*listing);
+            }
+            catch (...)
+            {
+                listing->error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                listing->done = true;
+            }
+        }
+        else
+        {
+            try
+            {
+                if (!disk)
+                {
+                    disk.reset(new ArchiveReadDisk(m_options.userGroupCache));
+                }
+
+                load(disk->raw(), *item);
+            }
+            catch (...)
+            {
+                item->m_error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                item->m_ready = true;
+            }
+        }
+
+        m_progress.notify_all();
+    }
+}
+
+void moor::ParallelDiskWalker::list(Listing& listing)
+{
+    DIR* dir = ::opendir(listing.path.c_str());
+    if (!dir)
+    {
+        throw pathError(listing.path);
+    }
+
+    while (struct dirent* d = ::readdir(dir))
+    {
+        std::string name(d->d_name);
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+
+        Child child;
+        child.name = name;
+
+#ifdef DT_DIR
+        if (d->d_type != DT_UNKNOWN)
+        {
+            child.isDirectory = (d->d_type == DT_DIR);
+        }
+        else
+#endif
+        {
+            struct stat st;
+            child.isDirectory = ::lstat(joinPath(listing.path, name).c_str(), &st) == 0
+                && S_ISDIR(st.st_mode);
+        }
+
+        listing.children.push_back(child);
+    }
+
+    ::closedir(dir);
+
+    std::sort(listing.children.begin(), listing.children.end(),
+              [](const Child& a, const Child& b) { return a.name < b.name; });
+}
+
+void moor::ParallelDiskWalker::load(archive* disk, Item& item)
+{
+    const char* path = item.path.c_str();
+
+    struct stat st;
+    if (::lstat(path, &st) < 0)
+    {
+        throw pathError(item.path);
+    }
+
+    int fd = -1;
+    if (S_ISREG(st.st_mode))
+    {
+        fd = ::open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0)
+        {
+            throw pathError(item.path);
+        }
+    }
+
+    archive_entry_copy_pathname(item.entry, path);
+    archive_entry_copy_sourcepath(item.entry, path);
+
+    if (archive_read_disk_entry_from_file(disk, item.entry, fd, &st) < ARCHIVE_WARN)
+    {
+        const char* errStr = archive_error_string(disk);
+        std::system_error err(archive_errno(disk), std::generic_category(), errStr ? errStr : "");
+
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        throw err;
+    }
+
+    if (fd >= 0 && static_cast<std::uint64_t>(st.st_size) <= m_options.maxPrefetchFileSize)
+    {
+        size_t size = static_cast<size_t>(st.st_size);
+        waitForBudget(item, size);
+
+        item.data.resize(size);
+        size_t done = 0;
+
+        while (done < size)
+        {
+            ssize_t n = ::pread(fd, item.data.data() + done, size - done, static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (n < 0)
+            {
+                std::system_error err = pathError(item.path);
+                ::close(fd);
+                throw err;
+            }
+
+            if (n == 0)
+            {
+                // The file shrank. The writer pads it like a streamed file.
+                break;
+            }
+
+            done += static_cast<size_t>(n);
+        }
+
+        item.data.resize(done);
+        item.prefetched = true;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bytesInFlight -= size - done;
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+void moor::ParallelDiskWalker::waitForBudget(const Item& item, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // The next entry for the consumer always gets through, so the walk
+    // can't stall on a budget held by entries behind it.
+    m_progress.wait(lock, [&]
+    {
+        return m_stop
+            || item.m_seq == m_headSeq
+            || m_bytesInFlight + size <= m_options.prefetchBytes;
+    });
+
+    m_bytesInFlight += size;
+}
+
+#else
+
+void moor::ParallelDiskWalker::walk() { }
+void moor::ParallelDiskWalker::work() { }
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+#include "user_group_cache.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+struct archive;
+struct archive_entry;
+
+namespace moor
+{
+    class ArchiveMatch;
+    class ArchiveReadDisk;
+
+    struct MOOR_API ParallelWalkOptions
+    {
+        // Threads that list directories, stat entries and prefetch content
+        unsigned threads;
+
+        // Maximum number of entries loaded ahead of the writer
+        size_t queueDepth;
+
+        // Maximum bytes of file content held in the queue
+        size_t prefetchBytes;
+
+        // Larger files are read by the writer when it reaches them
+        size_t maxPrefetchFileSize;
+
+        // Name lookups shared by the workers. One is created if unset.
+        std::shared_ptr<UserGroupCache> userGroupCache;
+
+        ParallelWalkOptions()
+            : threads(8),
+              queueDepth(1024),
+              prefetchBytes(64 * 1024 * 1024),
+              maxPrefetchFileSize(1024 * 1024),
+              userGroupCache() { }
+    };
+
+    // Walks a directory tree with a pool of worker threads and hands the
+    // entries back one at a time, in a deterministic depth first order with
+    // the entries of each directory sorted by name. Directory listings,
+    // metadata and small file content are loaded ahead of the consumer,
+    // bounded by the queue depth and prefetch byte budget.
+    //
+    // Directories excluded by the match are not descended into. All other
+    // match checks are left to the consumer. Calls to the match are made
+    // while holding matchMutex, which the consumer must also hold when it
+    // uses the match.
+    class MOOR_API ParallelDiskWalker
+    {
+    public:
+        struct Item
+        {
+            std::string path;
+            archive_entry* entry;
+
+            // Whole file content, if it was prefetched
+            std::vector<unsigned char> data;
+            bool prefetched;
+
+            Item(const std::string& path);
+            ~Item();
+
+        private:
+            friend class ParallelDiskWalker;
+
+            Item(const Item&);
+            Item& operator=(const Item&);
+
+            std::uint64_t m_seq;
+            bool m_ready;
+            std::exception_ptr m_error;
+        };
+
+        ParallelDiskWalker(const std::string& root,
+                           const ParallelWalkOptions& options = ParallelWalkOptions(),
+                           ArchiveMatch* match = nullptr,
+                           std::mutex* matchMutex = nullptr);
+        ~ParallelDiskWalker();
+
+        // The next entry in order, or null once the walk is complete.
+        // Rethrows any error hit while loading that entry or walking.
+        std::unique_ptr<Item> next();
+
+    private:
+        struct Child
+        {
+            std::string name;
+            bool isDirectory;
+        };
+
+        struct Listing
+        {
+            std::string path;
+            std::vector<Child> children;
+            bool done;
+            std::exception_ptr error;
+        };
+
+        ParallelDiskWalker(const ParallelDiskWalker&);
+        ParallelDiskWalker& operator=(const ParallelDiskWalker&);
+
+        void walk();
+        void walkDirectory(const std::shared_ptr<Listing>& listing);
+        std::shared_ptr<Listing> submitListing(const std::string& path);
+        bool directoryExcluded(const std::string& path);
+        void push(const std::string& path);
+
+        void work();
+        void list(Listing& listing);
+        void load(archive* disk, Item& item);
+        void waitForBudget(const Item& item, size_t size);
+
+        const std::string m_root;
+        ParallelWalkOptions m_options;
+        ArchiveMatch* const m_match;
+        std::mutex* const m_matchMutex;
+
+        std::mutex m_mutex;
+        std::condition_variable m_workAvailable;
+        std::condition_variable m_progress;
+
+        std::deque<std::unique_ptr<Item>> m_items;
+        std::deque<std::shared_ptr<Listing>> m_listings;
+        std::uint64_t m_headSeq;
+        std::uint64_t m_claimSeq;
+        size_t m_bytesInFlight;
+        bool m_walkDone;
+        bool m_stop;
+        std::exception_ptr m_walkError;
+
+        // Used by the walk thread for directory match checks
+        std::unique_ptr<ArchiveReadDisk> m_walkDisk;
+
+        std::vector<std::thread> m_threads;
+    };
+}
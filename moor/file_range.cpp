@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "file_range.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <unistd.h>
+#endif
+
+
+namespace
+{
+    const size_t tarBlockSize = 512;
+
+    std::system_error errnoError()
+    {
+        return std::system_error(std::error_code(errno, std::generic_category()));
+    }
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // Copy through user space, for when the kernel won't do it
+    std::uint64_t bufferedCopy(int in,
+                               std::int64_t inOffset,
+                               int out,
+                               std::int64_t outOffset,
+                               std::uint64_t size)
+    {
+        const size_t bufferSize = 1024 * 1024;
+        std::unique_ptr<char[]> buffer(new char[static_cast<size_t>(std::min<std::uint64_t>(size, bufferSize))]);
+        std::uint64_t copied = 0;
+
+        while (copied < size)
+        {
+            const size_t want = static_cast<size_t>(std::min<std::uint64_t>(size - copied, bufferSize));
+            const ssize_t n = ::pread(in, buffer.get(), want, inOffset + copied);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                throw errnoError();
+            }
+
+            if (n == 0)
+            {
+                break;
+            }
+
+            for (ssize_t done = 0; done < n; )
+            {
+                const ssize_t w = ::pwrite(out, buffer.get() + done, n - done, outOffset + copied + done);
+                if (w < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw errnoError();
+                }
+
+                done += w;
+            }
+
+            copied += n;
+        }
+
+        return copied;
+    }
+#endif
+
+    std::int64_t parseOctal(const unsigned char* p, size_t n)
+    {
+        std::int64_t value = 0;
+        size_t i = 0;
+
+        while (i < n && (p[i] == ' ' || p[i] == '0'))
+        {
+            ++i;
+        }
+
+        for (; i < n && p[i] >= '0' && p[i] <= '7'; ++i)
+        {
+            value = value * 8 + (p[i] - '0');
+        }
+
+        return value;
+    }
+
+    // Sizes too large for octal are stored in base 256 by GNU tar and
+    // libarchive, flagged by the high bit of the first byte
+    std::int64_t parseSize(const unsigned char* p)
+    {
+        if (!(p[0] & 0x80))
+        {
+            return parseOctal(p, 12);
+        }
+
+        if (p[0] & 0x40)
+        {
+            return -1;
+        }
+
+        std::int64_t value = p[0] & 0x3f;
+        for (size_t i = 1; i < 12; ++i)
+        {
+            if (value > (INT64_MAX >> 8))
+            {
+                return -1;
+            }
+
+            value = (value << 8) | p[i];
+        }
+
+        return value;
+    }
+
+    bool validChecksum(const unsigned char* header)
+    {
+        const std::int64_t expected = parseOctal(header + 148, 8);
+        std::int64_t sum = 0;
+
+        for (size_t i = 0; i < tarBlockSize; ++i)
+        {
+            sum += (i >= 148 && i < 156) ? ' ' : header[i];
+        }
+
+        return sum == expected;
+    }
+}
+
+std::uint64_t moor::detail::copyFileRange(int in,
+                                          std::int64_t inOffset,
+                                          int out,
+                                          std::int64_t outOffset,
+                                          std::uint64_t size)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    std::uint64_t copied = 0;
+
+#ifdef MOOR_HAVE_COPY_FILE_RANGE
+    loff_t inPos = inOffset;
+    loff_t outPos = outOffset;
+
+    while (copied < size)
+    {
+        const size_t chunk = static_cast<size_t>(std::min<std::uint64_t>(size - copied, 1 << 30));
+        const ssize_t n = ::copy_file_range(in, &inPos, out, &outPos, chunk, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // Not supported by the kernel, between these filesystems or
+            // for these kinds of file
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                || errno == EOPNOTSUPP)
+            {
+                break;
+            }
+
+            throw errnoError();
+        }
+
+        // Some filesystems report 0 for files they can't copy from, so
+        // let the buffered copy decide whether this is really the end
+        if (n == 0)
+        {
+            break;
+        }
+
+        copied += static_cast<std::uint64_t>(n);
+    }
+#endif
+
+    if (copied < size)
+    {
+        copied += bufferedCopy(in, inOffset + copied, out, outOffset + copied, size - copied);
+    }
+
+    return copied;
+#else
+    (void) in;
+    (void) inOffset;
+    (void) out;
+    (void) outOffset;
+    (void) size;
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported));
+#endif
+}
+
+std::int64_t moor::detail::tarDataOffset(int fd,
+                                         std::int64_t headerOffset,
+                                         std::int64_t size)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    unsigned char header[tarBlockSize];
+    std::int64_t pos = headerOffset;
+
+    // Bounds the walk through a damaged or hostile chain of extensions
+    for (int headers = 0; headers < 16; ++headers)
+    {
+        if (::pread(fd, header, sizeof(header), pos) != static_cast<ssize_t>(sizeof(header))
+            || !validChecksum(header))
+        {
+            return -1;
+        }
+
+        const std::int64_t recorded = parseSize(header + 124);
+        if (recorded < 0)
+        {
+            return -1;
+        }
+
+        pos += tarBlockSize;
+
+        switch (header[156])
+        {
+        case 'x':
+        case 'g':
+        case 'L':
+        case 'K':
+            pos += (recorded + tarBlockSize - 1) / tarBlockSize * tarBlockSize;
+            break;
+        case '0':
+        case '7':
+        case '\0':
+            return recorded == size ? pos : -1;
+        default:
+            return -1;
+        }
+    }
+#else
+    (void) fd;
+    (void) headerOffset;
+    (void) size;
+#endif
+
+    return -1;
+}
+
+std::vector<moor::detail::DataRun> moor::detail::fileDataRuns(int fd, std::int64_t size)
+{
+    std::vector<DataRun> runs;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // Fails where holes can't be found at all. Filesystems that can't
+    // track holes report the whole file as data.
+    if (::lseek(fd, 0, SEEK_HOLE) >= 0)
+    {
+        std::int64_t pos = 0;
+        while (pos < size)
+        {
+            const off_t data = ::lseek(fd, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO)
+            {
+                // Nothing but a hole to the end of the file
+                return runs;
+            }
+
+            if (data < 0)
+            {
+                runs.clear();
+                break;
+            }
+
+            if (data >= size)
+            {
+                return runs;
+            }
+
+            off_t hole = ::lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > size)
+            {
+                hole = size;
+            }
+
+            DataRun run = { data, hole - data };
+            runs.push_back(run);
+            pos = hole;
+        }
+
+        if (pos >= size)
+        {
+            return runs;
+        }
+    }
+#endif
+
+    if (size > 0)
+    {
+        DataRun run = { 0, size };
+        runs.push_back(run);
+    }
+
+    return runs;
+}
+
+std::vector<moor::detail::DataRun> moor::detail::memoryDataRuns(const void* data,
+                                                                size_t size,
+                                                                size_t blockSize)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    std::vector<DataRun> runs;
+    bool inRun = false;
+
+    for (size_t offset = 0; offset < size; offset += blockSize)
+    {
+        const size_t n = std::min(blockSize, size - offset);
+
+        // All zero if the first byte is, and each byte equals the next
+        const bool zero = p[offset] == 0
+                       && std::memcmp(p + offset, p + offset + 1, n - 1) == 0;
+
+        if (zero)
+        {
+            inRun = false;
+        }
+        else if (inRun)
+        {
+            runs.back().length += static_cast<std::int64_t>(n);
+        }
+        else
+        {
+            DataRun run = { static_cast<std::int64_t>(offset), static_cast<std::int64_t>(n) };
+            runs.push_back(run);
+            inRun = true;
+        }
+    }
+
+    return runs;
+}
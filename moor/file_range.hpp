@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace moor
+{
+    namespace detail
+    {
+        // A run of a file's content that holds data, outside any hole
+        struct DataRun
+        {
+            std::int64_t offset;
+            std::int64_t length;
+        };
+
+        // Copy size bytes between two descriptors at the given offsets
+        // without changing either file position. copy_file_range is used
+        // where available, which keeps the data in the kernel and lets
+        // filesystems that share extents (btrfs, XFS, NFS and others)
+        // make the copy a reflink. Otherwise, and when the kernel refuses
+        // the pair of files, the data is copied through a buffer.
+        //
+        // Returns the number of bytes copied, which is only short of size
+        // when the input ends. Throws std::system_error on failure.
+        std::uint64_t copyFileRange(int in,
+                                    std::int64_t inOffset,
+                                    int out,
+                                    std::int64_t outOffset,
+                                    std::uint64_t size);
+
+        // Find where the data of the entry whose header starts at
+        // headerOffset is stored in an uncompressed tar file. Extended
+        // headers (pax 'x' and 'g', GNU 'L' and 'K') before the entry's
+        // own header are skipped. Returns -1 if the headers there don't
+        // checksum or the entry's header doesn't record size bytes of
+        // contiguous data, so that the caller can read the entry normally.
+        std::int64_t tarDataOffset(int fd,
+                                   std::int64_t headerOffset,
+                                   std::int64_t size);
+
+        // The runs of data in the first size bytes of a file, found with
+        // SEEK_DATA and SEEK_HOLE. Without those, or on a filesystem that
+        // doesn't support them, the whole file is one run.
+        std::vector<DataRun> fileDataRuns(int fd, std::int64_t size);
+
+        // The runs of data in a buffer, leaving out blocks of blockSize
+        // bytes, aligned to the start of the buffer, that are all zero.
+        // A buffer of only zeros has no runs.
+        std::vector<DataRun> memoryDataRuns(const void* data,
+                                            size_t size,
+                                            size_t blockSize);
+    }
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #define MOOR_HAVE_MMAP 1
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+
+namespace
+{
+    std::system_error lastSystemError(const std::string& path)
+    {
+        return std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    // Reads until EOF rather than by size, which a FIFO or other stream
+    // doesn't have
+#ifdef MOOR_HAVE_MMAP
+    void readWholeFile(int fd, const std::string& path, std::vector<unsigned char>& out)
+    {
+        const size_t chunk = 64 * 1024;
+        size_t size = 0;
+
+        while (true)
+        {
+            out.resize(size + chunk);
+            ssize_t n = ::read(fd, out.data() + size, chunk);
+            if (n == 0)
+            {
+                break;
+            }
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                throw lastSystemError(path);
+            }
+
+            size += static_cast<size_t>(n);
+        }
+
+        out.resize(size);
+    }
+#else
+    void readWholeFile(const std::string& path, std::vector<unsigned char>& out)
+    {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            throw lastSystemError(path);
+        }
+
+        const size_t chunk = 64 * 1024;
+        size_t size = 0;
+
+        while (true)
+        {
+            out.resize(size + chunk);
+            size_t n = std::fread(out.data() + size, 1, chunk, file);
+            size += n;
+
+            if (n < chunk)
+            {
+                break;
+            }
+        }
+
+        const bool failed = std::ferror(file) != 0;
+        std::system_error err = lastSystemError(path);
+        std::fclose(file);
+
+        if (failed)
+        {
+            throw err;
+        }
+
+        out.resize(size);
+    }
+#endif
+}
+
+moor::MappedFile::MappedFile(const std::string& path_)
+    : m_path(path_),
+      m_data(nullptr),
+      m_size(0),
+      m_mapped(false),
+      m_fallback()
+{
+#ifdef MOOR_HAVE_MMAP
+    int fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw lastSystemError(m_path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        std::system_error err = lastSystemError(m_path);
+        ::close(fd);
+        throw err;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            m_data = p;
+            m_size = static_cast<size_t>(st.st_size);
+            m_mapped = true;
+        }
+    }
+
+    if (m_mapped)
+    {
+        ::close(fd);
+        advise(Advice::Sequential);
+        advise(Advice::WillNeed);
+        return;
+    }
+
+    // Empty, special or otherwise unmappable file, read from the same
+    // descriptor, since a FIFO can't be opened again
+    try
+    {
+        readWholeFile(fd, m_path, m_fallback);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+#else
+    readWholeFile(m_path, m_fallback);
+#endif
+
+    m_data = m_fallback.data();
+    m_size = m_fallback.size();
+}
+
+moor::MappedFile::MappedFile(MappedFile&& old)
+    : m_path(std::move(old.m_path)),
+      m_data(old.m_data),
+      m_size(old.m_size),
+      m_mapped(old.m_mapped),
+      m_fallback(std::move(old.m_fallback))
+{
+    old.m_data = nullptr;
+    old.m_size = 0;
+    old.m_mapped = false;
+}
+
+moor::MappedFile::~MappedFile()
+{
+#ifdef MOOR_HAVE_MMAP
+    if (m_mapped)
+    {
+        munmap(m_data, m_size);
+    }
+#endif
+}
+
+bool moor::MappedFile::advise(Advice advice)
+{
+#ifdef MOOR_HAVE_MMAP
+    if (!m_mapped)
+    {
+        return false;
+    }
+
+    int flag = MADV_NORMAL;
+    switch (advice)
+    {
+        case Advice::Normal:
+            flag = MADV_NORMAL;
+            break;
+        case Advice::Sequential:
+            flag = MADV_SEQUENTIAL;
+            break;
+        case Advice::Random:
+            flag = MADV_RANDOM;
+            break;
+        case Advice::WillNeed:
+            flag = MADV_WILLNEED;
+            break;
+        case Advice::DontNeed:
+            flag = MADV_DONTNEED;
+            break;
+    }
+
+    return (madvise(m_data, m_size, flag) == 0);
+#else
+    (void) advice;
+    return false;
+#endif
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+namespace moor
+{
+    // Read-only view of an entire file. The file is mapped where mmap is
+    // available, otherwise it is read into memory.
+    class MOOR_API MappedFile
+    {
+    public:
+        enum class Advice
+        {
+            Normal,
+            Sequential,
+            Random,
+            WillNeed,
+            DontNeed
+        };
+
+        // The mapping is advised as sequential and will-need by default,
+        // which is the access pattern of reading an archive front to back.
+        explicit MappedFile(const std::string& path);
+        MappedFile(MappedFile&& old);
+        ~MappedFile();
+
+        // Hint the expected access pattern to the kernel. Returns false if
+        // the hint was rejected or mapping isn't supported.
+        bool advise(Advice advice);
+
+        const void* data() const
+        {
+            return m_data;
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        const std::string& path() const
+        {
+            return m_path;
+        }
+
+        bool isMapped() const
+        {
+            return m_mapped;
+        }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        std::string m_path;
+        void* m_data;
+        size_t m_size;
+        bool m_mapped;
+
+        // Only used when the file could not be mapped
+        std::vector<unsigned char> m_fallback;
+    };
+}
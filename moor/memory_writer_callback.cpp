@@ -23,11 +23,10 @@
  */
 
 #include "memory_writer_callback.hpp"
+#include "segmented_buffer.hpp"
 
 #include <archive.h>
 
-#include <iterator>
-
 using namespace moor;
 
 struct write_memory_data
@@ -36,6 +35,7 @@ struct write_memory_data
     //size_t size;
     //size_t* client_size;
     std::vector<unsigned char>* buff;
+    SegmentedBuffer* segmented;
 };
 
 static int moor_memory_write_open(archive* a, void* /* client_data */)
@@ -68,10 +68,16 @@ static ssize_t moor_memory_write(archive*,
     mine->used += length;
     if (mine->client_size != 0)
       *mine->client_size = mine->used;*/
-    const unsigned char* p = reinterpret_cast<const unsigned char*>(buff);
-    std::copy(p,
-              p + length,
-              std::back_inserter(*mine->buff));
+    if (mine->segmented)
+    {
+        mine->segmented->append(buff, length);
+    }
+    else
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(buff);
+        mine->buff->insert(mine->buff->end(), p, p + length);
+    }
+
     return static_cast<ssize_t>(length);
 }
 
@@ -88,6 +94,7 @@ int moor::write_open_memory(archive* a, std::vector<unsigned char>& buff)
     write_memory_data* mine = new write_memory_data();
 
     mine->buff = &buff;
+    mine->segmented = nullptr;
     //mine->size = buffSize;
     //mine->client_size = used;
     return archive_write_open(a,
@@ -97,3 +104,16 @@ int moor::write_open_memory(archive* a, std::vector<unsigned char>& buff)
                               moor_memory_write_close);
 }
 
+
+int moor::write_open_memory(archive* a, SegmentedBuffer& buff)
+{
+    write_memory_data* mine = new write_memory_data();
+
+    mine->buff = nullptr;
+    mine->segmented = &buff;
+    return archive_write_open(a,
+                              mine,
+                              moor_memory_write_open,
+                              moor_memory_write,
+                              moor_memory_write_close);
+}
@@ -30,5 +30,8 @@ struct archive;
 
 namespace moor
 {
+    class SegmentedBuffer;
+
     int write_open_memory(archive* a, std::vector<unsigned char>& buff);
+    int write_open_memory(archive* a, SegmentedBuffer& buff);
 }
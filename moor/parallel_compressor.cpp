@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "parallel_compressor.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef MOOR_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
+#ifdef MOOR_HAVE_BZIP2
+  #include <bzlib.h>
+#endif
+
+
+namespace
+{
+    const size_t gzipWindow = 32 * 1024;
+
+    std::runtime_error compressionError(const char* what)
+    {
+        return std::runtime_error(std::string("parallel compression failed: ") + what);
+    }
+}
+
+bool moor::ParallelCompressor::supports(Filter filter)
+{
+    switch (filter)
+    {
+#ifdef MOOR_HAVE_ZLIB
+    case Filter::Gzip:
+        return true;
+#endif
+#ifdef MOOR_HAVE_BZIP2
+    case Filter::Bzip2:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+moor::ParallelCompressor::ParallelCompressor(Filter filter_,
+                                             const CompressionOptions& options_,
+                                             Sink sink_)
+    : m_filter(filter_),
+      m_level(options_.level),
+      m_blockSize(options_.blockSize != 0
+                  ? options_.blockSize
+                  : (filter_ == Filter::Bzip2 ? 900 * 1000 : 128 * 1024)),
+      m_maxPending(2 * std::max(1u, options_.threads)),
+      m_sink(std::move(sink_)),
+      m_current(),
+      m_dictionary(),
+      m_pending(),
+      m_mutex(),
+      m_workAvailable(),
+      m_jobDone(),
+      m_queue(),
+      m_stop(false),
+      m_headerWritten(false),
+      m_finished(false),
+      m_crc(0),
+      m_totalIn(0),
+      m_threads()
+{
+    if (!supports(m_filter))
+    {
+        throw std::system_error(std::make_error_code(std::errc::not_supported));
+    }
+
+    m_current.reserve(m_blockSize);
+
+    try
+    {
+        for (unsigned i = 0; i < std::max(1u, options_.threads); ++i)
+        {
+            m_threads.push_back(std::thread(&ParallelCompressor::work, this));
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+}
+
+moor::ParallelCompressor::~ParallelCompressor()
+{
+    stop();
+}
+
+void moor::ParallelCompressor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_workAvailable.notify_all();
+
+    for (std::thread& t : m_threads)
+    {
+        t.join();
+    }
+
+    m_threads.clear();
+}
+
+void moor::ParallelCompressor::write(const void* data_, size_t size_)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data_);
+
+    while (size_ > 0)
+    {
+        size_t n = std::min(size_, m_blockSize - m_current.size());
+        m_current.insert(m_current.end(), p, p + n);
+        p += n;
+        size_ -= n;
+
+        if (m_current.size() == m_blockSize)
+        {
+            submit(false);
+            drain(m_maxPending);
+        }
+    }
+}
+
+void moor::ParallelCompressor::finish()
+{
+    if (m_finished)
+    {
+        return;
+    }
+
+    m_finished = true;
+
+    // A bzip2 stream needs no terminator, so an empty final block is only
+    // needed when there was no input at all.
+    if (m_filter != Filter::Bzip2 || !m_current.empty() || m_totalIn == 0)
+    {
+        submit(true);
+    }
+
+    drain(0);
+
+    if (m_filter == Filter::Gzip)
+    {
+        unsigned char trailer[8];
+        std::uint32_t isize = static_cast<std::uint32_t>(m_totalIn);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            trailer[i] = static_cast<unsigned char>(m_crc >> (8 * i));
+            trailer[4 + i] = static_cast<unsigned char>(isize >> (8 * i));
+        }
+
+        m_sink(trailer, sizeof(trailer));
+    }
+}
+
+void moor::ParallelCompressor::submit(bool last)
+{
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->inputSize = m_current.size();
+    job->crc = 0;
+    job->last = last;
+    job->done = false;
+
+    if (m_filter == Filter::Gzip)
+    {
+        job->dictionary = m_dictionary;
+
+        size_t keep = std::min(gzipWindow, m_current.size());
+        m_dictionary.assign(m_current.end() - static_cast<std::ptrdiff_t>(keep), m_current.end());
+    }
+
+    job->input.swap(m_current);
+    m_current.clear();
+    m_current.reserve(m_blockSize);
+    m_totalIn += job->inputSize;
+
+    m_pending.push_back(job);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(job);
+    }
+
+    m_workAvailable.notify_one();
+}
+
+// Write out finished jobs in order, waiting until no more than maxPending
+// remain in flight.
+void moor::ParallelCompressor::drain(size_t maxPending)
+{
+    while (!m_pending.empty())
+    {
+        std::shared_ptr<Job> job = m_pending.front();
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!job->done)
+            {
+                if (m_pending.size() <= maxPending)
+                {
+                    return;
+                }
+
+                m_jobDone.wait(lock, [&job] { return job->done; });
+            }
+        }
+
+        m_pending.pop_front();
+
+        if (job->error)
+        {
+            std::rethrow_exception(job->error);
+        }
+
+        if (!m_headerWritten && m_filter == Filter::Gzip)
+        {
+            // No name or timestamp, so the output only depends on the input
+            static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+            m_sink(header, sizeof(header));
+        }
+
+        m_headerWritten = true;
+
+#ifdef MOOR_HAVE_ZLIB
+        if (m_filter == Filter::Gzip)
+        {
+            m_crc = static_cast<std::uint32_t>(crc32_combine(m_crc, job->crc, static_cast<z_off_t>(job->inputSize)));
+        }
+#endif
+
+        if (!job->output.empty())
+        {
+            m_sink(job->output.data(), job->output.size());
+        }
+    }
+}
+
+void moor::ParallelCompressor::work()
+{
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workAvailable.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+
+            if (m_stop)
+            {
+                return;
+            }
+
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        try
+        {
+            compress(*job);
+        }
+        catch (...)
+        {
+            job->error = std::current_exception();
+        }
+
+        // The input is no longer needed once compressed
+        std::vector<unsigned char>().swap(job->input);
+        std::vector<unsigned char>().swap(job->dictionary);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job->done = true;
+        }
+
+        m_jobDone.notify_all();
+    }
+}
+
+void moor::ParallelCompressor::compress(Job& job) const
+{
+    if (m_filter == Filter::Gzip)
+    {
+        compressGzip(job);
+    }
+    else
+    {
+        compressBzip2(job);
+    }
+}
+
+#ifdef MOOR_HAVE_ZLIB
+void moor::ParallelCompressor::compressGzip(Job& job) const
+{
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+
+    int level = m_level < 0 ? Z_DEFAULT_COMPRESSION : std::min(m_level, 9);
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw compressionError("deflateInit2");
+    }
+
+    if (!job.dictionary.empty())
+    {
+        deflateSetDictionary(&strm, job.dictionary.data(), static_cast<uInt>(job.dictionary.size()));
+    }
+
+    // Room for the worst case plus the sync flush marker
+    job.output.resize(deflateBound(&strm, static_cast<uLong>(job.input.size())) + 64);
+
+    strm.next_in = job.input.empty() ? Z_NULL : job.input.data();
+    strm.avail_in = static_cast<uInt>(job.input.size());
+    strm.next_out = job.output.data();
+    strm.avail_out = static_cast<uInt>(job.output.size());
+
+    int flush = job.last ? Z_FINISH : Z_SYNC_FLUSH;
+    int r;
+
+    while (true)
+    {
+        r = deflate(&strm, flush);
+        if (r == Z_STREAM_ERROR)
+        {
+            deflateEnd(&strm);
+            throw compressionError("deflate");
+        }
+
+        if (strm.avail_out != 0 || r == Z_STREAM_END)
+        {
+            break;
+        }
+
+        size_t used = job.output.size();
+        job.output.resize(used * 2);
+        strm.next_out = job.output.data() + used;
+        strm.avail_out = static_cast<uInt>(job.output.size() - used);
+    }
+
+    job.output.resize(job.output.size() - strm.avail_out);
+    deflateEnd(&strm);
+
+    job.crc = static_cast<std::uint32_t>(crc32(0, job.input.empty() ? Z_NULL : job.input.data(),
+                                               static_cast<uInt>(job.input.size())));
+}
+#else
+void moor::ParallelCompressor::compressGzip(Job&) const
+{
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+}
+#endif
+
+#ifdef MOOR_HAVE_BZIP2
+void moor::ParallelCompressor::compressBzip2(Job& job) const
+{
+    int blockSize100k = m_level < 1 ? 9 : std::min(m_level, 9);
+
+    // Documented worst case: 1% larger plus 600 bytes
+    unsigned int outSize = static_cast<unsigned int>(job.input.size() + job.input.size() / 100 + 600);
+    job.output.resize(outSize);
+
+    int r = BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(job.output.data()),
+                                     &outSize,
+                                     reinterpret_cast<char*>(job.input.data()),
+                                     static_cast<unsigned int>(job.input.size()),
+                                     blockSize100k,
+                                     0,
+                                     0);
+    if (r != BZ_OK)
+    {
+        throw compressionError("BZ2_bzBuffToBuffCompress");
+    }
+
+    job.output.resize(outSize);
+}
+#else
+void moor::ParallelCompressor::compressBzip2(Job&) const
+{
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+}
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+#include "compression_options.hpp"
+#include "types.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace moor
+{
+    // Compresses a byte stream in fixed-size blocks on worker threads and
+    // passes the output to a sink in order.
+    //
+    // Gzip blocks are raw deflate streams primed with the previous block's
+    // last 32 KiB as the dictionary and ended with a sync flush, joined
+    // under a single gzip header and trailer. Bzip2 blocks are complete
+    // bzip2 streams, which decompressors read back to back.
+    class MOOR_API ParallelCompressor
+    {
+    public:
+        // Throws to report a failed write
+        typedef std::function<void(const void*, size_t)> Sink;
+
+        ParallelCompressor(Filter filter,
+                           const CompressionOptions& options,
+                           Sink sink);
+
+        // Stops the workers. Output not yet finished is dropped.
+        ~ParallelCompressor();
+
+        // Rethrows errors from earlier blocks
+        void write(const void* data, size_t size);
+
+        // Compress what is left and end the stream
+        void finish();
+
+        // Whether the filter has a parallel implementation in this build
+        static bool supports(Filter filter);
+
+    private:
+        struct Job
+        {
+            std::vector<unsigned char> input;
+            std::vector<unsigned char> dictionary;
+            std::vector<unsigned char> output;
+            size_t inputSize;
+            std::uint32_t crc;
+            bool last;
+            bool done;
+            std::exception_ptr error;
+        };
+
+        ParallelCompressor(const ParallelCompressor&);
+        ParallelCompressor& operator=(const ParallelCompressor&);
+
+        void submit(bool last);
+        void drain(size_t maxPending);
+        void work();
+        void compress(Job& job) const;
+        void compressGzip(Job& job) const;
+        void compressBzip2(Job& job) const;
+        void stop();
+
+        const Filter m_filter;
+        const int m_level;
+        const size_t m_blockSize;
+        const size_t m_maxPending;
+        Sink m_sink;
+
+        std::vector<unsigned char> m_current;
+        std::vector<unsigned char> m_dictionary;
+
+        // Jobs in output order, completed or not
+        std::deque<std::shared_ptr<Job>> m_pending;
+
+        std::mutex m_mutex;
+        std::condition_variable m_workAvailable;
+        std::condition_variable m_jobDone;
+        std::deque<std::shared_ptr<Job>> m_queue;
+        bool m_stop;
+
+        bool m_headerWritten;
+        bool m_finished;
+        std::uint32_t m_crc;
+        std::uint64_t m_totalIn;
+
+        std::vector<std::thread> m_threads;
+    };
+}
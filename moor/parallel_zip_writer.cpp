@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "parallel_zip_writer.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef MOOR_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
+
+struct moor::ParallelZipWriter::Job
+{
+    std::string name;
+    std::vector<unsigned char> input;
+    std::string sourcePath;
+    bool directory;
+    std::uint32_t mode;
+    std::time_t mtime;
+
+    std::vector<unsigned char> output;
+    std::shared_ptr<std::FILE> spill;
+    std::uint64_t compressedSize;
+    std::uint64_t size;
+    std::uint32_t crc;
+    std::uint16_t method;
+
+    bool done;
+    std::exception_ptr error;
+
+    Job()
+        : name(),
+          input(),
+          sourcePath(),
+          directory(false),
+          mode(0),
+          mtime(0),
+          output(),
+          spill(),
+          compressedSize(0),
+          size(0),
+          crc(0),
+          method(0),
+          done(false),
+          error() { }
+};
+
+namespace
+{
+    const std::uint16_t methodStore = 0;
+    const std::uint16_t methodDeflate = 8;
+    const std::uint32_t max32 = 0xffffffff;
+    const std::uint16_t versionDefault = 20;
+    const std::uint16_t versionZip64 = 45;
+    const std::uint16_t madeByUnix = 3 << 8;
+    const std::uint16_t flagUtf8 = 1 << 11;
+
+    // Little endian record builder
+    class Record
+    {
+    public:
+        std::vector<unsigned char> bytes;
+
+        void u16(std::uint32_t v)
+        {
+            bytes.push_back(static_cast<unsigned char>(v));
+            bytes.push_back(static_cast<unsigned char>(v >> 8));
+        }
+
+        void u32(std::uint32_t v)
+        {
+            u16(v & 0xffff);
+            u16(v >> 16);
+        }
+
+        void u64(std::uint64_t v)
+        {
+            u32(static_cast<std::uint32_t>(v));
+            u32(static_cast<std::uint32_t>(v >> 32));
+        }
+
+        void append(const void* data, size_t size)
+        {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            bytes.insert(bytes.end(), p, p + size);
+        }
+    };
+
+    std::uint32_t dosDateTime(std::time_t t)
+    {
+        struct tm tm;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        localtime_s(&tm, &t);
+#else
+        localtime_r(&t, &tm);
+#endif
+
+        if (tm.tm_year < 80)
+        {
+            // DOS dates start in 1980
+            return (1 << 21) | (1 << 16);
+        }
+
+        return static_cast<std::uint32_t>((tm.tm_year - 80) << 25
+                                          | (tm.tm_mon + 1) << 21
+                                          | tm.tm_mday << 16
+                                          | tm.tm_hour << 11
+                                          | tm.tm_min << 5
+                                          | tm.tm_sec / 2);
+    }
+
+    // Extended timestamp with the modification time in UTC
+    void timestampExtra(Record& r, std::time_t mtime)
+    {
+        r.u16(0x5455);
+        r.u16(5);
+        r.bytes.push_back(1);
+        r.u32(static_cast<std::uint32_t>(mtime));
+    }
+
+    std::system_error lastError(const std::string& what)
+    {
+        return std::system_error(std::error_code(errno, std::generic_category()), what);
+    }
+}
+
+moor::ParallelZipWriter::ParallelZipWriter(const std::string& archive_file_name_,
+                                           const CompressionOptions& options_)
+    : m_sink(),
+      m_file(),
+      m_options(options_),
+      m_maxPending(4 * std::max(1u, options_.threads)),
+      m_pending(),
+      m_central(),
+      m_offset(0),
+      m_closed(false),
+      m_mutex(),
+      m_workAvailable(),
+      m_jobDone(),
+      m_queue(),
+      m_stop(false),
+      m_threads()
+{
+    std::FILE* f = std::fopen(archive_file_name_.c_str(), "wb");
+    if (!f)
+    {
+        throw lastError(archive_file_name_);
+    }
+
+    m_file.reset(f, std::fclose);
+    std::shared_ptr<std::FILE> file(m_file);
+
+    m_sink = [file](const void* data, size_t size)
+    {
+        if (std::fwrite(data, 1, size, file.get()) != size)
+        {
+            throw std::system_error(std::error_code(errno, std::generic_category()));
+        }
+    };
+
+    start();
+}
+
+moor::ParallelZipWriter::ParallelZipWriter(std::vector<unsigned char>& out_buffer_,
+                                           const CompressionOptions& options_)
+    : m_sink(),
+      m_file(),
+      m_options(options_),
+      m_maxPending(4 * std::max(1u, options_.threads)),
+      m_pending(),
+      m_central(),
+      m_offset(0),
+      m_closed(false),
+      m_mutex(),
+      m_workAvailable(),
+      m_jobDone(),
+      m_queue(),
+      m_stop(false),
+      m_threads()
+{
+    std::vector<unsigned char>* out = &out_buffer_;
+
+    m_sink = [out](const void* data, size_t size)
+    {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        out->insert(out->end(), p, p + size);
+    };
+
+    start();
+}
+
+moor::ParallelZipWriter::ParallelZipWriter(Sink sink_,
+                                           const CompressionOptions& options_)
+    : m_sink(std::move(sink_)),
+      m_file(),
+      m_options(options_),
+      m_maxPending(4 * std::max(1u, options_.threads)),
+      m_pending(),
+      m_central(),
+      m_offset(0),
+      m_closed(false),
+      m_mutex(),
+      m_workAvailable(),
+      m_jobDone(),
+      m_queue(),
+      m_stop(false),
+      m_threads()
+{
+    start();
+}
+
+moor::ParallelZipWriter::~ParallelZipWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+    }
+
+    stop();
+}
+
+void moor::ParallelZipWriter::start()
+{
+#ifdef MOOR_HAVE_ZLIB
+    try
+    {
+        for (unsigned i = 0; i < std::max(1u, m_options.threads); ++i)
+        {
+            m_threads.push_back(std::thread(&ParallelZipWriter::work, this));
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+#else
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+#endif
+}
+
+void moor::ParallelZipWriter::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_workAvailable.notify_all();
+
+    for (std::thread& t : m_threads)
+    {
+        t.join();
+    }
+
+    m_threads.clear();
+}
+
+void moor::ParallelZipWriter::addFile(const std::string& entry_name,
+                                      std::vector<unsigned char>&& content,
+                                      int permission,
+                                      std::time_t mtime)
+{
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->name = entry_name;
+    job->input = std::move(content);
+    job->mode = 0100000 | (static_cast<std::uint32_t>(permission) & 07777);
+    job->mtime = mtime;
+
+    submit(job);
+}
+
+void moor::ParallelZipWriter::addFile(const std::string& entry_name,
+                                      const void* data,
+                                      size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    addFile(entry_name, std::vector<unsigned char>(p, p + size));
+}
+
+void moor::ParallelZipWriter::addFile(const std::string& file_path)
+{
+    struct stat st;
+    if (::stat(file_path.c_str(), &st) < 0)
+    {
+        throw lastError(file_path);
+    }
+
+    if ((st.st_mode & S_IFMT) == S_IFDIR)
+    {
+        addDirectory(file_path, st.st_mode & 07777);
+        return;
+    }
+
+    if ((st.st_mode & S_IFMT) != S_IFREG)
+    {
+        throw std::system_error(std::make_error_code(std::errc::not_supported), file_path);
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->name = file_path;
+    job->sourcePath = file_path;
+    job->mode = 0100000 | (static_cast<std::uint32_t>(st.st_mode) & 07777);
+    job->mtime = st.st_mtime;
+
+    submit(job);
+}
+
+void moor::ParallelZipWriter::addDirectory(const std::string& directory_name, int permission)
+{
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->name = directory_name;
+    if (job->name.empty() || job->name[job->name.size() - 1] != '/')
+    {
+        job->name += '/';
+    }
+
+    job->directory = true;
+    job->mode = 040000 | (static_cast<std::uint32_t>(permission) & 07777);
+    job->mtime = std::time(nullptr);
+
+    submit(job);
+}
+
+void moor::ParallelZipWriter::close()
+{
+    if (m_closed)
+    {
+        return;
+    }
+
+    m_closed = true;
+    drain(0);
+    writeCentralDirectory();
+
+    if (m_file)
+    {
+        std::shared_ptr<std::FILE> file;
+        file.swap(m_file);
+
+        if (std::fflush(file.get()) != 0)
+        {
+            throw lastError("flush");
+        }
+    }
+
+    m_sink = Sink();
+}
+
+void moor::ParallelZipWriter::submit(const std::shared_ptr<Job>& job)
+{
+    if (m_closed)
+    {
+        throw std::logic_error("ParallelZipWriter is closed");
+    }
+
+    m_pending.push_back(job);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(job);
+    }
+
+    m_workAvailable.notify_one();
+    drain(m_maxPending);
+}
+
+// Write finished entries in order, waiting until no more than maxPending
+// remain in flight.
+void moor::ParallelZipWriter::drain(size_t maxPending)
+{
+    while (!m_pending.empty())
+    {
+        std::shared_ptr<Job> job = m_pending.front();
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!job->done)
+            {
+                if (m_pending.size() <= maxPending)
+                {
+                    return;
+                }
+
+                m_jobDone.wait(lock, [&job] { return job->done; });
+            }
+        }
+
+        m_pending.pop_front();
+
+        if (job->error)
+        {
+            std::rethrow_exception(job->error);
+        }
+
+        writeEntry(*job);
+    }
+}
+
+void moor::ParallelZipWriter::output(const void* data, size_t size)
+{
+    m_sink(data, size);
+    m_offset += size;
+}
+
+void moor::ParallelZipWriter::writeEntry(Job& job)
+{
+    const bool zip64 = job.size >= max32 || job.compressedSize >= max32;
+
+    CentralEntry entry;
+    entry.name = job.name;
+    entry.crc = job.crc;
+    entry.compressedSize = job.compressedSize;
+    entry.size = job.size;
+    entry.offset = m_offset;
+    entry.method = job.method;
+    entry.mode = job.mode;
+    entry.mtime = static_cast<std::uint32_t>(job.mtime);
+
+    Record r;
+    r.u32(0x04034b50);
+    r.u16(zip64 ? versionZip64 : versionDefault);
+    r.u16(flagUtf8);
+    r.u16(job.method);
+    r.u32(dosDateTime(job.mtime));
+    r.u32(job.crc);
+    r.u32(zip64 ? max32 : static_cast<std::uint32_t>(job.compressedSize));
+    r.u32(zip64 ? max32 : static_cast<std::uint32_t>(job.size));
+    r.u16(static_cast<std::uint32_t>(job.name.size()));
+    r.u16(9 + (zip64 ? 20 : 0));
+    r.append(job.name.data(), job.name.size());
+    timestampExtra(r, job.mtime);
+
+    if (zip64)
+    {
+        r.u16(0x0001);
+        r.u16(16);
+        r.u64(job.size);
+        r.u64(job.compressedSize);
+    }
+
+    output(r.bytes.data(), r.bytes.size());
+
+    if (job.spill)
+    {
+        std::FILE* f = job.spill.get();
+        std::rewind(f);
+
+        std::vector<unsigned char> buffer(1024 * 1024);
+        size_t n;
+        while ((n = std::fread(buffer.data(), 1, buffer.size(), f)) > 0)
+        {
+            output(buffer.data(), n);
+        }
+
+        if (std::ferror(f))
+        {
+            throw lastError("spill file");
+        }
+    }
+    else if (!job.output.empty())
+    {
+        output(job.output.data(), job.output.size());
+    }
+
+    m_central.push_back(entry);
+}
+
+void moor::ParallelZipWriter::writeCentralDirectory()
+{
+    const std::uint64_t cdOffset = m_offset;
+
+    for (const CentralEntry& e : m_central)
+    {
+        const bool bigSize = e.size >= max32;
+        const bool bigCompressed = e.compressedSize >= max32;
+        const bool bigOffset = e.offset >= max32;
+        const unsigned zip64Size = 8 * ((bigSize ? 1 : 0) + (bigCompressed ? 1 : 0) + (bigOffset ? 1 : 0));
+        const bool zip64 = zip64Size != 0;
+
+        Record r;
+        r.u32(0x02014b50);
+        r.u16(madeByUnix | versionZip64);
+        r.u16(zip64 ? versionZip64 : versionDefault);
+        r.u16(flagUtf8);
+        r.u16(e.method);
+        r.u32(dosDateTime(static_cast<std::time_t>(e.mtime)));
+        r.u32(e.crc);
+        r.u32(bigCompressed ? max32 : static_cast<std::uint32_t>(e.compressedSize));
+        r.u32(bigSize ? max32 : static_cast<std::uint32_t>(e.size));
+        r.u16(static_cast<std::uint32_t>(e.name.size()));
+        r.u16(9 + (zip64 ? 4 + zip64Size : 0));
+        r.u16(0); // comment
+        r.u16(0); // disk
+        r.u16(0); // internal attributes
+        r.u32(e.mode << 16 | ((e.mode & 040000) ? 0x10 : 0));
+        r.u32(bigOffset ? max32 : static_cast<std::uint32_t>(e.offset));
+        r.append(e.name.data(), e.name.size());
+        timestampExtra(r, static_cast<std::time_t>(e.mtime));
+
+        if (zip64)
+        {
+            r.u16(0x0001);
+            r.u16(zip64Size);
+            if (bigSize)
+            {
+                r.u64(e.size);
+            }
+            if (bigCompressed)
+            {
+                r.u64(e.compressedSize);
+            }
+            if (bigOffset)
+            {
+                r.u64(e.offset);
+            }
+        }
+
+        output(r.bytes.data(), r.bytes.size());
+    }
+
+    const std::uint64_t cdSize = m_offset - cdOffset;
+    const std::uint64_t count = m_central.size();
+    const bool zip64 = count >= 0xffff || cdOffset >= max32 || cdSize >= max32;
+
+    Record r;
+
+    if (zip64)
+    {
+        const std::uint64_t zip64Offset = m_offset;
+
+        r.u32(0x06064b50);
+        r.u64(44);
+        r.u16(madeByUnix | versionZip64);
+        r.u16(versionZip64);
+        r.u32(0);
+        r.u32(0);
+        r.u64(count);
+        r.u64(count);
+        r.u64(cdSize);
+        r.u64(cdOffset);
+
+        r.u32(0x07064b50);
+        r.u32(0);
+        r.u64(zip64Offset);
+        r.u32(1);
+    }
+
+    r.u32(0x06054b50);
+    r.u16(0);
+    r.u16(0);
+    r.u16(zip64 ? 0xffff : static_cast<std::uint32_t>(count));
+    r.u16(zip64 ? 0xffff : static_cast<std::uint32_t>(count));
+    r.u32(zip64 ? max32 : static_cast<std::uint32_t>(cdSize));
+    r.u32(zip64 ? max32 : static_cast<std::uint32_t>(cdOffset));
+    r.u16(0);
+
+    output(r.bytes.data(), r.bytes.size());
+}
+
+void moor::ParallelZipWriter::work()
+{
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workAvailable.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+
+            if (m_stop)
+            {
+                return;
+            }
+
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        try
+        {
+            compress(*job);
+        }
+        catch (...)
+        {
+            job->error = std::current_exception();
+        }
+
+        std::vector<unsigned char>().swap(job->input);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job->done = true;
+        }
+
+        m_jobDone.notify_all();
+    }
+}
+
+#ifdef MOOR_HAVE_ZLIB
+namespace
+{
+    // Collects compressed output in memory until it passes the spill size,
+    // then moves it to an anonymous temporary file.
+    class Output
+    {
+    public:
+        Output(std::vector<unsigned char>& memory,
+               std::shared_ptr<std::FILE>& spill,
+               size_t spillSize)
+            : m_memory(memory),
+              m_spill(spill),
+              m_spillSize(spillSize),
+              m_size(0) { }
+
+        void append(const unsigned char* data, size_t size)
+        {
+            if (!m_spill && m_memory.size() + size > m_spillSize)
+            {
+                std::FILE* f = std::tmpfile();
+                if (!f)
+                {
+                    throw lastError("tmpfile");
+                }
+
+                m_spill.reset(f, std::fclose);
+                write(m_memory.data(), m_memory.size());
+                std::vector<unsigned char>().swap(m_memory);
+            }
+
+            if (m_spill)
+            {
+                write(data, size);
+            }
+            else
+            {
+                m_memory.insert(m_memory.end(), data, data + size);
+            }
+
+            m_size += size;
+        }
+
+        void reset()
+        {
+            m_memory.clear();
+            m_spill.reset();
+            m_size = 0;
+        }
+
+        std::uint64_t size() const
+        {
+            return m_size;
+        }
+
+    private:
+        void write(const unsigned char* data, size_t size)
+        {
+            if (size != 0 && std::fwrite(data, 1, size, m_spill.get()) != size)
+            {
+                throw lastError("spill file");
+            }
+        }
+
+        std::vector<unsigned char>& m_memory;
+        std::shared_ptr<std::FILE>& m_spill;
+        const size_t m_spillSize;
+        std::uint64_t m_size;
+    };
+
+    // zlib takes 32 bit lengths
+    const size_t zlibChunk = 1 << 30;
+}
+
+void moor::ParallelZipWriter::compress(Job& job) const
+{
+    if (job.directory)
+    {
+        return;
+    }
+
+    std::unique_ptr<MappedFile> mapped;
+    const unsigned char* data = job.input.data();
+    size_t size = job.input.size();
+
+    if (!job.sourcePath.empty())
+    {
+        mapped.reset(new MappedFile(job.sourcePath));
+        data = static_cast<const unsigned char*>(mapped->data());
+        size = mapped->size();
+    }
+
+    uLong crc = crc32(0, Z_NULL, 0);
+    for (size_t done = 0; done < size; )
+    {
+        size_t n = std::min(size - done, zlibChunk);
+        crc = crc32(crc, data + done, static_cast<uInt>(n));
+        done += n;
+    }
+
+    job.crc = static_cast<std::uint32_t>(crc);
+    job.size = size;
+
+    Output out(job.output, job.spill, m_options.zip.spillSize);
+    const ZipOptions::Method method = m_options.zip.method;
+
+    if (method != ZipOptions::Method::Store && size != 0)
+    {
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+
+        int level = m_options.level < 0 ? Z_DEFAULT_COMPRESSION : std::min(m_options.level, 9);
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+
+        std::vector<unsigned char> buffer(256 * 1024);
+        size_t consumed = 0;
+        int r = Z_OK;
+
+        try
+        {
+            while (r != Z_STREAM_END)
+            {
+                if (strm.avail_in == 0 && consumed < size)
+                {
+                    size_t n = std::min(size - consumed, zlibChunk);
+                    strm.next_in = const_cast<unsigned char*>(data + consumed);
+                    strm.avail_in = static_cast<uInt>(n);
+                    consumed += n;
+                }
+
+                strm.next_out = buffer.data();
+                strm.avail_out = static_cast<uInt>(buffer.size());
+
+                r = deflate(&strm, consumed == size ? Z_FINISH : Z_NO_FLUSH);
+                if (r == Z_STREAM_ERROR)
+                {
+                    throw std::runtime_error("deflate failed");
+                }
+
+                out.append(buffer.data(), buffer.size() - strm.avail_out);
+            }
+        }
+        catch (...)
+        {
+            deflateEnd(&strm);
+            throw;
+        }
+
+        deflateEnd(&strm);
+
+        // Keep the entry stored if deflate didn't help, unless asked for
+        if (out.size() < size || method == ZipOptions::Method::Deflate)
+        {
+            job.method = methodDeflate;
+            job.compressedSize = out.size();
+            return;
+        }
+
+        out.reset();
+    }
+
+    if (mapped || size > m_options.zip.spillSize)
+    {
+        out.append(data, size);
+    }
+    else
+    {
+        // Owned content is written as is
+        job.output.swap(job.input);
+    }
+
+    job.method = methodStore;
+    job.compressedSize = size;
+}
+#else
+void moor::ParallelZipWriter::compress(Job&) const
+{
+    throw std::system_error(std::make_error_code(std::errc::not_supported));
+}
+#endif
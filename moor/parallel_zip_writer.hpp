@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+#include "compression_options.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace moor
+{
+    // Writes zip archives with entries deflated in parallel. Each entry is
+    // compressed whole on a worker thread, into memory or a temporary spill
+    // file for large entries, and the local headers, data and central
+    // directory are written in the order entries were added. Since sizes
+    // and CRCs are known before an entry is written, no data descriptors
+    // are needed. Zip64 records are used when sizes or offsets need them.
+    //
+    // Uses CompressionOptions::level, threads, zip.method and
+    // zip.spillSize. Encryption isn't supported. Not thread-safe: entries
+    // are added from one thread, which also does the writing.
+    class MOOR_API ParallelZipWriter
+    {
+    public:
+        // Throws to report a failed write
+        typedef std::function<void(const void*, size_t)> Sink;
+
+        ParallelZipWriter(const std::string& archive_file_name,
+                          const CompressionOptions& options = CompressionOptions());
+        ParallelZipWriter(std::vector<unsigned char>& out_buffer,
+                          const CompressionOptions& options = CompressionOptions());
+        ParallelZipWriter(Sink sink,
+                          const CompressionOptions& options = CompressionOptions());
+
+        // Closes the archive, ignoring errors. Call close() to see them.
+        ~ParallelZipWriter();
+
+        // Add an entry that takes ownership of its content
+        void addFile(const std::string& entry_name,
+                     std::vector<unsigned char>&& content,
+                     int permission = 0644,
+                     std::time_t mtime = std::time(nullptr));
+        void addFile(const std::string& entry_name,
+                     const void* data,
+                     size_t size);
+        void addFile(const std::string& entry_name,
+                     const std::string& content)
+        {
+            addFile(entry_name, content.data(), content.size());
+        }
+
+        // Add an entry from a real file, read by the worker that compresses it
+        void addFile(const std::string& file_path);
+
+        void addDirectory(const std::string& directory_name,
+                          int permission = 0755);
+
+        // Write the remaining entries and the central directory
+        void close();
+
+    private:
+        struct Job;
+
+        struct CentralEntry
+        {
+            std::string name;
+            std::uint32_t crc;
+            std::uint64_t compressedSize;
+            std::uint64_t size;
+            std::uint64_t offset;
+            std::uint16_t method;
+            std::uint32_t mode;
+            std::uint32_t mtime;
+        };
+
+        ParallelZipWriter(const ParallelZipWriter&);
+        ParallelZipWriter& operator=(const ParallelZipWriter&);
+
+        void start();
+        void submit(const std::shared_ptr<Job>& job);
+        void drain(size_t maxPending);
+        void writeEntry(Job& job);
+        void writeCentralDirectory();
+        void output(const void* data, size_t size);
+        void work();
+        void compress(Job& job) const;
+        void stop();
+
+        Sink m_sink;
+        std::shared_ptr<std::FILE> m_file;
+        const CompressionOptions m_options;
+        const size_t m_maxPending;
+
+        std::deque<std::shared_ptr<Job>> m_pending;
+        std::vector<CentralEntry> m_central;
+        std::uint64_t m_offset;
+        bool m_closed;
+
+        std::mutex m_mutex;
+        std::condition_variable m_workAvailable;
+        std::condition_variable m_jobDone;
+        std::deque<std::shared_ptr<Job>> m_queue;
+        bool m_stop;
+
+        std::vector<std::thread> m_threads;
+    };
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "read_ahead.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+
+moor::ReadAheadFile::ReadAheadFile(const std::string& path,
+                                   const ReadAheadOptions& options)
+    : m_file(std::fopen(path.c_str(), "rb"), std::fclose),
+      m_blockSize(std::max<size_t>(options.blockSize, 1)),
+      m_blocks(),
+      m_sizes(std::max<size_t>(options.depth, 2), 0),
+      m_mutex(),
+      m_filledCond(),
+      m_freedCond(),
+      m_readIndex(0),
+      m_filled(0),
+      m_lent(false),
+      m_eof(false),
+      m_stop(false),
+      m_errno(0),
+      m_thread()
+{
+    if (!m_file)
+    {
+        throw std::system_error(std::error_code(errno, std::generic_category()), path);
+    }
+
+    // The ring replaces stdio's own buffering
+    std::setvbuf(m_file.get(), nullptr, _IONBF, 0);
+
+    for (size_t i = 0; i < m_sizes.size(); ++i)
+    {
+        m_blocks.push_back(std::unique_ptr<char[]>(new char[m_blockSize]));
+    }
+
+    m_thread = std::thread(&ReadAheadFile::produce, this);
+}
+
+moor::ReadAheadFile::~ReadAheadFile()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_freedCond.notify_one();
+    m_thread.join();
+}
+
+void moor::ReadAheadFile::produce()
+{
+    const size_t depth = m_blocks.size();
+
+    while (true)
+    {
+        size_t index;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop && m_filled + (m_lent ? 1 : 0) == depth)
+            {
+                m_freedCond.wait(lock);
+            }
+
+            if (m_stop)
+            {
+                return;
+            }
+
+            index = (m_readIndex + m_filled) % depth;
+        }
+
+        // The block is not visible to the consumer until m_filled is
+        // bumped, so it is filled without holding the lock.
+        size_t n = std::fread(m_blocks[index].get(), 1, m_blockSize, m_file.get());
+        int err = (n < m_blockSize && std::ferror(m_file.get())) ? errno : 0;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (n > 0)
+            {
+                m_sizes[index] = n;
+                ++m_filled;
+            }
+
+            if (n < m_blockSize)
+            {
+                m_errno = err;
+                m_eof = true;
+            }
+        }
+
+        m_filledCond.notify_one();
+
+        if (n < m_blockSize)
+        {
+            return;
+        }
+    }
+}
+
+ssize_t moor::ReadAheadFile::read(const void** buffer)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_lent)
+    {
+        m_lent = false;
+        m_freedCond.notify_one();
+    }
+
+    while (m_filled == 0 && !m_eof)
+    {
+        m_filledCond.wait(lock);
+    }
+
+    if (m_filled == 0)
+    {
+        return m_errno ? -1 : 0;
+    }
+
+    size_t index = m_readIndex;
+    m_readIndex = (m_readIndex + 1) % m_blocks.size();
+    --m_filled;
+    m_lent = true;
+
+    *buffer = m_blocks[index].get();
+    return static_cast<ssize_t>(m_sizes[index]);
+}
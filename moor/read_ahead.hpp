@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <archive.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace moor
+{
+    struct ReadAheadOptions
+    {
+        size_t blockSize; // Bytes read per block
+        size_t depth;     // Number of blocks buffered ahead of the reader
+
+        ReadAheadOptions(size_t blockSize_ = 1024 * 1024,
+                         size_t depth_ = 4)
+            : blockSize(blockSize_),
+              depth(depth_) { }
+    };
+
+    // Reads a file on a background thread into a bounded ring of blocks,
+    // so I/O overlaps with whatever the consumer does with the previous
+    // block.
+    class MOOR_API ReadAheadFile
+    {
+    public:
+        ReadAheadFile(const std::string& path, const ReadAheadOptions& options);
+        ~ReadAheadFile();
+
+        // Hand out the next block, returning the previous one to the
+        // producer. Returns the block size, 0 at EOF or -1 on error with
+        // errorNumber() set.
+        ssize_t read(const void** buffer);
+
+        int errorNumber() const
+        {
+            return m_errno;
+        }
+
+    private:
+        ReadAheadFile(const ReadAheadFile&);
+        ReadAheadFile& operator=(const ReadAheadFile&);
+
+        void produce();
+
+        // Owned from the start, so a constructor that throws closes it
+        std::unique_ptr<std::FILE, int (*)(std::FILE*)> m_file;
+        const size_t m_blockSize;
+        std::vector<std::unique_ptr<char[]>> m_blocks;
+        std::vector<size_t> m_sizes;
+
+        std::mutex m_mutex;
+        std::condition_variable m_filledCond;
+        std::condition_variable m_freedCond;
+
+        size_t m_readIndex; // Next block the consumer will take
+        size_t m_filled;    // Blocks ready for the consumer
+        bool m_lent;        // The block before m_readIndex is still in use
+        bool m_eof;
+        bool m_stop;
+        int m_errno;
+
+        std::thread m_thread;
+    };
+}
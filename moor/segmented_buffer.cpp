@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "segmented_buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+moor::SegmentPool::SegmentPool(size_t segmentSize_, size_t maxIdle_)
+    : m_segmentSize(std::max<size_t>(segmentSize_, 1)),
+      m_maxIdle(maxIdle_),
+      m_mutex(),
+      m_idle()
+{
+}
+
+moor::SegmentPool::Segment moor::SegmentPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_idle.empty())
+        {
+            Segment segment(std::move(m_idle.back()));
+            m_idle.pop_back();
+            return segment;
+        }
+    }
+
+    return Segment(new unsigned char[m_segmentSize]);
+}
+
+void moor::SegmentPool::release(Segment segment)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (segment && m_idle.size() < m_maxIdle)
+    {
+        m_idle.push_back(std::move(segment));
+    }
+}
+
+size_t moor::SegmentPool::idleCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_idle.size();
+}
+
+moor::SegmentedBuffer::SegmentedBuffer(size_t segmentSize_)
+    : m_pool(std::make_shared<SegmentPool>(segmentSize_)),
+      m_segments(),
+      m_size(0)
+{
+}
+
+moor::SegmentedBuffer::SegmentedBuffer(std::shared_ptr<SegmentPool> pool_)
+    : m_pool(pool_ ? std::move(pool_) : std::make_shared<SegmentPool>()),
+      m_segments(),
+      m_size(0)
+{
+}
+
+moor::SegmentedBuffer::SegmentedBuffer(SegmentedBuffer&& old)
+    : m_pool(old.m_pool),
+      m_segments(std::move(old.m_segments)),
+      m_size(old.m_size)
+{
+    old.m_segments.clear();
+    old.m_size = 0;
+}
+
+moor::SegmentedBuffer::~SegmentedBuffer()
+{
+    clear();
+}
+
+void moor::SegmentedBuffer::append(const void* data_, size_t size_)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data_);
+    const size_t segmentSize = m_pool->segmentSize();
+
+    while (size_ > 0)
+    {
+        size_t index = m_size / segmentSize;
+        size_t offset = m_size % segmentSize;
+
+        if (index == m_segments.size())
+        {
+            m_segments.push_back(m_pool->acquire());
+        }
+
+        size_t n = std::min(size_, segmentSize - offset);
+        std::memcpy(m_segments[index].get() + offset, p, n);
+
+        p += n;
+        size_ -= n;
+        m_size += n;
+    }
+}
+
+void moor::SegmentedBuffer::reserve(size_t size_)
+{
+    const size_t segmentSize = m_pool->segmentSize();
+    size_t needed = (size_ + segmentSize - 1) / segmentSize;
+
+    m_segments.reserve(needed);
+    while (m_segments.size() < needed)
+    {
+        m_segments.push_back(m_pool->acquire());
+    }
+}
+
+void moor::SegmentedBuffer::clear()
+{
+    for (SegmentPool::Segment& segment : m_segments)
+    {
+        m_pool->release(std::move(segment));
+    }
+
+    m_segments.clear();
+    m_size = 0;
+}
+
+std::vector<moor::SegmentedBuffer::Segment> moor::SegmentedBuffer::segments() const
+{
+    const size_t segmentSize = m_pool->segmentSize();
+    std::vector<Segment> out;
+    size_t remaining = m_size;
+
+    for (size_t i = 0; remaining > 0; ++i)
+    {
+        Segment s = { m_segments[i].get(), std::min(remaining, segmentSize) };
+        out.push_back(s);
+        remaining -= s.size;
+    }
+
+    return out;
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+std::vector<struct iovec> moor::SegmentedBuffer::iovecs() const
+{
+    std::vector<struct iovec> out;
+
+    for (const Segment& s : segments())
+    {
+        struct iovec v;
+        v.iov_base = const_cast<unsigned char*>(s.data);
+        v.iov_len = s.size;
+        out.push_back(v);
+    }
+
+    return out;
+}
+#endif
+
+void moor::SegmentedBuffer::gather(void* out_) const
+{
+    unsigned char* out = static_cast<unsigned char*>(out_);
+
+    for (const Segment& s : segments())
+    {
+        std::memcpy(out, s.data, s.size);
+        out += s.size;
+    }
+}
+
+std::vector<unsigned char> moor::SegmentedBuffer::gather() const
+{
+    std::vector<unsigned char> out(m_size);
+    if (!out.empty())
+    {
+        gather(out.data());
+    }
+
+    return out;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #include <sys/uio.h>
+#endif
+
+
+namespace moor
+{
+    // Thread-safe free list of fixed size segments, shared between buffers
+    // so repeatedly built archives don't go back to the allocator.
+    class MOOR_API SegmentPool
+    {
+    public:
+        typedef std::unique_ptr<unsigned char[]> Segment;
+
+        explicit SegmentPool(size_t segmentSize = 1024 * 1024,
+                             size_t maxIdle = 64);
+
+        Segment acquire();
+        void release(Segment segment);
+
+        size_t segmentSize() const
+        {
+            return m_segmentSize;
+        }
+
+        size_t idleCount() const;
+
+    private:
+        SegmentPool(const SegmentPool&);
+        SegmentPool& operator=(const SegmentPool&);
+
+        const size_t m_segmentSize;
+        const size_t m_maxIdle;
+        mutable std::mutex m_mutex;
+        std::vector<Segment> m_idle;
+    };
+
+    // Append-only output buffer made of a chain of pool segments. Growing
+    // it never moves data already written, so each byte is copied once on
+    // the way in. The contents can be handed off segment by segment or
+    // gathered into one contiguous buffer.
+    class MOOR_API SegmentedBuffer
+    {
+    public:
+        struct Segment
+        {
+            const unsigned char* data;
+            size_t size;
+        };
+
+        explicit SegmentedBuffer(size_t segmentSize = 1024 * 1024);
+        explicit SegmentedBuffer(std::shared_ptr<SegmentPool> pool);
+        SegmentedBuffer(SegmentedBuffer&& old);
+        ~SegmentedBuffer();
+
+        void append(const void* data, size_t size);
+
+        // Hint the expected total size so segments are acquired up front.
+        void reserve(size_t size);
+
+        // Return all segments to the pool.
+        void clear();
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+
+        size_t capacity() const
+        {
+            return m_segments.size() * m_pool->segmentSize();
+        }
+
+        // The filled segments in order. Valid until the buffer is modified.
+        std::vector<Segment> segments() const;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        std::vector<struct iovec> iovecs() const;
+#endif
+
+        // Copy the contents into out, which must hold size() bytes.
+        void gather(void* out) const;
+        std::vector<unsigned char> gather() const;
+
+        const std::shared_ptr<SegmentPool>& pool() const
+        {
+            return m_pool;
+        }
+
+    private:
+        SegmentedBuffer(const SegmentedBuffer&);
+        SegmentedBuffer& operator=(const SegmentedBuffer&);
+
+        std::shared_ptr<SegmentPool> m_pool;
+        std::vector<SegmentPool::Segment> m_segments;
+        size_t m_size;
+    };
+}
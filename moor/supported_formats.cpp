@@ -65,6 +65,7 @@ namespace
         bool m_grzip;
         bool m_gzip;
         bool m_lrzip;
+        bool m_lz4;
         bool m_lzip;
         bool m_lzma;
         bool m_lzop;
@@ -72,6 +73,7 @@ namespace
         bool m_uuencode;
         bool m_xz;
         bool m_rpm;
+        bool m_zstd;
 
     public:
         SupportedWriteFilters();
@@ -88,6 +90,7 @@ namespace
         m_grzip = (archive_write_add_filter_grzip(a) == ARCHIVE_OK);
         m_gzip = (archive_write_add_filter_gzip(a) == ARCHIVE_OK);
         m_lrzip = (archive_write_add_filter_lrzip(a) == ARCHIVE_OK);
+        m_lz4 = (archive_write_add_filter_lz4(a) == ARCHIVE_OK);
         m_lzip = (archive_write_add_filter_lzip(a) == ARCHIVE_OK);
         m_lzma = (archive_write_add_filter_lzma(a) == ARCHIVE_OK);
         m_lzop = (archive_write_add_filter_lzop(a) == ARCHIVE_OK);
@@ -95,6 +98,7 @@ namespace
         m_uuencode = (archive_write_add_filter_uuencode(a) == ARCHIVE_OK);
         m_xz = (archive_write_add_filter_xz(a) == ARCHIVE_OK);
         m_rpm = false; // libarchive only supports read for it?
+        m_zstd = (archive_write_add_filter_zstd(a) == ARCHIVE_OK);
     }
 
     bool SupportedWriteFilters::isSupported(moor::Filter fmt)
@@ -125,6 +129,10 @@ namespace
                 return m_lzop;
             case moor::Filter::GRZip:
                 return m_grzip;
+            case moor::Filter::LZ4:
+                return m_lz4;
+            case moor::Filter::Zstd:
+                return m_zstd;
             default:
                 return false;
         }
@@ -113,6 +113,12 @@ const char* moor::showFilter(moor::Filter filter)
         case moor::Filter::GRZip:
             return "grzip";
 
+        case moor::Filter::LZ4:
+            return "lz4";
+
+        case moor::Filter::Zstd:
+            return "zstd";
+
         default:
             return "unknown";
     }
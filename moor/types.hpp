@@ -58,7 +58,9 @@ namespace moor
         LZip = ARCHIVE_FILTER_LZIP,
         LRZip = ARCHIVE_FILTER_LRZIP,
         LZOP = ARCHIVE_FILTER_LZOP,
-        GRZip = ARCHIVE_FILTER_GRZIP
+        GRZip = ARCHIVE_FILTER_GRZIP,
+        LZ4 = ARCHIVE_FILTER_LZ4,
+        Zstd = ARCHIVE_FILTER_ZSTD
     };
 
     enum class FileType
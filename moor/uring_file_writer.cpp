@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef MOOR_HAVE_IO_URING
+
+#include "uring_file_writer.hpp"
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Sparse direct descriptor tables and allocation need Linux 5.19 headers
+#if defined(IORING_FILE_INDEX_ALLOC) && defined(__NR_io_uring_setup)
+  #define MOOR_USE_IO_URING 1
+#endif
+
+
+#ifdef MOOR_USE_IO_URING
+
+namespace
+{
+    enum Step
+    {
+        StepOpen,
+        StepWrite,
+        StepClose,
+        StepCount
+    };
+
+    int setup(unsigned entries, io_uring_params* params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    int registerFiles(int fd, unsigned count)
+    {
+        io_uring_rsrc_register reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.nr = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)));
+    }
+
+    unsigned* ringField(void* ring, std::uint32_t offset)
+    {
+        return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+    }
+}
+
+std::unique_ptr<moor::UringFileWriter> moor::UringFileWriter::create(unsigned queueDepth)
+{
+    // Three operations per file
+    queueDepth = std::max(queueDepth, static_cast<unsigned>(StepCount));
+
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    int fd = setup(queueDepth, &params);
+    if (fd < 0)
+    {
+        return std::unique_ptr<UringFileWriter>();
+    }
+
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+    const unsigned slots = params.sq_entries / StepCount;
+
+    if ((params.features & needed) != needed || registerFiles(fd, slots) < 0)
+    {
+        ::close(fd);
+        return std::unique_ptr<UringFileWriter>();
+    }
+
+    std::unique_ptr<UringFileWriter> writer(new UringFileWriter(fd, slots));
+    if (!writer->map(params.sq_entries, params.cq_entries, &params))
+    {
+        return std::unique_ptr<UringFileWriter>();
+    }
+
+    return writer;
+}
+
+bool moor::UringFileWriter::map(unsigned sqEntries, unsigned cqEntries, const void* p)
+{
+    const io_uring_params& params = *static_cast<const io_uring_params*>(p);
+
+    m_ringSize = std::max(params.sq_off.array + sqEntries * sizeof(unsigned),
+                          params.cq_off.cqes + cqEntries * sizeof(io_uring_cqe));
+    void* ring = ::mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_ring = ring;
+
+    m_sqesSize = sqEntries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    m_sqHead = ringField(m_ring, params.sq_off.head);
+    m_sqTail = ringField(m_ring, params.sq_off.tail);
+    m_sqMask = ringField(m_ring, params.sq_off.ring_mask);
+    m_sqArray = ringField(m_ring, params.sq_off.array);
+    m_cqHead = ringField(m_ring, params.cq_off.head);
+    m_cqTail = ringField(m_ring, params.cq_off.tail);
+    m_cqMask = ringField(m_ring, params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(m_ring) + params.cq_off.cqes);
+
+    m_sqLocalTail = *m_sqTail;
+    return true;
+}
+
+moor::UringFileWriter::~UringFileWriter()
+{
+    if (m_sqes)
+    {
+        ::munmap(m_sqes, m_sqesSize);
+    }
+
+    if (m_ring)
+    {
+        ::munmap(m_ring, m_ringSize);
+    }
+
+    // Also closes anything left in the descriptor slots
+    ::close(m_fd);
+}
+
+io_uring_sqe* moor::UringFileWriter::nextSqe()
+{
+    const unsigned index = m_sqLocalTail & *m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    ++m_sqLocalTail;
+
+    return sqe;
+}
+
+void moor::UringFileWriter::submitAndWait(unsigned count)
+{
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned toSubmit = count;
+    while (toSubmit != 0)
+    {
+        int r = enter(m_fd, toSubmit, toSubmit, IORING_ENTER_GETEVENTS);
+        if (r < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+
+            throw std::system_error(std::error_code(errno, std::generic_category()), "io_uring_enter");
+        }
+
+        toSubmit -= static_cast<unsigned>(r);
+    }
+}
+
+std::vector<moor::UringFileWriter::File> moor::UringFileWriter::flush()
+{
+    std::vector<File> failed;
+    if (m_files.empty())
+    {
+        return failed;
+    }
+
+    unsigned count = 0;
+
+    for (size_t i = 0; i < m_files.size(); ++i)
+    {
+        File& file = m_files[i];
+        const unsigned slot = static_cast<unsigned>(i);
+        const std::uint64_t base = static_cast<std::uint64_t>(i) * StepCount;
+
+        // A failed open cancels the write. The close is linked so it
+        // waits, but runs whatever the write did.
+        io_uring_sqe* open = nextSqe();
+        open->opcode = IORING_OP_OPENAT;
+        open->fd = AT_FDCWD;
+        open->addr = reinterpret_cast<std::uintptr_t>(file.path.c_str());
+        open->len = file.mode;
+        open->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+        open->file_index = slot + 1;
+        open->flags = IOSQE_IO_LINK;
+        open->user_data = base + StepOpen;
+        ++count;
+
+        if (!file.data.empty())
+        {
+            io_uring_sqe* write = nextSqe();
+            write->opcode = IORING_OP_WRITE;
+            write->fd = static_cast<int>(slot);
+            write->addr = reinterpret_cast<std::uintptr_t>(file.data.data());
+            write->len = static_cast<std::uint32_t>(file.data.size());
+            write->off = 0;
+            write->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            write->user_data = base + StepWrite;
+            ++count;
+        }
+
+        io_uring_sqe* close = nextSqe();
+        close->opcode = IORING_OP_CLOSE;
+        close->file_index = slot + 1;
+        close->user_data = base + StepClose;
+        ++count;
+    }
+
+    submitAndWait(count);
+
+    std::vector<bool> opened(m_files.size(), false);
+    unsigned reaped = 0;
+
+    while (reaped < count)
+    {
+        unsigned head = *m_cqHead;
+        const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            int r = enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if (r < 0 && errno != EINTR)
+            {
+                throw std::system_error(std::error_code(errno, std::generic_category()), "io_uring_enter");
+            }
+
+            continue;
+        }
+
+        for (; head != tail; ++head, ++reaped)
+        {
+            const io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+            File& file = m_files[cqe.user_data / StepCount];
+            const int step = static_cast<int>(cqe.user_data % StepCount);
+
+            if (step == StepOpen)
+            {
+                opened[cqe.user_data / StepCount] = cqe.res >= 0;
+            }
+
+            // Keep the first error. A close after a failed open fails too.
+            if (file.error != 0 || (step == StepClose && !opened[cqe.user_data / StepCount]))
+            {
+                continue;
+            }
+
+            if (cqe.res < 0)
+            {
+                file.error = -cqe.res;
+            }
+            else if (step == StepWrite && static_cast<size_t>(cqe.res) != file.data.size())
+            {
+                file.error = EIO;
+            }
+        }
+
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    for (File& file : m_files)
+    {
+        if (file.error == 0)
+        {
+            // Like the disk writer, failing to set these isn't an error
+            if (file.chmod)
+            {
+                ::fchmodat(AT_FDCWD, file.path.c_str(), file.mode, 0);
+            }
+
+            if (file.setTimes)
+            {
+                ::utimensat(AT_FDCWD, file.path.c_str(), file.times, AT_SYMLINK_NOFOLLOW);
+            }
+        }
+        else
+        {
+            failed.push_back(std::move(file));
+        }
+    }
+
+    m_files.clear();
+    m_paths.clear();
+
+    return failed;
+}
+
+#else
+
+std::unique_ptr<moor::UringFileWriter> moor::UringFileWriter::create(unsigned)
+{
+    return std::unique_ptr<UringFileWriter>();
+}
+
+moor::UringFileWriter::~UringFileWriter()
+{
+}
+
+bool moor::UringFileWriter::map(unsigned, unsigned, const void*)
+{
+    return false;
+}
+
+io_uring_sqe* moor::UringFileWriter::nextSqe()
+{
+    return nullptr;
+}
+
+void moor::UringFileWriter::submitAndWait(unsigned)
+{
+}
+
+std::vector<moor::UringFileWriter::File> moor::UringFileWriter::flush()
+{
+    std::vector<File> failed;
+    failed.swap(m_files);
+    m_paths.clear();
+    return failed;
+}
+
+#endif
+
+moor::UringFileWriter::UringFileWriter(int fd, unsigned slots)
+    : m_fd(fd),
+      m_slots(slots),
+      m_ring(nullptr),
+      m_ringSize(0),
+      m_sqes(nullptr),
+      m_sqesSize(0),
+      m_sqHead(nullptr),
+      m_sqTail(nullptr),
+      m_sqMask(nullptr),
+      m_sqArray(nullptr),
+      m_cqHead(nullptr),
+      m_cqTail(nullptr),
+      m_cqMask(nullptr),
+      m_cqes(nullptr),
+      m_sqLocalTail(0),
+      m_files(),
+      m_paths()
+{
+}
+
+void moor::UringFileWriter::add(File&& file)
+{
+    m_paths.insert(file.path);
+    m_files.push_back(std::move(file));
+}
+
+#endif
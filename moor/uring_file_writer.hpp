@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace moor
+{
+    // Creates, writes and closes batches of small files through io_uring,
+    // so each file costs a share of one io_uring_enter instead of an open,
+    // write and close. Each file's operations are linked in the ring and
+    // use a direct descriptor slot, so no descriptor goes through the
+    // process table. io_uring has no chmod or utimens, so those are still
+    // done one call per file, when asked for, after the batch completes.
+    //
+    // Files are always created new and symlinks are not followed. Files
+    // that fail for any reason, including already existing, are handed
+    // back so the caller can write them the slow way.
+    class UringFileWriter
+    {
+    public:
+        struct File
+        {
+            std::string path;
+            std::vector<unsigned char> data;
+
+            // Creation mode, before the umask
+            mode_t mode;
+
+            // Set the mode exactly after writing, ignoring the umask
+            bool chmod;
+
+            // Set the times after writing. Either can be UTIME_OMIT.
+            bool setTimes;
+            struct timespec times[2];
+
+            // Left for the caller
+            std::shared_ptr<void> tag;
+
+            // errno of the step that failed, 0 on success
+            int error;
+
+            File()
+                : path(),
+                  data(),
+                  mode(0644),
+                  chmod(false),
+                  setTimes(false),
+                  tag(),
+                  error(0)
+            {
+                times[0].tv_sec = times[1].tv_sec = 0;
+                times[0].tv_nsec = times[1].tv_nsec = UTIME_OMIT;
+            }
+        };
+
+        // Returns null if io_uring or the features it needs are not
+        // available, in which case callers keep to ordinary system calls.
+        static std::unique_ptr<UringFileWriter> create(unsigned queueDepth);
+
+        ~UringFileWriter();
+
+        bool full() const
+        {
+            return m_files.size() >= m_slots;
+        }
+
+        bool empty() const
+        {
+            return m_files.empty();
+        }
+
+        bool pending(const std::string& path) const
+        {
+            return m_paths.count(path) != 0;
+        }
+
+        // Queue a file for the next flush. Don't call when full().
+        void add(File&& file);
+
+        // Write the queued files, returning the ones that failed
+        std::vector<File> flush();
+
+    private:
+        UringFileWriter(int fd, unsigned slots);
+
+        UringFileWriter(const UringFileWriter&);
+        UringFileWriter& operator=(const UringFileWriter&);
+
+        bool map(unsigned sqEntries, unsigned cqEntries, const void* params);
+        io_uring_sqe* nextSqe();
+        void submitAndWait(unsigned count);
+
+        int m_fd;
+        const unsigned m_slots;
+
+        void* m_ring;
+        size_t m_ringSize;
+        io_uring_sqe* m_sqes;
+        size_t m_sqesSize;
+
+        unsigned* m_sqHead;
+        unsigned* m_sqTail;
+        unsigned* m_sqMask;
+        unsigned* m_sqArray;
+        unsigned* m_cqHead;
+        unsigned* m_cqTail;
+        unsigned* m_cqMask;
+        io_uring_cqe* m_cqes;
+
+        unsigned m_sqLocalTail;
+
+        std::vector<File> m_files;
+        std::set<std::string> m_paths;
+    };
+}
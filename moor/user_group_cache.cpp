@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "user_group_cache.hpp"
+
+#include <vector>
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+  #define MOOR_HAVE_NSS 1
+  #include <cerrno>
+  #include <grp.h>
+  #include <pwd.h>
+  #include <unistd.h>
+#endif
+
+
+namespace
+{
+#ifdef MOOR_HAVE_NSS
+    // Resolve a name with the reentrant NSS calls, growing the scratch
+    // buffer until the entry fits.
+    bool lookupName(std::int64_t id, bool user, std::string& out)
+    {
+        std::vector<char> buffer(1024);
+
+        while (true)
+        {
+            int r;
+            const char* name = nullptr;
+
+            if (user)
+            {
+                struct passwd pwd;
+                struct passwd* result = nullptr;
+                r = getpwuid_r(static_cast<uid_t>(id), &pwd, buffer.data(), buffer.size(), &result);
+                if (r == 0 && result)
+                {
+                    name = result->pw_name;
+                }
+            }
+            else
+            {
+                struct group grp;
+                struct group* result = nullptr;
+                r = getgrgid_r(static_cast<gid_t>(id), &grp, buffer.data(), buffer.size(), &result);
+                if (r == 0 && result)
+                {
+                    name = result->gr_name;
+                }
+            }
+
+            if (r == ERANGE && buffer.size() < 1024 * 1024)
+            {
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+
+            if (!name)
+            {
+                return false;
+            }
+
+            out = name;
+            return true;
+        }
+    }
+#else
+    bool lookupName(std::int64_t, bool, std::string&)
+    {
+        return false;
+    }
+#endif
+}
+
+moor::UserGroupCache::UserGroupCache()
+    : m_mutex(),
+      m_users(),
+      m_groups()
+{
+}
+
+const char* moor::UserGroupCache::uname(std::int64_t uid)
+{
+    return lookup(m_users, uid, true);
+}
+
+const char* moor::UserGroupCache::gname(std::int64_t gid)
+{
+    return lookup(m_groups, gid, false);
+}
+
+void moor::UserGroupCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_users.clear();
+    m_groups.clear();
+}
+
+const char* moor::UserGroupCache::unameCallback(void* cache, std::int64_t uid)
+{
+    return static_cast<UserGroupCache*>(cache)->uname(uid);
+}
+
+const char* moor::UserGroupCache::gnameCallback(void* cache, std::int64_t gid)
+{
+    return static_cast<UserGroupCache*>(cache)->gname(gid);
+}
+
+const char* moor::UserGroupCache::lookup(NameMap& names, std::int64_t id, bool user)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        NameMap::const_iterator it = names.find(id);
+        if (it != names.end())
+        {
+            return it->second->found ? it->second->name.c_str() : nullptr;
+        }
+    }
+
+    // Look up without the lock held, since NSS may be slow. Racing threads
+    // resolve the same name and the first one in is kept.
+    std::unique_ptr<Name> entry(new Name());
+    entry->found = lookupName(id, user, entry->name);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::pair<NameMap::iterator, bool> inserted = names.insert(std::make_pair(id, std::move(entry)));
+    const Name& name = *inserted.first->second;
+
+    return name.found ? name.name.c_str() : nullptr;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2013 Matthew Arsenault
+ *
+ * This is part of moor, a wrapper for libarchive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "moor_build_config.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+namespace moor
+{
+    // Thread-safe cache of user and group names by id. A single instance can
+    // be shared by any number of disk readers and writers, so each id is
+    // looked up through NSS only once.
+    class MOOR_API UserGroupCache
+    {
+    public:
+        UserGroupCache();
+
+        // Returns null if the id has no name. The returned string stays
+        // valid for the life of the cache.
+        const char* uname(std::int64_t uid);
+        const char* gname(std::int64_t gid);
+
+        // Forget all names. Names returned earlier are invalidated.
+        void clear();
+
+        // libarchive lookup callbacks, with the cache as the user data
+        static const char* unameCallback(void* cache, std::int64_t uid);
+        static const char* gnameCallback(void* cache, std::int64_t gid);
+
+    private:
+        UserGroupCache(const UserGroupCache&);
+        UserGroupCache& operator=(const UserGroupCache&);
+
+        struct Name
+        {
+            bool found;
+            std::string name;
+        };
+
+        typedef std::unordered_map<std::int64_t, std::unique_ptr<Name>> NameMap;
+
+        const char* lookup(NameMap& names, std::int64_t id, bool user);
+
+        std::mutex m_mutex;
+        NameMap m_users;
+        NameMap m_groups;
+    };
+}
@@ -25,15 +25,32 @@
 
 #include <moor/archive_iterator.hpp>
 #include <moor/archive_match.hpp>
+#include <moor/archive_pool.hpp>
+#include <moor/archive_push_reader.hpp>
 #include <moor/archive_reader.hpp>
+#include <moor/archive_stream.hpp>
 #include <moor/archive_writer.hpp>
-
+#include <moor/concurrent_writer.hpp>
+#include <moor/parallel_zip_writer.hpp>
+#include <moor/segmented_buffer.hpp>
+#include <moor/supported_formats.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <list>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
 #include <system_error>
+#include <thread>
 #include <vector>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #ifdef __clang__
   #pragma clang diagnostic ignored "-Wexit-time-destructors"
   #pragma clang diagnostic ignored "-Wglobal-constructors"
@@ -284,188 +301,2389 @@ static bool testArchiveWriteCallback()
     }
 }
 
-static bool printArchiveEntries(ArchiveReader& reader)
+static bool testArchiveReadCallback()
 {
-    for (ArchiveIterator it = reader.begin(); !it.isAtEnd(); ++it)
+    PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    try
     {
-        std::cout << "Extracting " << it->pathname()
-                  << " size " << it->size()
-                  << '\n';
+        {
+            ArchiveWriter compressor(buf, Format::Zip, Filter::None);
+            compressor.addFile("lorem_ipsum.txt", testDataString);
+            compressor.addFile("vector_b.txt", testDataB10.begin(), testDataB10.end());
+        }
 
-        std::vector<unsigned char> data;
+        // Hand out small chunks to make sure the reader copes with
+        // headers split across reads.
+        const std::int64_t chunkSize = 7;
+        std::int64_t pos = 0;
+        const std::int64_t end = static_cast<std::int64_t>(buf.size());
 
-        if (!it->extractData<std::vector<unsigned char>>(data))
+        ArchiveReader reader(
+            [&](ArchiveReaderImpl&, void*, const void** out) -> ssize_t
         {
-            std::cerr << "Error extracting data\n";
-            return true;
+            std::int64_t n = std::min(chunkSize, end - pos);
+            *out = buf.data() + pos;
+            pos += n;
+            return static_cast<ssize_t>(n);
+        },
+        [&](ArchiveReaderImpl&, void*, std::int64_t request) -> std::int64_t
+        {
+            std::int64_t n = std::min(request, end - pos);
+            pos += n;
+            return n;
+        },
+        [&](ArchiveReaderImpl&, void*, std::int64_t offset, int whence) -> std::int64_t
+        {
+            switch (whence)
+            {
+                case SEEK_SET:
+                    pos = offset;
+                    break;
+                case SEEK_CUR:
+                    pos += offset;
+                    break;
+                case SEEK_END:
+                    pos = end + offset;
+                    break;
+            }
+
+            return pos;
+        });
+
+        std::vector<std::string> contents;
+
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            std::vector<unsigned char> out;
+            if (!it->extractData<std::vector<unsigned char>>(out))
+            {
+                std::cerr << "Error extracting test data\n";
+                return true;
+            }
+
+            contents.push_back(std::string(out.begin(), out.end()));
         }
 
-        if (static_cast<size_t>(it->size()) != data.size())
+        if (contents.size() != 2
+            || contents[0] != testDataString
+            || contents[1] != std::string(testDataB10.begin(), testDataB10.end()))
         {
-            std::cerr << "Read data size doesn't match entry size\n";
+            std::cerr << "Data read through callbacks does not match\n";
             return true;
         }
-    }
 
-    return false;
+        return false;
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error reading callback archive: " << ex.what() << '\n';
+        return true;
+    }
 }
 
-static bool testArchiveRead(const std::string& path)
+static bool testArchivePushReader()
 {
     PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
 
     try
     {
-        ArchiveReader reader1(path);
-        std::ifstream iff(path, std::ios::binary);
-        iff.seekg(0, std::ios::end);
-        std::ifstream::pos_type size = iff.tellg();
-        iff.seekg(0, std::ios::beg);
-        std::vector<unsigned char> ff(static_cast<size_t>(size));
+        {
+            ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+            compressor.addFile("lorem_ipsum.txt", testDataString);
+            compressor.addFile("skipped.txt", testDataA10.begin(), testDataA10.end());
+            compressor.addFile("vector_b.txt", testDataB10.begin(), testDataB10.end());
+        }
 
-        while (iff.good())
+        ArchivePushReader reader;
+        std::vector<std::string> names;
+        std::vector<std::string> contents;
+        size_t fed = 0;
+        const size_t chunkSize = 13;
+        bool done = false;
+
+        while (!done)
         {
-            iff.read(reinterpret_cast<char*>(ff.data()), size);
+            switch (reader.next())
+            {
+                case ArchivePushReader::Event::NeedInput:
+                    if (fed == buf.size())
+                    {
+                        reader.finish();
+                    }
+                    else
+                    {
+                        size_t n = std::min(chunkSize, buf.size() - fed);
+                        reader.feed(buf.data() + fed, n);
+                        fed += n;
+                    }
+                    break;
+
+                case ArchivePushReader::Event::Header:
+                    names.push_back(reader.entry().pathname());
+                    contents.push_back(std::string());
+
+                    if (names.back() == "skipped.txt")
+                    {
+                        reader.skipData();
+                    }
+                    break;
+
+                case ArchivePushReader::Event::Data:
+                    contents.back().append(static_cast<const char*>(reader.data()),
+                                           reader.dataSize());
+                    break;
+
+                case ArchivePushReader::Event::EndOfEntry:
+                    break;
+
+                case ArchivePushReader::Event::EndOfArchive:
+                    done = true;
+                    break;
+            }
         }
 
-        ArchiveReader reader(std::move(ff));
-        return printArchiveEntries(reader)
-               && printArchiveEntries(reader1);
+        if (names.size() != 3
+            || contents[0] != testDataString
+            || !contents[1].empty()
+            || contents[2] != std::string(testDataB10.begin(), testDataB10.end()))
+        {
+            std::cerr << "Push reader produced unexpected entries\n";
+            return true;
+        }
+
+        // Abandoning a reader part way through must not leak or crash
+        ArchivePushReader partial;
+        partial.feed(buf.data(), buf.size() / 2);
+        for (ArchivePushReader::Event event = partial.next();
+             event != ArchivePushReader::Event::NeedInput;
+             event = partial.next())
+        {
+            // Half the archive can't hold its end
+            if (event == ArchivePushReader::Event::EndOfArchive)
+            {
+                std::cerr << "Push reader ended a truncated archive\n";
+                return true;
+            }
+        }
+
+        return false;
     }
     catch (const std::runtime_error& ex)
     {
-        std::cerr << "Error reading archive: " << ex.what() << '\n';
+        std::cerr << "Error in push reader: " << ex.what() << '\n';
         return true;
     }
 }
 
-static bool testCompressDirectory(const std::string& path)
+static bool testFormatHint()
 {
     PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    {
+        ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+        compressor.addFile("lorem_ipsum.txt", testDataString);
+    }
 
     try
     {
+        const bool strictModes[] = { false, true };
+
+        for (bool strict : strictModes)
         {
-            ArchiveWriter compressor(path, Format::PAX, Filter::Gzip);
-            compressor.addDiskPath("test_data_dir");
-        }
+            ArchiveReader reader(buf.data(), buf.size(), FormatHint(Format::PAX, Filter::Gzip, strict));
+            std::vector<unsigned char> out;
 
-        ArchiveReader reader(path);
-        return printArchiveEntries(reader);
+            for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+            {
+                if (!it->extractData<std::vector<unsigned char>>(out))
+                {
+                    std::cerr << "Error extracting hinted data\n";
+                    return true;
+                }
+            }
+
+            if (std::string(out.begin(), out.end()) != testDataString)
+            {
+                std::cerr << "Hinted read does not match\n";
+                return true;
+            }
+        }
     }
     catch (const std::runtime_error& ex)
     {
-        std::cerr << "Error writing archive from directory: " << ex.what() << '\n';
+        std::cerr << "Error reading with format hint: " << ex.what() << '\n';
+        return true;
+    }
+
+    try
+    {
+        ArchiveReader reader(buf.data(), buf.size(), FormatHint(Format::Zip, Filter::None, true));
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+        }
+
+        std::cerr << "Strict hint should have rejected a tar.gz as zip\n";
         return true;
     }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Expected exception for mismatched strict hint: " << ex.what() << '\n';
+        return false;
+    }
 }
 
-static bool testExtractDirectory(const std::string& path)
+static bool testSharedBuffer()
 {
     PRINT_TEST_NAME();
+    std::shared_ptr<std::vector<unsigned char>> buf = std::make_shared<std::vector<unsigned char>>();
 
-    try
     {
-        ArchiveReader reader(path);
+        ArchiveWriter compressor(*buf, Format::PAX, Filter::Gzip);
+        compressor.addFile("lorem_ipsum.txt", testDataString);
+    }
 
-        std::string extractedPath("extracted_");
-        extractedPath += path;
+    std::shared_ptr<const std::vector<unsigned char>> shared = buf;
+    buf.reset();
 
-        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+    const size_t nThreads = 4;
+    std::vector<std::thread> threads;
+    std::vector<int> failed(nThreads, 0);
+
+    for (size_t i = 0; i < nThreads; ++i)
+    {
+        threads.push_back(std::thread([&shared, &failed, i]()
         {
-            if (!it->extractDisk(extractedPath))
+            try
             {
-                std::cerr << "Error extracting directory\n";
+                ArchiveReader reader(shared);
+                std::vector<unsigned char> out;
+
+                for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+                {
+                    it->extractData<std::vector<unsigned char>>(out);
+                }
+
+                failed[i] = (std::string(out.begin(), out.end()) != testDataString);
+            }
+            catch (const std::runtime_error&)
+            {
+                failed[i] = 1;
+            }
+        }));
+    }
+
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+
+    for (int f : failed)
+    {
+        if (f)
+        {
+            std::cerr << "Concurrent read of shared buffer failed\n";
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static std::string extractSingleEntry(ArchiveReaderImpl& reader)
+{
+    std::vector<unsigned char> out;
+
+    for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+    {
+        it->extractData<std::vector<unsigned char>>(out);
+    }
+
+    return std::string(out.begin(), out.end());
+}
+
+static bool testReaderPool()
+{
+    PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    {
+        ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+        compressor.addFile("lorem_ipsum.txt", testDataString);
+    }
+
+    try
+    {
+        ArchiveReaderPool pool(FormatHint(Format::PAX, Filter::Gzip));
+
+        {
+            ArchiveReaderPool::Lease a = pool.lease();
+            ArchiveReaderPool::Lease b = pool.lease();
+
+            a->reset(buf.data(), buf.size());
+            b->reset(std::vector<unsigned char>(buf));
+
+            if (extractSingleEntry(*a) != testDataString
+                || extractSingleEntry(*b) != testDataString)
+            {
+                std::cerr << "Leased reader read wrong data\n";
+                return true;
+            }
+
+            // Reset an already used reader in place
+            a->reset(buf.data(), buf.size());
+            if (extractSingleEntry(*a) != testDataString)
+            {
+                std::cerr << "Reset reader read wrong data\n";
                 return true;
             }
         }
 
+        if (pool.idleCount() != 2)
+        {
+            std::cerr << "Expected 2 idle readers, found " << pool.idleCount() << '\n';
+            return true;
+        }
+
+        ArchiveReaderPool::Lease c = pool.lease();
+        c->reset(buf.data(), buf.size());
+        if (extractSingleEntry(*c) != testDataString || pool.idleCount() != 1)
+        {
+            std::cerr << "Reused reader read wrong data\n";
+            return true;
+        }
+
         return false;
     }
     catch (const std::runtime_error& ex)
     {
-        std::cerr << "Exception extracting directory: " << ex.what() << '\n';
+        std::cerr << "Error in reader pool: " << ex.what() << '\n';
         return true;
     }
 }
 
-static bool testMatch(const std::string& path, bool useCallback)
+static bool testWriterReset()
 {
     PRINT_TEST_NAME();
 
     try
     {
-        std::vector<unsigned char> buf;
+        std::vector<unsigned char> first;
+        std::vector<unsigned char> second;
+        std::vector<unsigned char> third;
 
-        ArchiveMatch match;
-        match.excludePattern("foo*");
+        ArchiveWriterPool pool(Format::PAX, Filter::Gzip);
 
-        if (useCallback)
         {
-            match.addCallback(
-                [](ArchiveEntry entry, void*) -> void
-            {
-                const char* uname = entry.uname();
-                const char* gname = entry.gname();
+            ArchiveWriterPool::Lease writer = pool.lease();
+            writer->reset(first);
+            writer->addFile("first.txt", testDataString);
+
+            // Finishes the first archive
+            writer->reset(second);
+            writer->addFile("second.txt", std::string(testDataB10.begin(), testDataB10.end()));
+            writer->close();
+        }
 
-                std::cout << "\nCallback: skipping path " << entry.pathname() << '\n'
-                          << " entry properties:\n"
-                          << "   ctime: " << entry.ctime() << '\n'
-                          << "   mtime: " << entry.mtime() << '\n'
-                          << "   size: " << entry.size() << '\n'
-                          << "   uname: " << (uname ? uname : "") << '\n'
-                          << "   gname: " << (gname ? gname : "") << '\n';
-            },
-            nullptr);
+        ArchiveReader firstReader(std::move(first));
+        ArchiveReader secondReader(std::move(second));
+
+        if (extractSingleEntry(firstReader) != testDataString
+            || extractSingleEntry(secondReader) != std::string(testDataB10.begin(), testDataB10.end()))
+        {
+            std::cerr << "Reset writer produced wrong archives\n";
+            return true;
         }
 
+        ArchiveWriterPool::Lease reused = pool.lease();
+        if (pool.idleCount() != 0)
         {
-            ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
-            compressor.addDiskPath(path, &match);
+            std::cerr << "Expected the idle writer to be reused\n";
+            return true;
         }
 
-        ArchiveReader reader(std::move(buf));
+        reused->reset(third);
+        reused->addFile("third.txt", testDataString);
+        reused->close();
 
-        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        ArchiveReader thirdReader(std::move(third));
+        if (extractSingleEntry(thirdReader) != testDataString)
         {
-            std::string entryName(it->pathname());
+            std::cerr << "Reused writer produced a wrong archive\n";
+            return true;
+        }
 
-            if (entryName.find("foo") != std::string::npos)
-            {
-                std::cerr << "File should have been excluded from archive";
-                return true;
-            }
+        // The archive is written out when it's closed, which doesn't fit
+        unsigned char small[16];
+        size_t smallSize = sizeof(small);
+        reused->reset(small, &smallSize);
+        reused->addFile("small.txt", testDataString);
+        try
+        {
+            reused->close();
+            std::cerr << "Closing into a full buffer did not throw\n";
+            return true;
+        }
+        catch (const std::system_error&)
+        {
+        }
+
+        // A writer returned without being closed isn't reused
+        reused.reset();
+        const size_t idle = pool.idleCount();
+        {
+            ArchiveWriterPool::Lease open = pool.lease();
+            open->reset(third);
+        }
+
+        if (idle != 1 || pool.idleCount() != 0)
+        {
+            std::cerr << "Expected only the closed writer to be reused\n";
+            return true;
         }
 
         return false;
     }
     catch (const std::runtime_error& ex)
     {
-        std::cerr << "Error testing match: " << ex.what() << '\n';
+        std::cerr << "Error resetting writer: " << ex.what() << '\n';
         return true;
     }
 }
 
-int main()
+static bool testDataBlocks()
 {
-    if (testCompressDirectory("test_data_dir.tar.gz"))
+    PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    // Bigger than one block so the entry is split
+    std::string big;
+    while (big.size() < 256 * 1024)
     {
-        return 1;
+        big += testDataString;
     }
 
-    if (testExtractDirectory("test_data_dir.tar.gz"))
     {
-        return 1;
+        ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+        compressor.addFile("big.txt", big);
     }
 
-    if (testDoesNotExist())
+    try
     {
-        return 1;
-    }
+        ArchiveReader reader(std::move(buf));
+        std::string copied;
+        size_t nBlocks = 0;
 
-    if (testArchiveWriteFile("test_write_file.tar.gz"))
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            for (const DataBlock& block : it->blocks())
+            {
+                if (block.offset != static_cast<std::int64_t>(copied.size()))
+                {
+                    std::cerr << "Unexpected block offset " << block.offset << '\n';
+                    return true;
+                }
+
+                copied.append(static_cast<const char*>(block.data), block.size);
+                ++nBlocks;
+            }
+        }
+
+        if (copied != big || nBlocks < 2)
+        {
+            std::cerr << "Data blocks do not match entry data\n";
+            return true;
+        }
+
+        return false;
+    }
+    catch (const std::runtime_error& ex)
     {
-        return 1;
+        std::cerr << "Error iterating data blocks: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testExtractTo()
+{
+    PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    std::string big;
+    while (big.size() < 256 * 1024)
+    {
+        big += testDataString;
+    }
+
+    {
+        ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+        compressor.addFile("big.txt", big);
+        compressor.addFile("small.txt", testDataString);
+    }
+
+    try
+    {
+        const size_t chunkSize = 1000;
+        std::vector<unsigned char> copy(buf);
+        ArchiveReader reader(std::move(copy));
+        ArchiveIterator it = reader.begin();
+
+        std::string copied;
+        bool oversized = false;
+        bool ok = it->extractTo([&](const void* data, size_t size) -> bool
+        {
+            oversized |= size > chunkSize;
+            copied.append(static_cast<const char*>(data), size);
+            return true;
+        },
+        chunkSize);
+
+        if (!ok || oversized || copied != big)
+        {
+            std::cerr << "Chunked extraction does not match entry data\n";
+            return true;
+        }
+
+        ++it;
+        std::ostringstream out;
+        if (!it->extractTo(out) || out.str() != testDataString)
+        {
+            std::cerr << "Stream extraction does not match entry data\n";
+            return true;
+        }
+
+        // The sink can stop extraction early
+        ArchiveReader again(std::move(buf));
+        size_t calls = 0;
+        if (again.begin()->extractTo([&](const void*, size_t) { return ++calls < 2; }, chunkSize)
+            || calls != 2)
+        {
+            std::cerr << "Sink did not stop extraction\n";
+            return true;
+        }
+
+        return false;
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error extracting to sink: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testAddFileRanges()
+{
+    PRINT_TEST_NAME();
+    std::vector<unsigned char> buf;
+
+    // Larger than the writer's staging buffer
+    std::vector<char> contiguous(100 * 1024);
+    for (size_t i = 0; i < contiguous.size(); ++i)
+    {
+        contiguous[i] = static_cast<char>(i * 7);
+    }
+
+    const std::list<char> listed(contiguous.begin(), contiguous.end());
+    const std::vector<int> widened(testDataA10.begin(), testDataA10.end());
+
+    {
+        ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+        compressor.addFile("contiguous", contiguous.begin(), contiguous.end());
+        compressor.addFile("listed", listed.begin(), listed.end());
+        compressor.addFile("widened", widened.begin(), widened.end());
+    }
+
+    ArchiveReader reader(std::move(buf));
+    std::vector<char> out;
+    const std::vector<char>* expected[] = { &contiguous, &contiguous, &testDataA10 };
+    size_t n = 0;
+
+    for (auto it = reader.begin(); !it.isAtEnd(); ++it, ++n)
+    {
+        if (n >= 3
+            || !it->extractData(out)
+            || out != *expected[n])
+        {
+            std::cerr << "Range content mismatch for " << it->pathname() << '\n';
+            return true;
+        }
+    }
+
+    return n != 3;
+}
+
+static bool testSegmentedBuffer()
+{
+    PRINT_TEST_NAME();
+
+    std::vector<unsigned char> flat;
+    std::shared_ptr<SegmentPool> pool = std::make_shared<SegmentPool>(4096);
+    SegmentedBuffer segmented(pool);
+    segmented.reserve(64 * 1024);
+
+    {
+        ArchiveWriter flatWriter(flat, Format::PAX, Filter::None);
+        ArchiveWriter segmentedWriter(segmented, Format::PAX, Filter::None);
+
+        for (int i = 0; i < 20; ++i)
+        {
+            std::string name = "file" + std::to_string(i) + ".txt";
+            flatWriter.addFile(name, testDataString);
+            segmentedWriter.addFile(name, testDataString);
+        }
+    }
+
+    size_t iovecTotal = 0;
+    for (const struct iovec& v : segmented.iovecs())
+    {
+        iovecTotal += v.iov_len;
+    }
+
+    if (segmented.gather() != flat
+        || iovecTotal != flat.size()
+        || segmented.segments().size() < 2)
+    {
+        std::cerr << "Segmented output does not match flat output\n";
+        return true;
+    }
+
+    // Segments go back to the pool for the next archive
+    size_t segmentCount = segmented.segments().size();
+    segmented.clear();
+    if (pool->idleCount() < segmentCount)
+    {
+        std::cerr << "Segments were not returned to the pool\n";
+        return true;
+    }
+
+    return false;
+}
+
+static bool testFileIngest()
+{
+    PRINT_TEST_NAME();
+    const std::string path = "ingest_source.bin";
+
+    std::vector<unsigned char> content(300 * 1024);
+    for (size_t i = 0; i < content.size(); ++i)
+    {
+        content[i] = static_cast<unsigned char>(i % 251);
+    }
+
+    writeArrayToFile(path, content);
+
+    std::vector<unsigned char> buf;
+
+    {
+        ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+        compressor.setFileBlockSize(10000);
+
+        // Read in aligned blocks
+        compressor.addFile(path);
+
+        // Written from a mapping
+        compressor.setMapThreshold(64 * 1024);
+        compressor.addFile(path);
+    }
+
+    std::remove(path.c_str());
+
+    ArchiveReader reader(std::move(buf));
+    std::vector<unsigned char> out;
+    size_t n = 0;
+
+    for (auto it = reader.begin(); !it.isAtEnd(); ++it, ++n)
+    {
+        if (!it->extractData<std::vector<unsigned char>>(out) || out != content)
+        {
+            std::cerr << "Ingested file content does not match\n";
+            return true;
+        }
+    }
+
+    if (n != 2)
+    {
+        return true;
+    }
+
+    // Symlinks have no content to read, even where they lead nowhere
+    mkdir("ingest_links", 0755);
+    writeArrayToFile("ingest_links/target", content);
+    symlink("target", "ingest_links/link");
+    symlink("nowhere", "ingest_links/broken");
+
+    std::vector<unsigned char> links;
+    try
+    {
+        ArchiveWriter compressor(links, Format::PAX, Filter::None);
+        compressor.setMapThreshold(64 * 1024);
+        compressor.addDiskPath("ingest_links");
+    }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Error adding symlinks: " << ex.what() << '\n';
+        return true;
+    }
+
+    ArchiveReader linkReader(std::move(links));
+    size_t symlinks = 0;
+
+    for (auto it = linkReader.begin(); !it.isAtEnd(); ++it)
+    {
+        if (it->filetype() == FileType::Link)
+        {
+            ++symlinks;
+        }
+        else if (it->filetype() == FileType::Regular
+                 && (!it->extractData<std::vector<unsigned char>>(out) || out != content))
+        {
+            std::cerr << "Symlink target content does not match\n";
+            return true;
+        }
+    }
+
+    return symlinks != 2;
+}
+
+static bool testParallelWalk()
+{
+    PRINT_TEST_NAME();
+
+    // Small limits so the queue and prefetch budget are exercised
+    ParallelWalkOptions options;
+    options.threads = 3;
+    options.queueDepth = 4;
+    options.prefetchBytes = 1024;
+    options.maxPrefetchFileSize = 600;
+
+    const std::vector<std::string> dirs = { "walk", "walk/b_dir", "walk/b_dir/nested", "walk/skip_dir" };
+    const std::vector<std::string> files = {
+        "walk/c.txt", "walk/a.txt", "walk/b_dir/nested/z.txt",
+        "walk/b_dir/y.txt", "walk/b_dir/big.txt", "walk/skip_dir/x.txt"
+    };
+
+    for (const std::string& dir : dirs)
+    {
+        mkdir(dir.c_str(), 0755);
+    }
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::vector<unsigned char> content(files[i].find("big") != std::string::npos ? 5000 : 100 * i,
+                                           static_cast<unsigned char>('a' + i));
+        writeArrayToFile(files[i], content);
+    }
+
+    std::vector<unsigned char> parallel;
+    std::vector<unsigned char> again;
+    std::vector<unsigned char> serial;
+
+    try
+    {
+        ArchiveMatch match;
+        match.excludePattern("*skip_dir");
+
+        {
+            ArchiveWriter compressor(parallel, Format::PAX, Filter::None);
+            compressor.addDiskPath("walk", options, &match);
+        }
+
+        {
+            ArchiveWriter compressor(again, Format::PAX, Filter::None);
+            compressor.addDiskPath("walk", options, &match);
+        }
+
+        {
+            ArchiveMatch serialMatch;
+            serialMatch.excludePattern("*skip_dir");
+
+            ArchiveWriter compressor(serial, Format::PAX, Filter::None);
+            compressor.addDiskPath("walk", &serialMatch);
+        }
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error walking in parallel: " << ex.what() << '\n';
+        return true;
+    }
+
+    for (size_t i = files.size(); i-- > 0; )
+    {
+        std::remove(files[i].c_str());
+    }
+
+    for (size_t i = dirs.size(); i-- > 0; )
+    {
+        std::remove(dirs[i].c_str());
+    }
+
+    if (parallel != again)
+    {
+        std::cerr << "Parallel walk output is not deterministic\n";
+        return true;
+    }
+
+    // Same entries and content as the serial walk, in sorted order
+    const std::vector<std::string> expectedOrder = {
+        "walk", "walk/a.txt", "walk/b_dir", "walk/b_dir/big.txt",
+        "walk/b_dir/nested", "walk/b_dir/nested/z.txt", "walk/b_dir/y.txt", "walk/c.txt"
+    };
+
+    std::vector<std::pair<std::string, std::vector<unsigned char>>> walked[2];
+    std::vector<unsigned char>* bufs[2] = { &parallel, &serial };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ArchiveReader reader(std::move(*bufs[i]));
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            std::string name = it->pathname();
+            if (!name.empty() && name[name.size() - 1] == '/')
+            {
+                name.resize(name.size() - 1);
+            }
+
+            std::vector<unsigned char> content;
+            it->extractData<std::vector<unsigned char>>(content);
+            walked[i].push_back(std::make_pair(name, content));
+        }
+    }
+
+    if (walked[0].size() != expectedOrder.size())
+    {
+        std::cerr << "Parallel walk has " << walked[0].size() << " entries\n";
+        return true;
+    }
+
+    for (size_t i = 0; i < expectedOrder.size(); ++i)
+    {
+        if (walked[0][i].first != expectedOrder[i])
+        {
+            std::cerr << "Unexpected entry order at " << walked[0][i].first << '\n';
+            return true;
+        }
+    }
+
+    std::sort(walked[0].begin(), walked[0].end());
+    std::sort(walked[1].begin(), walked[1].end());
+    if (walked[0] != walked[1])
+    {
+        std::cerr << "Parallel walk does not match serial walk\n";
+        return true;
+    }
+
+    return false;
+}
+
+static bool testUserGroupCache()
+{
+    PRINT_TEST_NAME();
+
+    std::shared_ptr<UserGroupCache> cache = std::make_shared<UserGroupCache>();
+    std::vector<unsigned char> bufs[2];
+
+    try
+    {
+        ArchiveWriter first(bufs[0], Format::PAX, Filter::None);
+        ArchiveWriter second(bufs[1], Format::PAX, Filter::None);
+        first.setUserGroupCache(cache);
+        second.setUserGroupCache(cache);
+
+        first.addFile("test_data_dir/bar.txt");
+        first.addFile("test_data_dir/bar.txt");
+        second.addFile("test_data_dir/bar.txt");
+
+        if (second.userGroupCache() != cache)
+        {
+            std::cerr << "Writer is not using the shared cache\n";
+            return true;
+        }
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error adding files with a shared cache: " << ex.what() << '\n';
+        return true;
+    }
+
+    struct stat st;
+    stat("test_data_dir/bar.txt", &st);
+    const char* expectedUname = cache->uname(st.st_uid);
+    const char* expectedGname = cache->gname(st.st_gid);
+
+    for (std::vector<unsigned char>& buf : bufs)
+    {
+        ArchiveReader reader(std::move(buf));
+
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            const char* uname = it->uname();
+            const char* gname = it->gname();
+
+            if (std::string(uname ? uname : "") != (expectedUname ? expectedUname : "")
+                || std::string(gname ? gname : "") != (expectedGname ? expectedGname : ""))
+            {
+                std::cerr << "Unexpected owner names in entry\n";
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool testParallelCompression()
+{
+    PRINT_TEST_NAME();
+
+    std::string big;
+    for (int i = 0; big.size() < 300 * 1024; ++i)
+    {
+        big += testDataString + std::to_string(i * 7919);
+    }
+
+    // Small blocks so the output spans many of them
+    CompressionOptions options;
+    options.threads = 3;
+    options.blockSize = 4096;
+
+    for (Filter filter : { Filter::Gzip, Filter::Bzip2 })
+    {
+        std::vector<unsigned char> buf;
+        const std::string path = "parallel_compressed.tar";
+
+        try
+        {
+            {
+                ArchiveWriter compressor(buf, Format::PAX, filter, options);
+                compressor.addFile("big.txt", big);
+                compressor.addFile("lorem_ipsum.txt", testDataString);
+            }
+
+            {
+                ArchiveWriter compressor(path, Format::PAX, filter, options);
+                compressor.addFile("big.txt", big);
+                compressor.addFile("lorem_ipsum.txt", testDataString);
+            }
+
+            ArchiveReader fromFile(path);
+            ArchiveReader fromMemory(std::move(buf));
+            ArchiveReader* readers[] = { &fromFile, &fromMemory };
+
+            for (ArchiveReader* reader : readers)
+            {
+                std::vector<std::string> contents;
+
+                for (auto it = reader->begin(); !it.isAtEnd(); ++it)
+                {
+                    std::ostringstream content;
+                    it->extractTo(content);
+                    contents.push_back(content.str());
+                }
+
+                if (contents.size() != 2 || contents[0] != big || contents[1] != testDataString)
+                {
+                    std::cerr << "Parallel " << showFilter(filter) << " output does not match\n";
+                    return true;
+                }
+
+                if (archive_filter_code(reader->raw(), 0) != static_cast<int>(filter))
+                {
+                    std::cerr << "Unexpected filter " << archive_filter_name(reader->raw(), 0) << '\n';
+                    return true;
+                }
+            }
+        }
+        catch (const std::runtime_error& ex)
+        {
+            std::cerr << "Error with parallel compression: " << ex.what() << '\n';
+            return true;
+        }
+
+        std::remove(path.c_str());
+    }
+
+    return false;
+}
+
+static bool roundTrip(Format format,
+                      Filter filter,
+                      const CompressionOptions& options,
+                      size_t* compressedSize = nullptr)
+{
+    std::vector<unsigned char> buf;
+
+    {
+        ArchiveWriter compressor(buf, format, filter, options);
+        compressor.addFile("lorem_ipsum.txt", testDataString);
+        compressor.addFile("vector_b.txt", testDataB10.begin(), testDataB10.end());
+    }
+
+    if (compressedSize)
+    {
+        *compressedSize = buf.size();
+    }
+
+    // The passphrase has to be added before opening
+    ArchiveReader reader((FormatHint()));
+    if (!options.zip.passphrase.empty())
+    {
+        archive_read_add_passphrase(reader.raw(), options.zip.passphrase.c_str());
+    }
+
+    reader.reset(std::move(buf));
+
+    std::vector<std::string> contents;
+    for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+    {
+        std::ostringstream content;
+        it->extractTo(content);
+        contents.push_back(content.str());
+    }
+
+    return contents.size() != 2
+        || contents[0] != testDataString
+        || contents[1] != std::string(testDataB10.begin(), testDataB10.end());
+}
+
+static bool testCompressionOptions()
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        CompressionOptions options;
+        options.level = 19;
+        options.threads = 2;
+
+        for (Filter filter : { Filter::Zstd, Filter::LZ4, Filter::Xz })
+        {
+            if (!writeFilterIsSupported(filter))
+            {
+                std::cout << showFilter(filter) << " is not supported, skipping\n";
+                continue;
+            }
+
+            CompressionOptions filterOptions(options);
+            filterOptions.level = filter == Filter::Zstd ? 19 : 9;
+
+            if (roundTrip(Format::PAX, filter, filterOptions))
+            {
+                std::cerr << "Round trip failed with " << showFilter(filter) << '\n';
+                return true;
+            }
+        }
+
+        CompressionOptions store;
+        store.zip.method = ZipOptions::Method::Store;
+        CompressionOptions deflate;
+        deflate.level = 9;
+        deflate.zip.method = ZipOptions::Method::Deflate;
+
+        size_t storedSize = 0;
+        size_t deflatedSize = 0;
+        if (roundTrip(Format::Zip, Filter::None, store, &storedSize)
+            || roundTrip(Format::Zip, Filter::None, deflate, &deflatedSize)
+            || deflatedSize >= storedSize)
+        {
+            std::cerr << "Zip compression method was not applied\n";
+            return true;
+        }
+
+        CompressionOptions encrypted;
+        encrypted.zip.encryption = "zipcrypt";
+        encrypted.zip.passphrase = "moor";
+        if (roundTrip(Format::Zip, Filter::None, encrypted))
+        {
+            std::cerr << "Encrypted zip round trip failed\n";
+            return true;
+        }
+
+        CompressionOptions sevenZip;
+        sevenZip.sevenZip.method = SevenZipOptions::Method::Bzip2;
+        if (roundTrip(Format::Zip7, Filter::None, sevenZip))
+        {
+            std::cerr << "7z round trip failed\n";
+            return true;
+        }
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error with compression options: " << ex.what() << '\n';
+        return true;
+    }
+
+    // Filters without a level ignore it
+    for (Filter filter : { Filter::Compress, Filter::UU })
+    {
+        try
+        {
+            CompressionOptions options;
+            options.level = 5;
+            std::vector<unsigned char> buf;
+            {
+                ArchiveWriter compressor(buf, Format::PAX, filter, options);
+                compressor.addFile("level.txt", testDataString);
+            }
+
+            ArchiveReader reader(std::move(buf));
+            std::vector<unsigned char> out;
+            auto it = reader.begin();
+            if (it.isAtEnd()
+                || !it->extractData<std::vector<unsigned char>>(out)
+                || std::string(out.begin(), out.end()) != testDataString)
+            {
+                std::cerr << "Round trip with an unused level failed\n";
+                return true;
+            }
+        }
+        catch (const std::system_error& ex)
+        {
+            std::cerr << "Level was refused by a filter without one: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    // Out of range levels are rejected
+    try
+    {
+        CompressionOptions bad;
+        bad.level = 42;
+        std::vector<unsigned char> buf;
+        ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip, bad);
+
+        std::cerr << "Invalid compression level was accepted\n";
+        return true;
+    }
+    catch (const std::system_error&)
+    {
+    }
+
+    return false;
+}
+
+static bool testParallelZip()
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        std::string big;
+        for (int i = 0; big.size() < 200 * 1024; ++i)
+        {
+            big += "Entry " + std::to_string(i) + ": " + testDataString;
+        }
+
+        // Doesn't deflate, so is stored
+        std::vector<unsigned char> noise(16 * 1024);
+        unsigned state = 12345;
+        for (unsigned char& c : noise)
+        {
+            state = state * 1103515245 + 12345;
+            c = static_cast<unsigned char>(state >> 16);
+        }
+
+        {
+            std::ofstream source("pzip_source.txt", std::ios::binary);
+            source << testDataString;
+        }
+
+        CompressionOptions options;
+        options.threads = 3;
+        options.zip.spillSize = 4096;
+
+        std::vector<unsigned char> buf;
+        {
+            ParallelZipWriter writer(buf, options);
+            writer.addDirectory("dir");
+            writer.addFile("dir/big.txt", big);
+            writer.addFile("noise.bin", std::vector<unsigned char>(noise));
+            writer.addFile("pzip_source.txt");
+            writer.addFile("empty", std::string());
+            writer.close();
+        }
+
+        writeArrayToFile("parallel.zip", buf);
+
+        const std::string names[] = { "dir/", "dir/big.txt", "noise.bin", "pzip_source.txt", "empty" };
+        const std::string contents[] =
+        {
+            std::string(),
+            big,
+            std::string(noise.begin(), noise.end()),
+            testDataString,
+            std::string()
+        };
+
+        ArchiveReader reader(std::move(buf));
+        size_t i = 0;
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it, ++i)
+        {
+            std::ostringstream content;
+            it->extractTo(content);
+
+            if (i >= 5 || it->pathname() != names[i] || content.str() != contents[i])
+            {
+                std::cerr << "Unexpected parallel zip entry " << it->pathname() << '\n';
+                return true;
+            }
+        }
+
+        if (i != 5)
+        {
+            std::cerr << "Parallel zip has " << i << " entries\n";
+            return true;
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Error writing parallel zip: " << ex.what() << '\n';
+        return true;
+    }
+
+    return false;
+}
+
+static bool testConcurrentWriter()
+{
+    PRINT_TEST_NAME();
+
+    typedef ConcurrentWriterOptions::Ordering Ordering;
+
+    for (Ordering ordering : { Ordering::Arrival, Ordering::Sequence })
+    {
+        const int producers = 4;
+        const int perProducer = 50;
+
+        try
+        {
+            std::vector<unsigned char> buf;
+            ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+
+            {
+                ConcurrentWriterOptions options;
+                options.ordering = ordering;
+                options.queueDepth = 3;
+                options.queueBytes = 1024;
+
+                ConcurrentArchiveWriter writer(compressor, options);
+
+                EntrySubmission dir;
+                dir.name = "dir";
+                dir.type = FileType::Directory;
+                dir.permission = 0755;
+                dir.sequence = writer.nextSequence();
+                writer.submit(std::move(dir));
+
+                std::vector<std::thread> threads;
+                for (int p = 0; p < producers; ++p)
+                {
+                    threads.push_back(std::thread([&writer, p, perProducer]
+                    {
+                        for (int i = 0; i < perProducer; ++i)
+                        {
+                            EntrySubmission entry;
+                            entry.sequence = writer.nextSequence();
+                            entry.name = "dir/" + std::to_string(entry.sequence);
+                            std::string content = std::to_string(p) + ":" + std::to_string(i) + testDataString;
+                            entry.data.assign(content.begin(), content.end());
+
+                            while (i % 2 == 0 && !writer.trySubmit(entry))
+                            {
+                                std::this_thread::yield();
+                            }
+
+                            if (i % 2 != 0)
+                            {
+                                writer.submit(std::move(entry));
+                            }
+                        }
+                    }));
+                }
+
+                for (std::thread& t : threads)
+                {
+                    t.join();
+                }
+
+                writer.close();
+            }
+
+            compressor.close();
+
+            ArchiveReader reader(std::move(buf));
+            int count = 0;
+            std::vector<bool> seen(producers * perProducer + 1);
+
+            for (auto it = reader.begin(); !it.isAtEnd(); ++it, ++count)
+            {
+                const std::string name = it->pathname();
+                if (count == 0)
+                {
+                    if (name != "dir/" || it->filetype() != FileType::Directory)
+                    {
+                        std::cerr << "Expected the directory first, got " << name << '\n';
+                        return true;
+                    }
+
+                    continue;
+                }
+
+                size_t sequence = std::stoul(name.substr(4));
+                if (sequence >= seen.size() || seen[sequence]
+                    || (ordering == Ordering::Sequence && sequence != static_cast<size_t>(count)))
+                {
+                    std::cerr << "Unexpected entry " << name << " at " << count << '\n';
+                    return true;
+                }
+
+                seen[sequence] = true;
+            }
+
+            if (count != producers * perProducer + 1)
+            {
+                std::cerr << "Expected " << producers * perProducer + 1
+                          << " entries, got " << count << '\n';
+                return true;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Error with concurrent writer: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    // Gaps in the sequence are reported on close
+    try
+    {
+        std::vector<unsigned char> buf;
+        ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+
+        ConcurrentWriterOptions options;
+        options.ordering = ConcurrentWriterOptions::Ordering::Sequence;
+        ConcurrentArchiveWriter writer(compressor, options);
+
+        EntrySubmission entry;
+        entry.name = "late";
+        entry.sequence = 1;
+        writer.submit(std::move(entry));
+        writer.close();
+
+        std::cerr << "Sequence gap was not reported\n";
+        return true;
+    }
+    catch (const std::logic_error&)
+    {
+    }
+
+    // As is a failed write of the content, not only of a header
+    try
+    {
+        ArchiveWriter compressor([](ArchiveWriter& w, void*, const void*, size_t) -> ssize_t
+        {
+            archive_set_error(w.raw(), ENOSPC, "No space left");
+            return -1;
+        }, Format::PAX, Filter::None);
+
+        ConcurrentArchiveWriter writer(compressor);
+
+        EntrySubmission entry;
+        entry.name = "full";
+        entry.data.assign(64 * 1024, 'f');
+        writer.submit(std::move(entry));
+        writer.close();
+
+        std::cerr << "Content write error was not reported\n";
+        return true;
+    }
+    catch (const std::system_error& ex)
+    {
+        if (ex.code().value() != ENOSPC)
+        {
+            std::cerr << "Unexpected error: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool testArchiveStream()
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        std::string big;
+        for (int i = 0; big.size() < 300 * 1024; ++i)
+        {
+            big += std::to_string(i) + testDataString;
+        }
+
+        {
+            std::ofstream source("stream_source.txt", std::ios::binary);
+            source << testDataString;
+        }
+
+        ArchiveStream stream(Format::PAX, Filter::Gzip);
+        stream.addDirectory("streamed");
+        stream.addFile("streamed/big.txt", std::vector<unsigned char>(big.begin(), big.end()));
+        stream.addFile("stream_source.txt");
+
+        size_t generated = 0;
+        stream.addFile("streamed/generated", 100000, [&generated](void* buf, size_t size)
+        {
+            size_t n = std::min<size_t>(size, 100000 - generated);
+            std::memset(buf, 'g', n);
+            generated += n;
+            return n;
+        });
+
+        // Pull with uneven buffer sizes, nothing should be produced ahead
+        // of the first read
+        if (generated != 0)
+        {
+            std::cerr << "Stream read content before it was needed\n";
+            return true;
+        }
+
+        std::vector<unsigned char> archive;
+        std::vector<unsigned char> buf(7001);
+        for (size_t want = 1; ; want = want * 3 % buf.size() + 1)
+        {
+            size_t n = stream.read(buf.data(), want);
+            if (n == 0)
+            {
+                break;
+            }
+
+            archive.insert(archive.end(), buf.begin(), buf.begin() + n);
+        }
+
+        if (!stream.atEnd() || stream.read(buf.data(), buf.size()) != 0)
+        {
+            std::cerr << "Stream did not end\n";
+            return true;
+        }
+
+        const std::string names[] = { "streamed/", "streamed/big.txt", "stream_source.txt", "streamed/generated" };
+        const std::string contents[] = { std::string(), big, testDataString, std::string(100000, 'g') };
+
+        ArchiveReader reader(std::move(archive));
+        size_t i = 0;
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it, ++i)
+        {
+            std::ostringstream content;
+            it->extractTo(content);
+
+            if (i >= 4 || it->pathname() != names[i] || content.str() != contents[i])
+            {
+                std::cerr << "Unexpected streamed entry " << it->pathname() << '\n';
+                return true;
+            }
+        }
+
+        if (i != 4)
+        {
+            std::cerr << "Stream has " << i << " entries\n";
+            return true;
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Error streaming archive: " << ex.what() << '\n';
+        return true;
+    }
+
+    return false;
+}
+
+static bool testExtractAll()
+{
+    PRINT_TEST_NAME();
+
+    const std::time_t dirTime = 1000000000;
+
+    try
+    {
+        std::vector<unsigned char> buf;
+        {
+            ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+            compressor.addHeader("top", FileType::Directory, 0, 0750, dirTime);
+            compressor.addFinish();
+
+            for (int i = 0; i < 20; ++i)
+            {
+                compressor.addFile("top/a/b/file" + std::to_string(i) + ".txt", testDataString);
+            }
+
+            compressor.addFile("top/skip.log", testDataString);
+
+            // Parents that aren't in the archive
+            compressor.addFile("other/deep/file.txt", testDataString);
+        }
+
+        ArchiveMatch match;
+        match.excludePattern("*.log");
+
+        ExtractOptions options;
+        options.flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+        options.match = &match;
+
+        ArchiveReader reader(std::move(buf));
+        size_t count = reader.extractAll("extract_all", options);
+        if (count != 22)
+        {
+            std::cerr << "Extracted " << count << " entries\n";
+            return true;
+        }
+
+        std::ifstream in("extract_all/top/a/b/file7.txt", std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (content != testDataString)
+        {
+            std::cerr << "Extracted content does not match\n";
+            return true;
+        }
+
+        struct stat st;
+        if (stat("extract_all/top/skip.log", &st) == 0)
+        {
+            std::cerr << "Excluded entry was extracted\n";
+            return true;
+        }
+
+        if (stat("extract_all/other/deep/file.txt", &st) != 0)
+        {
+            std::cerr << "Entry without parent directories was not extracted\n";
+            return true;
+        }
+
+        // Directory attributes are applied after the files inside it
+        if (stat("extract_all/top", &st) != 0
+            || st.st_mtime != dirTime
+            || (st.st_mode & 07777) != 0750)
+        {
+            std::cerr << "Directory time or permissions not restored\n";
+            return true;
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Error extracting archive: " << ex.what() << '\n';
+        return true;
+    }
+
+    return false;
+}
+
+static bool testExtractParallel()
+{
+    PRINT_TEST_NAME();
+
+    const std::time_t dirTime = 1000000000;
+
+    // Read while no other thread is running
+    const mode_t mask = umask(0);
+    umask(mask);
+
+    // Added from disk to get a symlink entry
+    mkdir("pe", 0755);
+    symlink("0", "pe/link");
+
+    for (Format format : { Format::Zip, Format::PAX })
+    {
+        const std::string path = format == Format::Zip ? "parallel_extract.zip" : "parallel_extract.tar";
+        const std::string root = "extract_parallel_" + std::string(showFormat(format));
+
+        try
+        {
+            {
+                ArchiveWriter compressor(path, format, Filter::None);
+                compressor.addHeader("pe", FileType::Directory, 0, 0700, dirTime);
+                compressor.addFinish();
+
+                for (int i = 0; i < 100; ++i)
+                {
+                    compressor.addFile("pe/" + std::to_string(i % 7) + "/file" + std::to_string(i),
+                                       std::to_string(i) + testDataString);
+                }
+
+                // The later copy wins
+                compressor.addFile("pe/dup", std::string("first"));
+                compressor.addFile("pe/dup", std::string("second"));
+
+                // Written through the symlink, as extractAll would
+                compressor.addHeader("pe/link");
+                compressor.addFinish();
+                compressor.addFile("pe/link/through", std::string("through"));
+            }
+
+            ExtractOptions options;
+            options.threads = 4;
+
+            size_t count = ArchiveReader::extractParallel(path, root, options);
+            if (count != 105)
+            {
+                std::cerr << "Extracted " << count << " entries from " << path << '\n';
+                return true;
+            }
+
+            for (int i = 0; i < 100; i += 9)
+            {
+                std::ifstream in(root + "/pe/" + std::to_string(i % 7) + "/file" + std::to_string(i), std::ios::binary);
+                std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                if (content != std::to_string(i) + testDataString)
+                {
+                    std::cerr << "Parallel extracted content does not match\n";
+                    return true;
+                }
+            }
+
+            // Every file is created under the process umask
+            for (int i = 0; i < 100; ++i)
+            {
+                struct stat fileStat;
+                const std::string file = root + "/pe/" + std::to_string(i % 7) + "/file" + std::to_string(i);
+                if (stat(file.c_str(), &fileStat) != 0 || (fileStat.st_mode & mask) != 0)
+                {
+                    std::cerr << "Parallel extracted " << file << " ignores the umask\n";
+                    return true;
+                }
+            }
+
+            std::ifstream dup(root + "/pe/dup", std::ios::binary);
+            std::string dupContent((std::istreambuf_iterator<char>(dup)), std::istreambuf_iterator<char>());
+
+            struct stat st;
+            if (dupContent != "second"
+                || stat((root + "/pe").c_str(), &st) != 0
+                || st.st_mtime != dirTime
+                || (st.st_mode & 07777) != 0700)
+            {
+                std::cerr << "Parallel extraction lost ordering or directory attributes\n";
+                return true;
+            }
+
+            std::ifstream through(root + "/pe/0/through", std::ios::binary);
+            std::string throughContent((std::istreambuf_iterator<char>(through)), std::istreambuf_iterator<char>());
+            if (lstat((root + "/pe/link").c_str(), &st) != 0
+                || !S_ISLNK(st.st_mode)
+                || throughContent != "through")
+            {
+                std::cerr << "Entry below a symlink was not written through it\n";
+                return true;
+            }
+        }
+        catch (const std::system_error& ex)
+        {
+            std::cerr << "Error extracting " << path << " in parallel: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool testExtractIoUring()
+{
+    PRINT_TEST_NAME();
+
+    // The result is the same either way, but the test only covers
+    // io_uring where it's available
+    if (!ExtractOptions::supports(ExtractOptions::Backend::WriteDisk))
+    {
+        std::cerr << "Disk writer backend is not supported\n";
+        return true;
+    }
+
+    std::cout << "io_uring is "
+              << (ExtractOptions::supports(ExtractOptions::Backend::IoUring) ? "available" : "unavailable")
+              << '\n';
+
+    const std::time_t fileTime = 1200000000;
+
+    try
+    {
+        std::vector<unsigned char> buf;
+        {
+            ArchiveWriter compressor(buf, Format::PAX, Filter::None);
+
+            for (int i = 0; i < 200; ++i)
+            {
+                std::string content = std::to_string(i) + testDataString;
+                compressor.addHeader("uring/" + std::to_string(i % 5) + "/f" + std::to_string(i),
+                                     FileType::Regular,
+                                     static_cast<std::int64_t>(content.size()),
+                                     i % 2 == 0 ? 0644 : 0600,
+                                     fileTime);
+                compressor.addContent(content.data(), content.size());
+                compressor.addFinish();
+            }
+
+            // Larger than the batch limit
+            compressor.addFile("uring/big", std::string(256 * 1024, 'b'));
+            compressor.addFile("uring/empty", std::string());
+
+            // The later copy wins
+            compressor.addFile("uring/dup", std::string("first"));
+            compressor.addFile("uring/dup", std::string("second"));
+        }
+
+        ExtractOptions options;
+        options.backend = ExtractOptions::Backend::IoUring;
+        options.queueDepth = 16;
+
+        // The second pass replaces existing files
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            ArchiveReader reader((std::vector<unsigned char>(buf)));
+            if (reader.extractAll("extract_uring", options) != 204)
+            {
+                std::cerr << "Unexpected entry count\n";
+                return true;
+            }
+
+            for (int i = 0; i < 200; i += 7)
+            {
+                const std::string path = "extract_uring/uring/" + std::to_string(i % 5) + "/f" + std::to_string(i);
+                std::ifstream in(path, std::ios::binary);
+                std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+                struct stat st;
+                if (content != std::to_string(i) + testDataString
+                    || stat(path.c_str(), &st) != 0
+                    || (st.st_mode & 07777) != (i % 2 == 0 ? 0644u : 0600u)
+                    || st.st_mtime != fileTime)
+                {
+                    std::cerr << "File " << path << " was not restored\n";
+                    return true;
+                }
+            }
+
+            std::ifstream big("extract_uring/uring/big", std::ios::binary);
+            std::string bigContent((std::istreambuf_iterator<char>(big)), std::istreambuf_iterator<char>());
+            std::ifstream dup("extract_uring/uring/dup", std::ios::binary);
+            std::string dupContent((std::istreambuf_iterator<char>(dup)), std::istreambuf_iterator<char>());
+
+            struct stat st;
+            if (bigContent != std::string(256 * 1024, 'b')
+                || dupContent != "second"
+                || stat("extract_uring/uring/empty", &st) != 0
+                || st.st_size != 0)
+            {
+                std::cerr << "Large, empty or repeated entries were not restored\n";
+                return true;
+            }
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        std::cerr << "Error extracting with io_uring: " << ex.what() << '\n';
+        return true;
+    }
+
+    return false;
+}
+
+static bool testCopyRangeTar()
+{
+    PRINT_TEST_NAME();
+
+    // Sizes that do and don't end on a tar block
+    const size_t sizes[] = { 1, 512, 100000, 3 * 1024 * 1024 + 7 };
+    std::vector<std::string> contents;
+
+    mkdir("copy_range_src", 0755);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        std::string content(sizes[i], '\0');
+        for (size_t j = 0; j < content.size(); ++j)
+        {
+            content[j] = static_cast<char>('a' + (j * 7 + i) % 26);
+        }
+
+        std::ofstream out("copy_range_src/file" + std::to_string(i), std::ios::binary);
+        out << content;
+        contents.push_back(content);
+    }
+
+    chmod("copy_range_src/file2", 0640);
+
+    for (Format format : { Format::PAX, Format::Tar })
+    {
+        const std::string suffix = format == Format::PAX ? "pax" : "gnu";
+        const std::string path = "copy_range_" + suffix + ".tar";
+        const std::string root = "copy_range_out_" + suffix;
+
+        try
+        {
+            {
+                ArchiveWriter compressor(path, format, Filter::None);
+                for (size_t i = 0; i < contents.size(); ++i)
+                {
+                    compressor.addFile("copy_range_src/file" + std::to_string(i));
+
+                    // Data written by libarchive in between copied data
+                    compressor.addFile("copy_range_src/inline" + std::to_string(i), testDataString);
+                }
+
+                // A long name adds an extended header before the entry's own
+                compressor.addHeader("copy_range_src/" + std::string(150, 'n'),
+                                     FileType::Regular,
+                                     static_cast<std::int64_t>(contents[2].size()));
+                compressor.writeFileData("copy_range_src/file2");
+                compressor.addFinish();
+            }
+
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || st.st_size % 10240 != 0)
+            {
+                std::cerr << "Tar file is not padded to a whole block\n";
+                return true;
+            }
+
+            // Through libarchive's own reading, without any copying
+            std::vector<unsigned char> buf;
+            {
+                std::ifstream in(path, std::ios::binary);
+                buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            }
+
+            ArchiveReader memoryReader(std::move(buf));
+            size_t entries = 0;
+            for (auto it = memoryReader.begin(); !it.isAtEnd(); ++it, ++entries)
+            {
+                const std::string name(it->pathname());
+                std::vector<unsigned char> data;
+                it->extractData<std::vector<unsigned char>>(data);
+
+                std::string expected = testDataString;
+                if (name.find("copy_range_src/file") == 0)
+                {
+                    expected = contents[std::stoul(name.substr(19))];
+                }
+                else if (name.find("copy_range_src/nnn") == 0)
+                {
+                    expected = contents[2];
+                }
+
+                if (std::string(data.begin(), data.end()) != expected)
+                {
+                    std::cerr << "Content of " << name << " does not match\n";
+                    return true;
+                }
+            }
+
+            if (entries != 2 * contents.size() + 1)
+            {
+                std::cerr << "Read " << entries << " entries\n";
+                return true;
+            }
+
+            ArchiveReader reader(path);
+            if (reader.extractAll(root, ExtractOptions()) != entries)
+            {
+                std::cerr << "Extracted a different number of entries\n";
+                return true;
+            }
+
+            for (size_t i = 0; i < contents.size(); ++i)
+            {
+                const std::string name = "copy_range_src/file" + std::to_string(i);
+                std::ifstream in(root + "/" + name, std::ios::binary);
+                std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+                struct stat source;
+                stat(name.c_str(), &source);
+                if (content != contents[i]
+                    || stat((root + "/" + name).c_str(), &st) != 0
+                    || st.st_mode != source.st_mode
+                    || st.st_mtime != source.st_mtime)
+                {
+                    std::cerr << "Extracted " << name << " does not match\n";
+                    return true;
+                }
+            }
+        }
+        catch (const std::system_error& ex)
+        {
+            std::cerr << "Error copying tar data: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    // The archive is refused as an entry of itself, as with other formats
+    mkdir("copy_range_self", 0755);
+    std::ofstream("copy_range_self/file") << testDataString;
+    for (Format format : { Format::PAX, Format::Tar })
+    {
+        try
+        {
+            ArchiveWriter compressor("copy_range_self/self.tar", format, Filter::None);
+            compressor.addDiskPath("copy_range_self");
+            std::cerr << "Archive was added to itself\n";
+            return true;
+        }
+        catch (const std::system_error&)
+        {
+        }
+    }
+
+    // A FIFO can't be written at an offset, so libarchive writes to it
+    unlink("copy_range_fifo");
+    if (mkfifo("copy_range_fifo", 0644) != 0)
+    {
+        std::cerr << "Could not make a FIFO\n";
+        return true;
+    }
+
+    std::vector<unsigned char> piped;
+    std::thread drain([&piped]()
+    {
+        std::ifstream in("copy_range_fifo", std::ios::binary);
+        piped.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    });
+
+    try
+    {
+        ArchiveWriter compressor("copy_range_fifo", Format::PAX, Filter::None);
+        compressor.addFile("copy_range_src/file2");
+        compressor.addFinish();
+    }
+    catch (const std::system_error& ex)
+    {
+        // Unblock the reader if the writer never opened the FIFO
+        std::ofstream("copy_range_fifo");
+        drain.join();
+        std::cerr << "Error writing to a FIFO: " << ex.what() << '\n';
+        return true;
+    }
+
+    drain.join();
+    if (piped.size() % 10240 != 0)
+    {
+        std::cerr << "FIFO output is not padded to a whole block\n";
+        return true;
+    }
+
+    ArchiveReader pipedReader(std::move(piped));
+    auto it = pipedReader.begin();
+    std::vector<unsigned char> data;
+    if (!it.isAtEnd())
+    {
+        it->extractData<std::vector<unsigned char>>(data);
+    }
+
+    if (std::string(data.begin(), data.end()) != contents[2])
+    {
+        std::cerr << "Content written to a FIFO does not match\n";
+        return true;
+    }
+
+    return false;
+}
+
+static bool testSparseFiles()
+{
+    PRINT_TEST_NAME();
+
+    const std::int64_t fileSize = 16 * 1024 * 1024;
+
+    mkdir("sparse_src", 0755);
+    {
+        std::ofstream out("sparse_src/image", std::ios::binary);
+        out.seekp(1024 * 1024);
+        out << "data";
+    }
+
+    if (truncate("sparse_src/image", fileSize) != 0)
+    {
+        std::cerr << "Could not make a sparse file\n";
+        return true;
+    }
+
+    // Without holes in the source, there is nothing to check them against
+    struct stat st;
+    stat("sparse_src/image", &st);
+    const bool holes = st.st_blocks * 512 < fileSize;
+
+    std::string image(static_cast<size_t>(fileSize), '\0');
+    image.replace(1024 * 1024, 4, "data");
+
+    // Zero blocks in content from memory
+    std::string content(256 * 1024, '\0');
+    content[5000] = 'a';
+    content[content.size() - 1] = 'z';
+
+    for (Format format : { Format::PAX, Format::Tar })
+    {
+        const std::string suffix = format == Format::PAX ? "pax" : "gnu";
+        const std::string path = "sparse_" + suffix + ".tar";
+
+        try
+        {
+            {
+                ArchiveWriter compressor(path, format, Filter::None);
+                compressor.addFile("sparse_src/image");
+                compressor.addFile("content", content);
+                compressor.addFile("zeros", std::string(100000, '\0'));
+            }
+
+            stat(path.c_str(), &st);
+            if (format == Format::PAX && st.st_size > 256 * 1024 && holes)
+            {
+                std::cerr << "Holes were stored in the archive: " << st.st_size << " bytes\n";
+                return true;
+            }
+
+            // ARCHIVE_EXTRACT_SPARSE gives GNU tar's stored zeros holes too
+            const std::string root = "sparse_out_" + suffix;
+            ExtractOptions options;
+            options.flags |= ARCHIVE_EXTRACT_SPARSE;
+
+            ArchiveReader reader(path);
+            if (reader.extractAll(root, options) != 3)
+            {
+                std::cerr << "Extracted a different number of entries\n";
+                return true;
+            }
+
+            const std::pair<std::string, std::string> expected[] =
+            {
+                std::make_pair(root + "/sparse_src/image", image),
+                std::make_pair(root + "/content", content),
+                std::make_pair(root + "/zeros", std::string(100000, '\0'))
+            };
+
+            for (const std::pair<std::string, std::string>& file : expected)
+            {
+                std::ifstream in(file.first, std::ios::binary);
+                std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                if (data != file.second)
+                {
+                    std::cerr << "Content of " << file.first << " does not match\n";
+                    return true;
+                }
+            }
+
+            if (holes
+                && (stat((root + "/sparse_src/image").c_str(), &st) != 0
+                    || st.st_blocks * 512 >= fileSize))
+            {
+                std::cerr << "Extracted file has no holes\n";
+                return true;
+            }
+        }
+        catch (const std::system_error& ex)
+        {
+            std::cerr << "Error with sparse files: " << ex.what() << '\n';
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool printArchiveEntries(ArchiveReader& reader)
+{
+    for (ArchiveIterator it = reader.begin(); !it.isAtEnd(); ++it)
+    {
+        std::cout << "Extracting " << it->pathname()
+                  << " size " << it->size()
+                  << '\n';
+
+        std::vector<unsigned char> data;
+
+        if (!it->extractData<std::vector<unsigned char>>(data))
+        {
+            std::cerr << "Error extracting data\n";
+            return true;
+        }
+
+        if (static_cast<size_t>(it->size()) != data.size())
+        {
+            std::cerr << "Read data size doesn't match entry size\n";
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool testArchiveRead(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        ArchiveReader reader1(path);
+        std::ifstream iff(path, std::ios::binary);
+        iff.seekg(0, std::ios::end);
+        std::ifstream::pos_type size = iff.tellg();
+        iff.seekg(0, std::ios::beg);
+        std::vector<unsigned char> ff(static_cast<size_t>(size));
+
+        while (iff.good())
+        {
+            iff.read(reinterpret_cast<char*>(ff.data()), size);
+        }
+
+        ArchiveReader reader(std::move(ff));
+        return printArchiveEntries(reader)
+               && printArchiveEntries(reader1);
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error reading archive: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testArchiveReadMapped(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        MappedFile mapped(path);
+        ArchiveReader reader(std::move(mapped));
+        return printArchiveEntries(reader);
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error reading mapped archive: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testMappedFileFallback(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    std::vector<unsigned char> expected;
+    {
+        std::ifstream in(path, std::ios::binary);
+        expected.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    // A FIFO has no size and is read until the writer closes it
+    unlink("mapped_fifo");
+    if (mkfifo("mapped_fifo", 0644) != 0)
+    {
+        std::cerr << "Could not make a FIFO\n";
+        return true;
+    }
+
+    std::thread feed([&expected]()
+    {
+        std::ofstream out("mapped_fifo", std::ios::binary);
+        out.write(reinterpret_cast<const char*>(expected.data()), static_cast<std::streamsize>(expected.size()));
+    });
+
+    try
+    {
+        MappedFile mapped("mapped_fifo");
+        feed.join();
+
+        const unsigned char* data = static_cast<const unsigned char*>(mapped.data());
+        if (mapped.isMapped() || std::vector<unsigned char>(data, data + mapped.size()) != expected)
+        {
+            std::cerr << "Read wrong content from a FIFO\n";
+            return true;
+        }
+
+        ArchiveReader reader(std::move(mapped));
+        if (printArchiveEntries(reader))
+        {
+            return true;
+        }
+    }
+    catch (const std::system_error& ex)
+    {
+        if (feed.joinable())
+        {
+            feed.join();
+        }
+
+        std::cerr << "Error reading a FIFO: " << ex.what() << '\n';
+        return true;
+    }
+
+    // Failures keep their own error
+    const std::pair<const char*, int> failures[] = {
+        std::make_pair("mapped_missing", ENOENT),
+        std::make_pair("test_data_dir", EISDIR)
+    };
+
+    for (const std::pair<const char*, int>& failure : failures)
+    {
+        try
+        {
+            MappedFile mapped(failure.first);
+            std::cerr << "Opened " << failure.first << '\n';
+            return true;
+        }
+        catch (const std::system_error& ex)
+        {
+            if (ex.code().value() != failure.second)
+            {
+                std::cerr << "Unexpected error for " << failure.first << ": " << ex.what() << '\n';
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool testArchiveReadAhead(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        // Tiny blocks so the ring wraps many times
+        ArchiveReader reader(path, ReadAheadOptions(64, 2));
+        return printArchiveEntries(reader);
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error reading archive with read-ahead: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testCompressDirectory(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        {
+            ArchiveWriter compressor(path, Format::PAX, Filter::Gzip);
+            compressor.addDiskPath("test_data_dir");
+        }
+
+        ArchiveReader reader(path);
+        return printArchiveEntries(reader);
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error writing archive from directory: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testExtractDirectory(const std::string& path)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        ArchiveReader reader(path);
+
+        std::string extractedPath("extracted_");
+        extractedPath += path;
+
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            if (!it->extractDisk(extractedPath))
+            {
+                std::cerr << "Error extracting directory\n";
+                return true;
+            }
+        }
+
+        return false;
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Exception extracting directory: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+static bool testMatch(const std::string& path, bool useCallback)
+{
+    PRINT_TEST_NAME();
+
+    try
+    {
+        std::vector<unsigned char> buf;
+
+        ArchiveMatch match;
+        match.excludePattern("foo*");
+
+        if (useCallback)
+        {
+            match.addCallback(
+                [](ArchiveEntry entry, void*) -> void
+            {
+                const char* uname = entry.uname();
+                const char* gname = entry.gname();
+
+                std::cout << "\nCallback: skipping path " << entry.pathname() << '\n'
+                          << " entry properties:\n"
+                          << "   ctime: " << entry.ctime() << '\n'
+                          << "   mtime: " << entry.mtime() << '\n'
+                          << "   size: " << entry.size() << '\n'
+                          << "   uname: " << (uname ? uname : "") << '\n'
+                          << "   gname: " << (gname ? gname : "") << '\n';
+            },
+            nullptr);
+        }
+
+        {
+            ArchiveWriter compressor(buf, Format::PAX, Filter::Gzip);
+            compressor.addDiskPath(path, &match);
+        }
+
+        ArchiveReader reader(std::move(buf));
+
+        for (auto it = reader.begin(); !it.isAtEnd(); ++it)
+        {
+            std::string entryName(it->pathname());
+
+            if (entryName.find("foo") != std::string::npos)
+            {
+                std::cerr << "File should have been excluded from archive";
+                return true;
+            }
+        }
+
+        return false;
+    }
+    catch (const std::runtime_error& ex)
+    {
+        std::cerr << "Error testing match: " << ex.what() << '\n';
+        return true;
+    }
+}
+
+int main()
+{
+    if (testCompressDirectory("test_data_dir.tar.gz"))
+    {
+        return 1;
+    }
+
+    if (testExtractDirectory("test_data_dir.tar.gz"))
+    {
+        return 1;
+    }
+
+    if (testDoesNotExist())
+    {
+        return 1;
+    }
+
+    if (testArchiveWriteFile("test_write_file.tar.gz"))
+    {
+        return 1;
     }
 
     if (testArchiveRead("test_write_file.tar.gz"))
@@ -473,6 +2691,21 @@ int main()
         return 1;
     }
 
+    if (testArchiveReadMapped("test_write_file.tar.gz"))
+    {
+        return 1;
+    }
+
+    if (testMappedFileFallback("test_write_file.tar.gz"))
+    {
+        return 1;
+    }
+
+    if (testArchiveReadAhead("test_write_file.tar.gz"))
+    {
+        return 1;
+    }
+
     if (testArchiveWriteMemory("test_write_memory.tar.gz"))
     {
         return 1;
@@ -503,5 +2736,120 @@ int main()
         return 1;
     }
 
+    if (testArchiveReadCallback())
+    {
+        return 1;
+    }
+
+    if (testArchivePushReader())
+    {
+        return 1;
+    }
+
+    if (testFormatHint())
+    {
+        return 1;
+    }
+
+    if (testSharedBuffer())
+    {
+        return 1;
+    }
+
+    if (testReaderPool())
+    {
+        return 1;
+    }
+
+    if (testWriterReset())
+    {
+        return 1;
+    }
+
+    if (testDataBlocks())
+    {
+        return 1;
+    }
+
+    if (testExtractTo())
+    {
+        return 1;
+    }
+
+    if (testAddFileRanges())
+    {
+        return 1;
+    }
+
+    if (testSegmentedBuffer())
+    {
+        return 1;
+    }
+
+    if (testFileIngest())
+    {
+        return 1;
+    }
+
+    if (testParallelWalk())
+    {
+        return 1;
+    }
+
+    if (testUserGroupCache())
+    {
+        return 1;
+    }
+
+    if (testParallelCompression())
+    {
+        return 1;
+    }
+
+    if (testCompressionOptions())
+    {
+        return 1;
+    }
+
+    if (testParallelZip())
+    {
+        return 1;
+    }
+
+    if (testConcurrentWriter())
+    {
+        return 1;
+    }
+
+    if (testArchiveStream())
+    {
+        return 1;
+    }
+
+    if (testExtractAll())
+    {
+        return 1;
+    }
+
+    if (testExtractParallel())
+    {
+        return 1;
+    }
+
+    if (testExtractIoUring())
+    {
+        return 1;
+    }
+
+    if (testCopyRangeTar())
+    {
+        return 1;
+    }
+
+    if (testSparseFiles())
+    {
+        return 1;
+    }
+
     return 0;
 }